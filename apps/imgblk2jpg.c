@@ -33,11 +33,12 @@
 
 static void usage(void) {
   fprintf(stderr,
-"yuyv2jpeg: Read one or more YUYV422-formatted (2 bytes/pixel) frames from   \n"
-"stdin and write them atomically to the specified JPEG file.                 \n"
+"imgblk2jpg: Read an ImgBlk file from stdin and write it atomically to the   \n"
+"specified JPEG file. The image size comes from the ImgBlk header; -h and -w \n"
+"are only needed for the old headerless format.                              \n"
 "                                                                            \n"
 "Usage:                                                                      \n"
-" yuyv2jpeg -h <px_height> -w <px_width> <jpeg_file>                         \n"
+" imgblk2jpg [-h <px_height> -w <px_width>] [-c <w>x<h>+<x>+<y>] <jpeg_file> \n"
 "                                                                            \n"
 "Option:          Description:                                               \n"
 "                                                                            \n"
@@ -47,6 +48,8 @@ static void usage(void) {
 "                                                                            \n"
 "  -q [1,2,3]     JPEG Filesize (1-smallest, 3-largest)                      \n"
 "                                                                            \n"
+"  -c [WxH+X+Y]   Only convert this region; X and W must be even. Only the   \n"
+"                 blocks it covers are read and decoded                      \n"
 "                                                                            \n");
 }
 
@@ -58,29 +61,35 @@ static void bail(const char *msg) {
 
 int main(int argc, char **argv)
 {
-  int       opt;
-  uint8_t   *yuyv, *rgb, *imgblk, *jpeg;
-  uint32_t  npix, h = 720, w = 1280, q = 3;
-  size_t    len;
+  int                   opt, sized = 0;
+  uint8_t              *rgb, *imgblk = NULL, *jpeg;
+  uint32_t              h = 720, w = 1280, q = 3;
+  uint32_t              cx = 0, cy = 0, cw = 0, ch = 0;
+  size_t                len;
+  struct stat           st;
+  struct imgblk_hdr     hdr;
+  struct imgblk_reader *rd = NULL;
 
   // Set stdin pipe size
   fcntl(STDIN_FILENO, F_SETPIPE_SZ, 4194304);
 
   // Parse command-line options
   opterr = 0;
-  while((opt = getopt(argc, argv, "h:w:q:")) != -1) {
+  while((opt = getopt(argc, argv, "h:w:q:c:")) != -1) {
     switch (opt) {
 
     case 'h':
       h = strtoul(optarg, NULL, 0);
       if (h < 1)
         bail("-h must be greater than 0");
+      sized = 1;
       break;
 
     case 'w':
       w = strtoul(optarg, NULL, 0);
       if (w < 1)
         bail("-w must be greater than 0");
+      sized = 1;
       break;
 
     case 'q':
@@ -89,6 +98,11 @@ int main(int argc, char **argv)
         bail("-q must be 1, 2, or 3");
       break;
 
+    case 'c':
+      if (4 != sscanf(optarg, "%ux%u+%u+%u", &cw, &ch, &cx, &cy) || !cw || !ch)
+        bail("-c must be <w>x<h>+<x>+<y>");
+      break;
+
     default:
       bail("Unknown argument");
     }
@@ -97,25 +111,52 @@ int main(int argc, char **argv)
   if ((argc - optind) != 1)
     bail("Must specify exactly one output file");
 
-  npix = h*w;
-
-  imgblk = file_read("/dev/stdin", &len);
-  if (len != (2*npix))
-    bail("incorrect number of input bytes");
-
-  // RGB uses 3 bytes per pixel
-  rgb = malloc(3*npix);
-  if (!rgb)
-    bail("Could not allocate memory!");
-
-  // convert to YUYV
-  yuyv = imgblk2yuyv(imgblk, w, h);
-  free(imgblk);
-
-  // Convert to RGB, then to JPEG
-  yuyv422_to_rgb24(rgb, yuyv, npix);
-  free(yuyv);
-  jpeg = rgb24_to_jpeg(rgb, w, h, q, &len);
+  if (cw) {
+    // A file on stdin is mapped, so that a region only reads its blocks
+    if (0 == fstat(STDIN_FILENO, &st) && S_ISREG(st.st_mode))
+      rd = imgblk_open("/dev/stdin", &hdr);
+    if (!rd) {
+      imgblk = file_read("/dev/stdin", &len);
+      if (!imgblk)
+        bail("Could not read input");
+      rd = imgblk_open_mem(imgblk, len, &hdr);
+    }
+    if (!rd)
+      bail("-c needs a complete ImgBlk file with a header");
+    if (sized && (hdr.w != w || hdr.h != h))
+      bail("-h and -w don't match the ImgBlk header");
+
+    rgb = malloc(3*(size_t)cw*ch);
+    if (!rgb)
+      bail("Could not allocate memory!");
+    if (!imgblk_read(rd, cx, cy, cw, ch, IMGBLK_FMT_RGB24, rgb, 3*(size_t)cw))
+      bail("Region is outside the image, or the ImgBlk file is corrupt");
+    imgblk_close(rd);
+    free(imgblk);
+
+    jpeg = rgb24_to_jpeg(rgb, cw, ch, q, &len);
+    free(rgb);
+  } else {
+    imgblk = file_read("/dev/stdin", &len);
+    if (!imgblk)
+      bail("Could not read input");
+
+    // Encode straight from the planes, trusting the header over -h and -w
+    if (imgblk_file_hdr(imgblk, len, &hdr)) {
+      if (sized && (hdr.w != w || hdr.h != h))
+        bail("-h and -w don't match the ImgBlk header");
+      jpeg = imgblk_file_to_jpeg(imgblk, len, q, &hdr, &len);
+    } else if (len >= 4 && !memcmp(imgblk, "IBLK", 4)) {
+      bail("Unsupported or truncated ImgBlk file");
+    } else {
+      if (len != 2*(size_t)h*w || w % 2)
+        bail("incorrect number of input bytes");
+      jpeg = imgblk2jpeg(imgblk, w, h, q, &len);
+    }
+    free(imgblk);
+  }
+  if (!jpeg)
+    bail("Could not convert to JPEG");
 
   // Write to disk
   if (0 > file_write_atomic(argv[optind], jpeg, len))
@@ -0,0 +1,99 @@
+// MIT License
+// Copyright (c) Tyler Graff 2018
+// tagraff@gmail.com
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "util.h"
+
+static void usage(void) {
+  fprintf(stderr,
+"jpg2yuyv: Read a JPEG or MJPEG frame from stdin, decode it and write it     \n"
+"atomically to the specified file as YUYV422, e.g. for yuyv2imgblk. Prints   \n"
+"the resolution of the image written, as <width> <height>.                   \n"
+"                                                                            \n"
+"Usage:                                                                      \n"
+" jpg2yuyv [-s <scale>] <yuyv_file>                                          \n"
+"                                                                            \n"
+"Option:          Description:                                               \n"
+"  -s [int]       Scale down by 1, 2, 4 or 8 while decoding (default 1)      \n"
+"                                                                            \n");
+}
+
+static void bail(const char *msg) {
+  fprintf(stderr, "\nERROR: %s\n\n", msg);
+  usage();
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+  int       opt;
+  uint8_t  *jpeg, *yuyv;
+  uint32_t  w, h, scale = 1;
+  size_t    len;
+
+  // Set stdin pipe size
+  fcntl(STDIN_FILENO, F_SETPIPE_SZ, 4194304);
+
+  // Parse command-line options
+  opterr = 0;
+  while((opt = getopt(argc, argv, "s:")) != -1) {
+    switch (opt) {
+
+    case 's':
+      scale = strtoul(optarg, NULL, 0);
+      if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+        bail("-s must be 1, 2, 4 or 8");
+      break;
+
+    default:
+      bail("Unknown argument");
+    }
+  }
+
+  if ((argc - optind) != 1)
+    bail("Must specify output file");
+
+  jpeg = file_read("/dev/stdin", &len);
+  if (!jpeg)
+    bail("Could not read input");
+
+  yuyv = jpeg_to_yuyv(jpeg, len, scale, &w, &h);
+  free(jpeg);
+  if (!yuyv)
+    bail("Input is not a JPEG that can be decoded");
+
+  if (0 > file_write_atomic(argv[optind], yuyv, 2*w*h))
+    fprintf(stderr, "Error writing to file: %s\n", argv[optind]);
+  else
+    printf("%u %u\n", w, h);
+
+  free(yuyv);
+  return 0;
+}
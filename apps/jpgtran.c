@@ -0,0 +1,120 @@
+// MIT License
+// Copyright (c) Tyler Graff 2018
+// tagraff@gmail.com
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "util.h"
+
+static void usage(void) {
+  fprintf(stderr,
+"jpgtran: Read a JPEG from stdin, crop, flip or rotate it losslessly and     \n"
+"write it atomically to the specified file. The image is not decoded, so no  \n"
+"quality is lost. Crop offsets are rounded down to whole 8 or 16px blocks.   \n"
+"                                                                            \n"
+"Usage:                                                                      \n"
+" jpgtran [-x <xform>] [-c <w>x<h>+<x>+<y>] <jpeg_file>                      \n"
+"                                                                            \n"
+"Options:                                                                    \n"
+" -x <xform>   flip-h, flip-v, transpose, transverse, rot90, rot180 or rot270\n"
+" -c <crop>    Crop region, applied before <xform>. A size of 0 extends the  \n"
+"              crop to the edge of the image                                 \n"
+"                                                                            \n");
+}
+
+static void bail(const char *msg) {
+  fprintf(stderr, "\nERROR: %s\n\n", msg);
+  usage();
+  exit(EXIT_FAILURE);
+}
+
+static const char *xforms[] = {
+  [JPEG_XFORM_FLIP_H]     = "flip-h",
+  [JPEG_XFORM_FLIP_V]     = "flip-v",
+  [JPEG_XFORM_TRANSPOSE]  = "transpose",
+  [JPEG_XFORM_TRANSVERSE] = "transverse",
+  [JPEG_XFORM_ROT90]      = "rot90",
+  [JPEG_XFORM_ROT180]     = "rot180",
+  [JPEG_XFORM_ROT270]     = "rot270",
+};
+
+int main(int argc, char **argv)
+{
+  int              opt;
+  unsigned         ii;
+  enum jpeg_xform  xform = JPEG_XFORM_NONE;
+  uint32_t         cx = 0, cy = 0, cw = 0, ch = 0;
+  uint8_t         *in, *out;
+  size_t           len;
+
+  // Set stdin pipe size
+  fcntl(STDIN_FILENO, F_SETPIPE_SZ, 4194304);
+
+  // Parse command-line options
+  opterr = 0;
+  while((opt = getopt(argc, argv, "x:c:")) != -1) {
+    switch (opt) {
+
+    case 'x':
+      for (ii = JPEG_XFORM_FLIP_H; ii <= JPEG_XFORM_ROT270; ii++)
+        if (!strcmp(optarg, xforms[ii]))
+          break;
+      if (ii > JPEG_XFORM_ROT270)
+        bail("Unknown transform");
+      xform = ii;
+      break;
+
+    case 'c':
+      if (4 != sscanf(optarg, "%ux%u+%u+%u", &cw, &ch, &cx, &cy))
+        bail("-c must be <w>x<h>+<x>+<y>");
+      break;
+
+    default:
+      bail("Unknown argument");
+    }
+  }
+
+  if ((argc - optind) != 1)
+    bail("Must specify output file");
+
+  in = file_read("/dev/stdin", &len);
+  if (!in)
+    bail("Could not read input");
+
+  out = jpeg_transform(in, len, xform, cx, cy, cw, ch, &len);
+  free(in);
+  if (!out)
+    bail("Input is not a JPEG that can be transformed");
+
+  if (0 > file_write_atomic(argv[optind], out, len))
+    fprintf(stderr, "Error writing to file: %s\n", argv[optind]);
+
+  free(out);
+  return 0;
+}
@@ -0,0 +1,77 @@
+// MIT License
+// Copyright (c) Tyler Graff 2018
+// tagraff@gmail.com
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "util.h"
+
+static void usage(void) {
+  fprintf(stderr,
+"mjpeg2jpg: Read one MJPEG frame from stdin and write it atomically to the   \n"
+"specified JPEG file, with the standard Huffman tables added if the frame has\n"
+"none. The frame is not re-encoded.                                          \n"
+"                                                                            \n"
+"Usage:                                                                      \n"
+" mjpeg2jpg <jpeg_file>                                                      \n"
+"                                                                            \n");
+}
+
+static void bail(const char *msg) {
+  fprintf(stderr, "\nERROR: %s\n\n", msg);
+  usage();
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+  int       opt;
+  uint8_t  *frame;
+  size_t    len;
+
+  // Set stdin pipe size
+  fcntl(STDIN_FILENO, F_SETPIPE_SZ, 4194304);
+
+  // Parse command-line options
+  opterr = 0;
+  while((opt = getopt(argc, argv, "")) != -1)
+    bail("Unknown argument");
+
+  if ((argc - optind) != 1)
+    bail("Must specify output file");
+
+  frame = file_read("/dev/stdin", &len);
+  if (!frame || !mjpeg_check(frame, len, NULL))
+    bail("Input is not a complete MJPEG frame");
+
+  if (0 > mjpeg_write_atomic(argv[optind], frame, len))
+    fprintf(stderr, "Error writing to file: %s\n", argv[optind]);
+
+  free(frame);
+  return 0;
+}
@@ -0,0 +1,178 @@
+// vrec
+//
+// MIT License
+// Copyright (c) Tyler Graff 2018
+// tagraff@gmail.com
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include "util.h"
+
+static void usage(void) {
+  fprintf(stderr,
+"vrec: Record frames of a fixed size from stdin into a ring of preallocated  \n"
+"segment files, <prefix>.0 to <prefix>.<n-1>, overwriting the oldest segment \n"
+"once they are all full. The disk space used is fixed when the ring is made. \n"
+"Each segment starts with an index of its frames and their timestamps; see   \n"
+"frame_ring_open in util.h.                                                  \n"
+"                                                                            \n"
+"Usage:                                                                      \n"
+" vrec -h <px_height> -w <px_width> <prefix>                                 \n"
+"                                                                            \n"
+"Option:          Description:                                               \n"
+"  -h [int]       Input YUYV image height in pixels                          \n"
+"  -w [int]       Input YUYV image width in pixels                           \n"
+"  -f [int]       Frame size in bytes, for other formats. Overrides -h and -w\n"
+"  -n [int]       Number of segments (default 8)                             \n"
+"  -s [int]       Segment size in MiB (default 1024)                         \n"
+"  -y [int]       Sync to disk every [y] frames; 0 only when a segment fills \n"
+"                 (default 30)                                               \n"
+"  -d             Write with O_DIRECT, bypassing the page cache              \n"
+"                                                                            \n");
+}
+
+static void bail(const char *msg) {
+  fprintf(stderr, "\nERROR: %s\n\n", msg);
+  usage();
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+  int                  opt, direct = 0, bad, failed = 0;
+  uint8_t             *frame;
+  uint32_t             h = 720, w = 1280, nseg = 8, sync_every = 30;
+  size_t               frame_len = 0, seg_len = 1024, slot, nframes;
+  struct timespec      now;
+  struct frame_reader *rd;
+  struct frame_ring   *fr;
+
+  // Set stdin pipe size
+  fcntl(STDIN_FILENO, F_SETPIPE_SZ, 4194304);
+
+  // Parse command-line options
+  opterr = 0;
+  while((opt = getopt(argc, argv, "h:w:f:n:s:y:d")) != -1) {
+    switch (opt) {
+
+    case 'h':
+      h = strtoul(optarg, NULL, 0);
+      if (h < 1)
+        bail("-h must be greater than 0");
+      break;
+
+    case 'w':
+      w = strtoul(optarg, NULL, 0);
+      if (w < 1)
+        bail("-w must be greater than 0");
+      break;
+
+    case 'f':
+      frame_len = strtoul(optarg, NULL, 0);
+      if (frame_len < 1)
+        bail("-f must be greater than 0");
+      break;
+
+    case 'n':
+      nseg = strtoul(optarg, NULL, 0);
+      if (nseg < 1)
+        bail("-n must be greater than 0");
+      break;
+
+    case 's':
+      seg_len = strtoul(optarg, NULL, 0);
+      if (seg_len < 1)
+        bail("-s must be greater than 0");
+      break;
+
+    case 'y':
+      sync_every = strtoul(optarg, NULL, 0);
+      break;
+
+    case 'd':
+      direct = 1;
+      break;
+
+    default:
+      bail("Unknown argument");
+    }
+  }
+
+  if ((argc - optind) != 1)
+    bail("Must specify exactly one segment file prefix");
+
+  if (!frame_len)
+    frame_len = 2*(size_t)h*w;
+  if (seg_len > SIZE_MAX >> 20)
+    bail("-s is too big");
+  seg_len <<= 20;
+  if (frame_len > seg_len)
+    bail("Frames are too big for the segments");
+
+  // Size the index for a segment full of frames. Each frame takes a slot of
+  // whole blocks, plus its entry in the index, which is padded to a block.
+  slot    = (frame_len + FRAME_RING_ALIGN - 1) / FRAME_RING_ALIGN * FRAME_RING_ALIGN;
+  nframes = (seg_len - FRAME_RING_HDR_LEN) / (slot + FRAME_RING_ENTRY);
+  while (nframes && nframes*slot + (FRAME_RING_HDR_LEN + nframes*FRAME_RING_ENTRY +
+                                    FRAME_RING_ALIGN - 1) / FRAME_RING_ALIGN *
+                                   FRAME_RING_ALIGN > seg_len)
+    nframes--;
+  if (!nframes)
+    bail("Frames are too big for the segments");
+  if (nframes > UINT32_MAX)
+    nframes = UINT32_MAX;
+
+  rd = frame_reader_open("/dev/stdin", frame_len);
+  if (!rd)
+    bail("Could not open input");
+
+  fr = frame_ring_open(argv[optind], nseg, seg_len, nframes, sync_every, direct);
+  if (!fr)
+    bail("Could not create the segment files");
+
+  while ((frame = frame_reader_next(rd))) {
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (frame_ring_write(fr, frame, frame_len,
+                         (uint64_t)now.tv_sec*1000000000 + now.tv_nsec)) {
+      perror("Error recording frame");
+      failed = 1;
+      break;
+    }
+  }
+
+  // A frame cut short means a wrong size, or truncated input
+  bad = frame_reader_error(rd);
+  frame_reader_close(rd);
+
+  if (frame_ring_close(fr))
+    bail("Could not sync the segment files");
+  if (bad)
+    bail("Incorrect input length");
+  if (failed)
+    return EXIT_FAILURE;
+
+  return 0;
+}
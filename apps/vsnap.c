@@ -0,0 +1,149 @@
+// MIT License
+// Copyright (c) Tyler Graff 2018
+// tagraff@gmail.com
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <linux/videodev2.h>
+
+#include "framecap.h"
+#include "util.h"
+
+static void usage(void) {
+  fprintf(stderr,
+"vsnap: Capture frames from a v4l2 device and write each one atomically to   \n"
+"the specified JPEG file, replacing the last. MJPEG frames are written as-is,\n"
+"with the standard Huffman tables added if missing. YUYV422 frames are       \n"
+"encoded.                                                                    \n"
+"                                                                            \n"
+"Usage:                                                                      \n"
+" vsnap [opts] <device> <jpeg_file>                                          \n"
+"                                                                            \n"
+"  Default options are: -t 1 -d 0 -q 3                                       \n"
+"                                                                            \n"
+"Option:          Description:                                               \n"
+"                                                                            \n"
+"  -t [int]       Write [t] Total frames and then exit.                      \n"
+"                 0 writes forever                                           \n"
+"                                                                            \n"
+"  -d [int]       After a frame is written, Discard the next [d] frames.     \n"
+"                                                                            \n"
+"  -q [1,2,3]     JPEG Filesize for YUYV frames (1-smallest, 3-largest)      \n"
+"                                                                            \n");
+}
+
+static void bail(const char *msg) {
+  fprintf(stderr, "\nERROR: %s\n\n", msg);
+  usage();
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+  Framecap *ctx;
+  int       opt;
+  uint8_t  *frame, *jpeg;
+  uint32_t  len, w, h, ffmt, q = 3;
+  uint64_t  ii, kk, total = 1, discard = 0;
+  size_t    jlen;
+
+  // Parse command-line options
+  opterr = 0;
+  while((opt = getopt(argc, argv, "t:d:q:")) != -1) {
+    switch (opt) {
+
+    case 't':
+      total = strtoul(optarg, NULL, 0);
+      if (total < 1)
+        total = -1;
+      break;
+
+    case 'd':
+      discard = strtoul(optarg, NULL, 0);
+      break;
+
+    case 'q':
+      q = strtoul(optarg, NULL, 0);
+      if (q < 1 || q > 3)
+        bail("-q must be 1, 2, or 3");
+      break;
+
+    default:
+      bail("Unknown argument");
+    }
+  }
+
+  if ((argc - optind) != 2)
+    bail("Must specify a device and an output file");
+
+  ctx = framecap_new(argv[optind], 2);
+  if (!ctx) {
+    fprintf(stderr, "Error opening: %s\n", argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+
+  for (ii = 0; ii < total; ii++) {
+
+    // throw away <discard> frames between written ones
+    for (kk = 0; ii && kk < discard; kk++)
+      framecap_done(ctx, framecap_next(ctx, &len, NULL, NULL, NULL));
+
+    frame = framecap_next(ctx, &len, &w, &h, &ffmt);
+    if (!frame)
+      break;
+
+    switch (ffmt) {
+
+    // Already a JPEG. Skip over corrupt frames
+    case V4L2_PIX_FMT_MJPEG:
+    case V4L2_PIX_FMT_JPEG:
+      if (0 > mjpeg_write_atomic(argv[optind+1], frame, len))
+        fprintf(stderr, "Skipping invalid MJPEG frame\n");
+      break;
+
+    case V4L2_PIX_FMT_YUYV:
+      if (len < 2*w*h) {
+        fprintf(stderr, "Skipping short YUYV frame\n");
+        break;
+      }
+      jpeg = yuyv422_to_jpeg(frame, w, h, q, &jlen);
+      if (!jpeg || 0 > file_write_atomic(argv[optind+1], jpeg, jlen))
+        fprintf(stderr, "Error writing to file: %s\n", argv[optind+1]);
+      free(jpeg);
+      break;
+
+    default:
+      framecap_done(ctx, frame);
+      framecap_free(ctx);
+      bail("Device must capture MJPEG or YUYV");
+    }
+
+    framecap_done(ctx, frame);
+  }
+
+  framecap_free(ctx);
+  return 0;
+}
@@ -31,16 +31,18 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #include "util.h"
 
 static void usage(void) {
   fprintf(stderr,
-"yuyv2jpeg: Read one or more YUYV422-formatted (2 bytes/pixel) frames from   \n"
-"stdin and write them atomically to the specified JPEG file.                 \n"
+"yuyv-util: Read one or more YUYV422-formatted (2 bytes/pixel) frames from   \n"
+"stdin, write each one atomically to the specified ImgBlk file, then convert \n"
+"it back and write that atomically to the specified JPEG file.               \n"
 "                                                                            \n"
 "Usage:                                                                      \n"
-" yuyv2jpeg -h <px_height> -w <px_width> <jpeg_file>                         \n"
+" yuyv-util -h <px_height> -w <px_width> <jpeg_file> <imgblk_file>           \n"
 "                                                                            \n"
 "Option:          Description:                                               \n"
 "                                                                            \n"
@@ -50,6 +52,11 @@ static void usage(void) {
 "                                                                            \n"
 "  -q [1,2,3]     JPEG Filesize (1-smallest, 3-largest)                      \n"
 "                                                                            \n"
+"  -k [int]       Append frames to the ImgBlk file as a stream instead, whole\n"
+"                 every k frames and otherwise only the blocks that changed  \n"
+"                                                                            \n"
+"  -d [int]       With -k, how much a block must change to be stored: the    \n"
+"                 sum of absolute differences of its samples. Default 0      \n"
 "                                                                            \n");
 }
 
@@ -61,17 +68,23 @@ static void bail(const char *msg) {
 
 int main(int argc, char **argv)
 {
-  int       opt;
-  uint8_t  *yuyv, *rgb, *imgblk, *jpeg;
-  uint32_t  npix, h = 720, w = 1280, q = 2;
-  size_t    len;
+  int                   opt, bad;
+  char                 *jpg_name, *blk_name;
+  uint8_t              *frame, *yuyv, *rgb, *imgblk, *jpeg;
+  uint32_t              npix, h = 720, w = 1280, q = 2, keyint = 0, thresh = 0;
+  size_t                len;
+  struct timespec       now;
+  struct imgblk_hdr     hdr;
+  struct imgblk_stream *st = NULL;
+  FILE                 *fp = NULL;
+  struct frame_reader  *fr;
 
   // Set stdin pipe size
   fcntl(STDIN_FILENO, F_SETPIPE_SZ, 4194304);
 
   // Parse command-line options
   opterr = 0;
-  while((opt = getopt(argc, argv, "h:w:q:")) != -1) {
+  while((opt = getopt(argc, argv, "h:w:q:k:d:")) != -1) {
     switch (opt) {
 
     case 'h':
@@ -82,8 +95,8 @@ int main(int argc, char **argv)
 
     case 'w':
       w = strtoul(optarg, NULL, 0);
-      if (w < 1)
-        bail("-w must be greater than 0");
+      if (w < 1 || w % 2)
+        bail("-w must be even and greater than 0");
       break;
 
     case 'q':
@@ -92,52 +105,105 @@ int main(int argc, char **argv)
         bail("-q must be 1, 2, or 3");
       break;
 
+    case 'k':
+      keyint = strtoul(optarg, NULL, 0);
+      if (keyint < 1)
+        bail("-k must be greater than 0");
+      break;
+
+    case 'd':
+      thresh = strtoul(optarg, NULL, 0);
+      break;
+
     default:
       bail("Unknown argument");
     }
   }
 
-  if ((argc - optind) < 1)
-    bail("Must specify output file");
+  if ((argc - optind) != 2)
+    bail("Must specify exactly one JPEG file and one ImgBlk file");
+  jpg_name = argv[optind];
+  blk_name = argv[optind+1];
 
   npix = h*w;
 
+  hdr.fourcc = IMGBLK_FOURCC_YUYV;
+  hdr.w      = w;
+  hdr.h      = h;
+  hdr.side   = 80;
+  hdr.quant  = IMGBLK_QUANT_MAG;
+  hdr.codec  = IMGBLK_CODEC_RAW;
+
+  if (keyint) {
+    st = imgblk_stream_new(&hdr, keyint, thresh);
+    fp = fopen(blk_name, "ab");
+    if (!st || !fp)
+      bail("Could not open ImgBlk stream");
+  }
+
   // RGB uses 3 bytes per pixel
   rgb = malloc(3*npix);
   if (!rgb)
     bail("Could not allocate memory!");
 
-  // Convert forever
-  for (;;) {
+  fr = frame_reader_open("/dev/stdin", 2*(size_t)npix);
+  if (!fr)
+    bail("Could not open input");
 
-    // read an entire yuyv frame
-    yuyv = file_read("/dev/stdin", &len);
-    if (len != (2*npix))
-      break;
+  // Convert forever, or until the input ends
+  while ((frame = frame_reader_next(fr))) {
 
     // convert to ImgBlk
-    imgblk = yuyv2imgblk(yuyv, w, h);
-    free(yuyv);
-
-    file_write_atomic(argv[argc-1], imgblk, len);
-
-    // convert back to YUYV
-    yuyv = imgblk2yuyv(imgblk, w, h);
-    free(imgblk);
+    clock_gettime(CLOCK_REALTIME, &now);
+    hdr.timestamp = (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
+    if (st) {
+      // append what changed, then take the frame back as the stream has it
+      imgblk = imgblk_stream_frame(st, frame, hdr.timestamp, &len);
+      if (!imgblk)
+        bail("Could not allocate memory!");
+      if (len != fwrite(imgblk, 1, len, fp) || fflush(fp))
+        fprintf(stderr, "Error writing to file: %s\n", blk_name);
+      imgblk_stream_last(st, frame);
+      free(imgblk);
+      yuyv = frame;
+    } else {
+      imgblk = yuyv_to_imgblk_file(frame, &hdr, &len);
+      if (!imgblk)
+        bail("Could not allocate memory!");
+
+      if (0 > file_write_atomic(blk_name, imgblk, len))
+        fprintf(stderr, "Error writing to file: %s\n", blk_name);
+
+      // convert back to YUYV
+      yuyv = imgblk_file_to_yuyv(imgblk, len, &hdr);
+      free(imgblk);
+      if (!yuyv)
+        bail("Could not allocate memory!");
+    }
 
     // Convert to RGB, then to JPEG
     yuyv422_to_rgb24(rgb, yuyv, npix);
     jpeg = rgb24_to_jpeg(rgb, w, h, q, &len);
 
     // Write to disk
-    if (0 > file_write_atomic(argv[argc-2], jpeg, len))
-      fprintf(stderr, "Error writing to file: %s\n", argv[argc-1]);
+    if (0 > file_write_atomic(jpg_name, jpeg, len))
+      fprintf(stderr, "Error writing to file: %s\n", jpg_name);
 
     free(jpeg);
-    free(yuyv);
+    if (yuyv != frame)
+      free(yuyv);
   }
 
-  free(yuyv);
+  // A frame cut short means a wrong size, or truncated input
+  bad = frame_reader_error(fr);
+  frame_reader_close(fr);
   free(rgb);
+  imgblk_stream_free(st);
+  if (fp)
+    fclose(fp);
+
+  if (bad)
+    bail("Incorrect input length");
+
   return 0;
 }
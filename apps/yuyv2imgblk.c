@@ -27,6 +27,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <errno.h>
+#include <time.h>
 #include "util.h"
 
 static void usage(void) {
@@ -36,7 +38,14 @@ static void usage(void) {
 "                                                                            \n"
 "Option:          Description:                                               \n"
 "  -h [int]       Input image height in pixels                               \n"
-"  -w [int]       Input image width in pixels                                \n"
+"  -w [int]       Input image width in pixels (even)                         \n"
+"  -b [int]       Block side in YUYV macropixels and rows: a multiple of 8,  \n"
+"                 e.g. 16, 32, 64 or 80 (default)                            \n"
+"  -l             Lossless: don't quantize the samples                       \n"
+"  -z [0-9]       Deflate each block at this zlib level                      \n"
+"  -t [int]       Threads to deflate with (default 1)                        \n"
+"  -r             Write the old headerless format: 80 macropixel blocks,     \n"
+"                 quantized                                                  \n"
 "                                                                            \n");
 }
 
@@ -46,16 +55,29 @@ static void bail(const char *msg) {
   exit(EXIT_FAILURE);
 }
 
+// A frame replaced before it was written isn't an error
+static void write_done(void *ctx, const char *fname, ssize_t len, int err) {
+  (void)ctx;
+  if (len < 0 && err != ECANCELED)
+    fprintf(stderr, "Error writing to file: %s\n", fname);
+}
+
 int main(int argc, char **argv)
 {
-  int       opt;
-  uint8_t  *yuyv, *imgblk;
-  uint32_t  npix, h = 720, w = 1280;
-  size_t    len;
+  int                  opt, raw = 0, level = -1, threads = 1, bad;
+  uint8_t             *yuyv, *imgblk;
+  uint32_t             npix, h = 720, w = 1280, side = 80;
+  size_t               len, nframes;
+  struct timespec      now;
+  struct imgblk_hdr    hdr;
+  struct frame_reader *fr;
+  struct file_writer  *fw = NULL;
+
+  hdr.quant = IMGBLK_QUANT_MAG;
 
   // Parse command-line options
   opterr = 0;
-  while((opt = getopt(argc, argv, "h:w:")) != -1) {
+  while((opt = getopt(argc, argv, "h:w:b:lz:t:r")) != -1) {
     switch (opt) {
 
     case 'h':
@@ -66,8 +88,34 @@ int main(int argc, char **argv)
 
     case 'w':
       w = strtoul(optarg, NULL, 0);
-      if (w < 1)
-        bail("-w must be greater than 0");
+      if (w < 1 || w % 2)
+        bail("-w must be even and greater than 0");
+      break;
+
+    case 'b':
+      side = strtoul(optarg, NULL, 0);
+      if (side < 8 || side > IMGBLK_MAX_SIDE || side % 8)
+        bail("-b must be a multiple of 8, up to 1024");
+      break;
+
+    case 'l':
+      hdr.quant = IMGBLK_QUANT_NONE;
+      break;
+
+    case 'z':
+      level = strtol(optarg, NULL, 0);
+      if (level < 0 || level > 9)
+        bail("-z must be 0 to 9");
+      break;
+
+    case 't':
+      threads = strtol(optarg, NULL, 0);
+      if (threads < 1)
+        bail("-t must be greater than 0");
+      break;
+
+    case 'r':
+      raw = 1;
       break;
 
     default:
@@ -78,18 +126,60 @@ int main(int argc, char **argv)
   if ((argc - optind) != 1)
     bail("Must specify exactly one output file");
 
+  if (raw && (side != 80 || hdr.quant != IMGBLK_QUANT_MAG || level >= 0))
+    bail("-r can't be used with -b, -l or -z");
+
   npix = h*w;
 
-  // read an entire yuyv frame
-  yuyv = file_read("/dev/stdin", &len);
-  if (len != (2*npix))
-      bail("Incorrect input length");
+  fr = frame_reader_open("/dev/stdin", 2*(size_t)npix);
+  if (!fr)
+    bail("Could not open input");
+
+  // Convert the next frame while the last one is written. -r converts in the
+  // reader's buffer, so it writes in line
+  if (!raw) {
+    fw = file_writer_open(1, 1);
+    if (!fw)
+      bail("Could not start the file writer");
+  }
+
+  hdr.fourcc = IMGBLK_FOURCC_YUYV;
+  hdr.w      = w;
+  hdr.h      = h;
+  hdr.side   = side;
+  hdr.codec  = level >= 0 ? IMGBLK_CODEC_DEFLATE : IMGBLK_CODEC_RAW;
+
+  // Each yuyv frame in turn replaces the ImgBlk file
+  for (nframes = 0; (yuyv = frame_reader_next(fr)); nframes++) {
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    // convert to ImgBlk
+    if (raw) {
+      // the frame is already the size of the ImgBlk
+      if (!yuyv2imgblk_inplace(yuyv, w, h))
+        bail("Could not convert to ImgBlk");
+      file_write_atomic(argv[argc-1], yuyv, 2*(size_t)npix);
+      continue;
+    }
+
+    hdr.timestamp = (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
+    imgblk = yuyv_to_imgblk_file_z(yuyv, &hdr, level, threads, &len);
+    if (!imgblk)
+      bail("Could not convert to ImgBlk");
+
+    if (0 > file_writer_submit(fw, argv[argc-1], imgblk, len, write_done, NULL)) {
+      fprintf(stderr, "Error writing to file: %s\n", argv[argc-1]);
+      free(imgblk);
+    }
+  }
+
+  file_writer_close(fw);
+  // A frame cut short means a wrong size, or truncated input
+  bad = !nframes || frame_reader_error(fr);
+  frame_reader_close(fr);
 
-  // convert to ImgBlk
-  imgblk = yuyv2imgblk(yuyv, w, h);
-  free(yuyv);
+  if (bad)
+    bail("Incorrect input length");
 
-  file_write_atomic(argv[argc-1], imgblk, len);
-  free(imgblk);
   return 0;
 }
@@ -29,6 +29,7 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <stdint.h>
+#include <errno.h>
 #include <sys/stat.h>
 
 //#include "framecap.h"
@@ -50,6 +51,13 @@ static void usage(void) {
 "                                                                            \n"
 "  -q [1,2,3]     JPEG Filesize (1-smallest, 3-largest)                      \n"
 "                                                                            \n"
+"  -Q [1-100]     JPEG quality on the usual libjpeg scale. Overrides -q      \n"
+"                                                                            \n"
+"  -b [int]       Maximum JPEG size in bytes. Lowers the quality to fit      \n"
+"                 (from -Q, or 100)                                          \n"
+"                                                                            \n"
+"  -g             Grayscale JPEG of the luma only. Faster, and smaller       \n"
+"                                                                            \n"
 "                                                                            \n");
 }
 
@@ -59,19 +67,29 @@ static void bail(const char *msg) {
   exit(EXIT_FAILURE);
 }
 
+// A frame replaced before it was written isn't an error
+static void write_done(void *ctx, const char *fname, ssize_t len, int err) {
+  (void)ctx;
+  if (len < 0 && err != ECANCELED)
+    fprintf(stderr, "Error writing to file: %s\n", fname);
+}
+
 int main(int argc, char **argv)
 {
-  int       opt;
-  uint8_t  *yuyv, *rgb, *jpeg;
-  uint32_t  npix, h = 720, w = 1280, q = 3;
-  size_t    len;
+  int                  opt, gray = 0, bad;
+  uint8_t             *yuyv, *pix, *jpeg;
+  uint32_t             npix, h = 720, w = 1280, q = 3, qq = 0;
+  size_t               len, max_len = 0, nframes;
+  struct frame_reader *fr;
+  struct file_writer  *fw;
+  struct jpeg_encoder *je = NULL;
 
   // Set stdin pipe size
   fcntl(STDIN_FILENO, F_SETPIPE_SZ, 4194304);
 
   // Parse command-line options
   opterr = 0;
-  while((opt = getopt(argc, argv, "h:w:q:")) != -1) {
+  while((opt = getopt(argc, argv, "h:w:q:Q:b:g")) != -1) {
     switch (opt) {
 
     case 'h':
@@ -92,6 +110,22 @@ int main(int argc, char **argv)
         bail("-q must be 1, 2, or 3");
       break;
 
+    case 'Q':
+      qq = strtoul(optarg, NULL, 0);
+      if (qq < 1 || qq > 100)
+        bail("-Q must be between 1 and 100");
+      break;
+
+    case 'b':
+      max_len = strtoul(optarg, NULL, 0);
+      if (max_len < 1)
+        bail("-b must be greater than 0");
+      break;
+
+    case 'g':
+      gray = 1;
+      break;
+
     default:
       bail("Unknown argument");
     }
@@ -102,26 +136,62 @@ int main(int argc, char **argv)
 
   npix = h*w;
 
-  // read an entire yuyv frame
-  yuyv = file_read("/dev/stdin", &len);
-  if (len != (2*npix))
-    bail("Incorrect input length");
+  fr = frame_reader_open("/dev/stdin", 2*(size_t)npix);
+  if (!fr)
+    bail("Could not open input");
 
-  // RGB uses 3 bytes per pixel
-  rgb = malloc(3*npix);
-  if (!rgb)
+  // RGB uses 3 bytes per pixel, gray 1
+  pix = malloc((gray ? 1 : 3)*npix);
+  if (!pix)
     bail("Could not allocate memory!");
 
-  // Convert to RGB, then to JPEG
-  yuyv422_to_rgb24(rgb, yuyv, npix);
-  free(yuyv);
-  jpeg = rgb24_to_jpeg(rgb, w, h, q, &len);
-  free(rgb);
+  // -Q and -b keep one encoder, so -b's size control learns from each frame
+  if (qq || max_len) {
+    je = jpeg_encoder_new(w, h, gray ? 1 : 3, qq ? qq : 100, max_len);
+    if (!je)
+      bail("Could not create the JPEG encoder");
+  }
 
-  // Write to disk
-  if (0 > file_write_atomic(argv[optind], jpeg, len))
-    fprintf(stderr, "Error writing to file: %s\n", argv[optind]);
+  // Encode the next frame while the last one is written
+  fw = file_writer_open(1, 1);
+  if (!fw)
+    bail("Could not start the file writer");
+
+  // Each yuyv frame in turn replaces the JPEG
+  for (nframes = 0; (yuyv = frame_reader_next(fr)); nframes++) {
+
+    // Convert to RGB or gray, then to JPEG
+    if (gray)
+      yuyv422_to_y8(pix, yuyv, npix);
+    else
+      yuyv422_to_rgb24(pix, yuyv, npix);
+
+    if (je)
+      jpeg = jpeg_encoder_encode(je, pix, &len);
+    else if (gray)
+      jpeg = y8_to_jpeg(pix, w, h, q, &len);
+    else
+      jpeg = rgb24_to_jpeg(pix, w, h, q, &len);
+
+    if (!jpeg)
+      bail("JPEG encoding failed");
+
+    // Write to disk
+    if (0 > file_writer_submit(fw, argv[optind], jpeg, len, write_done, NULL)) {
+      fprintf(stderr, "Error writing to file: %s\n", argv[optind]);
+      free(jpeg);
+    }
+  }
+
+  file_writer_close(fw);
+  jpeg_encoder_free(je);
+  free(pix);
+  // A frame cut short means a wrong size, or truncated input
+  bad = !nframes || frame_reader_error(fr);
+  frame_reader_close(fr);
+
+  if (bad)
+    bail("Incorrect input length");
 
-  free(jpeg);
   return 0;
 }
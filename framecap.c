@@ -209,7 +209,7 @@ uint8_t * framecap_next(Framecap *ctx,
   struct v4l2_format vfmt;
   struct timeval     timeout;
   fd_set fds;
-  int    r;
+  int    r = 0;
 
   FD_ZERO(&fds);
   FD_SET(ctx->fd, &fds);
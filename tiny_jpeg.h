@@ -105,7 +105,8 @@ extern "C"
 //  PARAMETERS
 //      dest_path:          filename to which we will write. e.g. "out.jpg"
 //      width, height:      image size in pixels
-//      num_components:     3 is RGB. 4 is RGBA. Those are the only supported values
+//      num_components:     1 is grayscale. 3 is RGB. 4 is RGBA. Those are the only
+//                          supported values
 //      src_data:           pointer to the pixel data.
 //
 //  RETURN:
@@ -128,7 +129,8 @@ int tje_encode_to_file(const char* dest_path,
 //                          2: Very good quality. About 1/2 the size of 3.
 //                          1: Noticeable. About 1/6 the size of 3, or 1/3 the size of 2.
 //      width, height:      image size in pixels
-//      num_components:     3 is RGB. 4 is RGBA. Those are the only supported values
+//      num_components:     1 is grayscale. 3 is RGB. 4 is RGBA. Those are the only
+//                          supported values
 //      src_data:           pointer to the pixel data.
 //
 //  RETURN:
@@ -159,6 +161,505 @@ int tje_encode_with_func(tje_write_func* func,
                          const int num_components,
                          const unsigned char* src_data);
 
+// - tje_encode_to_buffer -
+//
+// Usage
+//  Same as tje_encode_with_func, but the JPEG is written straight into `dest`,
+//  a caller-provided buffer of `dest_size` bytes. Nothing is allocated.
+//
+//  RETURN:
+//      Length of the JPEG in bytes. 0 on error, or if it did not fit in
+//      `dest`. A buffer of tje_encode_bound() bytes always fits.
+
+size_t tje_encode_to_buffer(unsigned char* dest,
+                            size_t dest_size,
+                            const int quality,
+                            const int width,
+                            const int height,
+                            const int num_components,
+                            const unsigned char* src_data);
+
+// - tje_encode_to_growable_buffer -
+//
+// Usage
+//  Same as tje_encode_to_buffer, but `*dest` is a malloc()ed buffer of
+//  `*dest_size` bytes (or NULL and 0) that is grown with realloc() only if
+//  the JPEG does not fit. `*dest` and `*dest_size` are updated when it grows,
+//  and the buffer remains owned by the caller, so it can be reused for the
+//  next image.
+//
+//  RETURN:
+//      Length of the JPEG in bytes. 0 on error.
+
+size_t tje_encode_to_growable_buffer(unsigned char** dest,
+                                     size_t* dest_size,
+                                     const int quality,
+                                     const int width,
+                                     const int height,
+                                     const int num_components,
+                                     const unsigned char* src_data);
+
+// - tje_encode_bound -
+//
+// Usage
+//  Returns the worst-case size in bytes of a JPEG of `width` x `height`
+//  pixels, at any quality and subsampling.
+
+size_t tje_encode_bound(const int width, const int height);
+
+// ============================================================
+// Planar encoder
+// ============================================================
+//
+// For sources that already hold YCbCr planes, e.g. ImgBlk files, so that
+// data units are loaded straight from them with no colour conversion.
+
+// Y, Cb and Cr planes, each `width` x `height` samples, with Cb and Cr
+// subsampled as in the JPEG, or NULL for grayscale. A plane is either rows
+// `stride` bytes apart, or cut into tiles of `tile_width` x `tile_height`
+// samples stored one after another, left to right then top to bottom, each
+// row after row. The tiles on the right and bottom edges are cut to fit.
+typedef struct
+{
+    const unsigned char* planes[3];
+    int                  width[3];
+    int                  height[3];
+    int                  stride[3];       // Untiled planes only.
+    int                  tile_width[3];   // Multiples of 8, or 0 if untiled.
+    int                  tile_height[3];
+} TJEPlanes;
+
+// - tje_encode_planes_to_growable_buffer -
+//
+// Usage
+//  Same as tje_encode_to_growable_buffer, for the planar YCbCr image `img`,
+//  which is the size of its plane 0.
+//
+//      subsampling:        one of TJE_SUBSAMPLING_*, matching the planes.
+//
+//  RETURN:
+//      Length of the JPEG in bytes. 0 on error, or if the planes don't match
+//      `subsampling`.
+
+size_t tje_encode_planes_to_growable_buffer(unsigned char** dest,
+                                            size_t* dest_size,
+                                            const int quality,
+                                            const int subsampling,
+                                            const TJEPlanes* img);
+
+// ============================================================
+// Row-push encoder
+// ============================================================
+//
+// For sources that are converted a strip at a time, e.g. from a camera's
+// YUYV buffer, so that the whole image never has to be in memory as RGB.
+
+typedef struct TJEStream TJEStream;
+
+// - tje_begin -
+//
+// Usage
+//  Starts a JPEG, writing its headers to `func`. The pixels are then given
+//  top to bottom with tje_push_rows, and the JPEG is finished by tje_end.
+//
+//  PARAMETERS
+//      func, context:      as tje_encode_with_func
+//      quality:            1, 2 or 3. See tje_encode_to_file_at_quality.
+//      width, height:      image size in pixels
+//      num_components:     1, 3 or 4. See tje_encoder_new.
+//      subsampling:        one of TJE_SUBSAMPLING_*. Ignored for grayscale.
+//
+//  RETURN:
+//      A new stream, or NULL on error.
+
+TJEStream* tje_begin(tje_write_func* func,
+                     void* context,
+                     const int quality,
+                     const int width,
+                     const int height,
+                     const int num_components,
+                     const int subsampling);
+
+// - tje_push_rows -
+//
+// Usage
+//  Adds the next `num_rows` rows of pixels, `width * num_components` bytes
+//  each. Every complete row of MCUs (8 pixel rows, 16 with 4:2:0) is encoded
+//  straight away. Rows that don't complete one are copied until the next
+//  push does, so pushing whole MCU rows, e.g. 16 at a time, avoids a copy.
+//
+//  RETURN:
+//      0 on error, e.g. more rows than the image has.
+
+int tje_push_rows(TJEStream* stream, const unsigned char* rows, const int num_rows);
+
+// - tje_end -
+//
+// Usage
+//  Finishes the JPEG and frees the stream.
+//
+//  RETURN:
+//      1 if all `height` rows were pushed and encoded. 0 on error.
+
+int tje_end(TJEStream* stream);
+
+// - tje_standard_dht -
+//
+// Usage
+//  Writes a DHT segment, marker included, with the four Annex K Huffman
+//  tables that tiny_jpeg uses by default. Motion-JPEG frames, e.g. from UVC
+//  cameras, usually leave out their DHT and rely on these tables.
+//
+//  RETURN:
+//      Bytes written, TJE_STANDARD_DHT_SIZE. 0 if `dest_size` is smaller.
+
+#define TJE_STANDARD_DHT_SIZE 420
+
+size_t tje_standard_dht(unsigned char* dest, size_t dest_size);
+
+// ============================================================
+// Reusable encoder
+// ============================================================
+//
+// Everything that only depends on the quality, image size and subsampling
+// (quantization and Huffman tables, the output buffer) is prepared once by
+// tje_encoder_new, so encoding a stream of same-sized frames does no set-up
+// and no allocations per frame. An encoder must only be used by one thread
+// at a time; use one per thread.
+
+// Chroma subsampling.
+enum
+{
+    TJE_SUBSAMPLING_444 = 0,  // Full resolution chroma.
+    TJE_SUBSAMPLING_422 = 1,  // Chroma at half the horizontal resolution.
+    TJE_SUBSAMPLING_420 = 2,  // Chroma at half the resolution both ways.
+};
+
+typedef struct TJEEncoder TJEEncoder;
+
+// - tje_encoder_new -
+//
+//  PARAMETERS
+//      quality:            1, 2 or 3. See tje_encode_to_file_at_quality.
+//      width, height:      image size in pixels
+//      num_components:     1 is grayscale. 3 is RGB. 4 is RGBA. Those are the only
+//                          supported values
+//      subsampling:        one of TJE_SUBSAMPLING_*. Ignored for grayscale.
+//
+//  RETURN:
+//      A new encoder, or NULL on error. Free with tje_encoder_free.
+
+TJEEncoder* tje_encoder_new(const int quality,
+                            const int width,
+                            const int height,
+                            const int num_components,
+                            const int subsampling);
+
+// - tje_encoder_encode -
+//
+// Usage
+//  Encodes `src_data`, an image of the size given to tje_encoder_new, and
+//  points *jpeg at the result. The JPEG lives in the encoder and is valid
+//  until the next call on it.
+//
+//  RETURN:
+//      Length of the JPEG in bytes. 0 on error.
+
+size_t tje_encoder_encode(TJEEncoder* encoder,
+                          const unsigned char* src_data,
+                          const unsigned char** jpeg);
+
+// - tje_encoder_encode_ladder -
+//
+// Usage
+//  Encodes `src_data` with each of `num_encoders` encoders, e.g. at several
+//  qualities, as tje_encoder_encode would, and with the same results. The
+//  colour conversion and the DCT are done once per block for all of them, so
+//  each extra JPEG only costs its quantization and entropy coding. The
+//  encoders must have the same image size, components, subsampling and
+//  restart interval, and no target size. With restart intervals, the rows are
+//  spread over the threads of encoders[0]; the others need at least as many.
+//  Optimized Huffman tables still take a pass per encoder.
+//
+//  PARAMETERS
+//      num_encoders:       1 to TJE_MAX_LADDER
+//      jpegs, sizes:       receive each encoder's JPEG, as tje_encoder_encode
+//
+//  RETURN:
+//      1 on success. 0 on error.
+
+#define TJE_MAX_LADDER 8
+
+int tje_encoder_encode_ladder(TJEEncoder* const encoders[],
+                              const int num_encoders,
+                              const unsigned char* src_data,
+                              const unsigned char* jpegs[],
+                              size_t sizes[]);
+
+// - tje_encoder_set_restart_interval -
+//
+// Usage
+//  Emits a restart marker every `mcu_rows` rows of MCUs (8 pixel rows, or
+//  16 with 4:2:0), or none if 0. The restart intervals don't depend on each
+//  other, so they are spread over `num_threads` threads, the calling thread
+//  included. The result is a standard baseline JPEG. Threads are only used
+//  if TJE_THREADS is defined along with TJE_IMPLEMENTATION.
+//
+//  RETURN:
+//      0 on error, e.g. if an interval would be longer than 65535 MCUs.
+
+int tje_encoder_set_restart_interval(TJEEncoder* encoder,
+                                     const int mcu_rows,
+                                     const int num_threads);
+
+// - tje_encoder_set_incremental -
+//
+// Usage
+//  For mostly static scenes. Ends every row of MCUs with a restart marker,
+//  and keeps each row's entropy-coded data along with a hash of its source
+//  pixels. Rows whose pixels hash the same as in the previous frame are then
+//  copied over instead of encoded again, as long as the quantization and
+//  Huffman tables are unchanged. The JPEGs are the same as with a restart
+//  interval of 1 on one thread, which this replaces. 0 turns it off, along
+//  with restart markers.
+//
+//  RETURN:
+//      0 if out of memory.
+
+int tje_encoder_set_incremental(TJEEncoder* encoder, const int enable);
+
+// - tje_encoder_set_quality -
+//
+// Usage
+//  Switches to the 1..100 quality scale of libjpeg (IJG): the Annex K tables
+//  are scaled by 5000/quality below 50 and by 200 - 2*quality above, so 50
+//  gives the spec tables and 100 all ones. Replaces the quality given to
+//  tje_encoder_new.
+//
+//  RETURN:
+//      0 if `quality` is out of range.
+
+int tje_encoder_set_quality(TJEEncoder* encoder, const int quality);
+
+// - tje_encoder_set_target_size -
+//
+// Usage
+//  Rate control. Each frame is encoded at the highest 1..100 quality, up to
+//  `max_quality`, whose JPEG should fit in `target_size` bytes, judged by
+//  quick trial encodes of every 8th row of MCUs. How far the trials were off
+//  is carried over to the next frame, so a steady stream costs a few trial
+//  rows per frame. Frames that still come out too big are re-encoded at a
+//  lower quality, unless they are already at quality 1. A `target_size` of 0
+//  turns rate control off and keeps the last quality.
+//
+//  RETURN:
+//      0 if `max_quality` is out of range.
+
+int tje_encoder_set_target_size(TJEEncoder* encoder,
+                                const size_t target_size,
+                                const int max_quality);
+
+// - tje_encoder_set_optimize_huffman -
+//
+// Usage
+//  Replaces the Annex K Huffman tables with tables built from the image's
+//  own statistics, which are typically 5-15% smaller. Building the tables
+//  takes an extra pass over the image (DCT and quantization, without the
+//  entropy coding). They are rebuilt every `interval` frames. With 1, every
+//  frame gets exact tables. With more, the tables from one frame are reused
+//  for the frames that follow, so they have a code for every symbol. 0 goes
+//  back to the Annex K tables.
+//
+//  RETURN:
+//      0 if `interval` is negative.
+
+int tje_encoder_set_optimize_huffman(TJEEncoder* encoder, const int interval);
+
+// - tje_encoder_get_quality -
+//
+// Usage
+//  Returns the 1..100 quality of the last frame, or the one set with
+//  tje_encoder_set_quality. 0 if still using the quality from tje_encoder_new.
+
+int tje_encoder_get_quality(const TJEEncoder* encoder);
+
+// Thumbnail modes.
+enum
+{
+    TJE_THUMBNAIL_NONE = 0,
+    TJE_THUMBNAIL_RAW  = 1,  // 1/8 scale Y, Cb and Cr planes.
+    TJE_THUMBNAIL_JPEG = 2,  // The same planes, also encoded as a JPEG.
+};
+
+// A frame at 1/8 scale, one pixel per 8x8 block. Plane 0 is luma, of the
+// image's size over 8, rounded up. Planes 1 and 2 are Cb and Cr, which are
+// subsampled like the image's and NULL for grayscale.
+typedef struct
+{
+    const unsigned char* planes[3];
+    int                  stride[3];  // Bytes between rows.
+    int                  width[3];
+    int                  height[3];
+    const unsigned char* jpeg;       // TJE_THUMBNAIL_JPEG only.
+    size_t               jpeg_size;
+} TJEThumbnail;
+
+// - tje_encoder_set_thumbnail -
+//
+// Usage
+//  With a `mode` other than TJE_THUMBNAIL_NONE, each frame also yields a
+//  thumbnail made of the DC coefficient of every block, which the DCT
+//  computes anyway. With TJE_THUMBNAIL_JPEG it is encoded too, at the same
+//  quality and subsampling as the frame, which costs about 1/64 of encoding
+//  the frame.
+//
+//  RETURN:
+//      0 on an invalid mode, or if out of memory.
+
+int tje_encoder_set_thumbnail(TJEEncoder* encoder, const int mode);
+
+// - tje_encoder_get_thumbnail -
+//
+// Usage
+//  Returns the thumbnail of the last frame encoded. It lives in the encoder
+//  and is valid until the next call on it. NULL when thumbnails are off.
+
+const TJEThumbnail* tje_encoder_get_thumbnail(const TJEEncoder* encoder);
+
+void tje_encoder_free(TJEEncoder* encoder);
+
+// ============================================================
+// Lossless transforms
+// ============================================================
+
+enum
+{
+    TJE_TRANSFORM_NONE = 0,     // Crop only.
+    TJE_TRANSFORM_FLIP_H,       // Mirror left to right.
+    TJE_TRANSFORM_FLIP_V,       // Upside down.
+    TJE_TRANSFORM_TRANSPOSE,    // Across the top-left to bottom-right diagonal.
+    TJE_TRANSFORM_TRANSVERSE,   // Across the top-right to bottom-left diagonal.
+    TJE_TRANSFORM_ROT_90,       // Clockwise.
+    TJE_TRANSFORM_ROT_180,
+    TJE_TRANSFORM_ROT_270,
+};
+
+// - tje_transform -
+//
+// Usage
+//  Crops, then flips or rotates, a baseline JPEG without decoding it to
+//  pixels: the quantized DCT coefficients of its blocks are moved around and
+//  entropy-coded again, so no quality is lost and it costs a fraction of
+//  decoding and re-encoding. Takes single-scan JPEGs with 1 or 3 components,
+//  chroma at 4:4:4, 4:2:2 or 4:2:0, such as tiny_jpeg's and those of most
+//  MJPEG cameras, which may leave out the Annex K Huffman tables. The result
+//  has Huffman tables optimized for it, and no restart markers or APPn
+//  segments other than JFIF.
+//
+//  The crop's top-left corner is rounded down to a whole MCU (8 or 16
+//  pixels). A crop_w or crop_h of 0 extends it to the edge. An edge that a
+//  flip would move onto the top or left has its partial MCU dropped, as
+//  jpegtran -trim does.
+//
+//  PARAMETERS
+//      dest, dest_size:    as tje_encode_to_growable_buffer
+//      transform:          one of TJE_TRANSFORM_*
+//
+//  RETURN:
+//      Length of the new JPEG in bytes. 0 on error, e.g. unsupported input.
+
+size_t tje_transform(unsigned char** dest,
+                     size_t* dest_size,
+                     const unsigned char* jpeg,
+                     const size_t jpeg_size,
+                     const int transform,
+                     const int crop_x,
+                     const int crop_y,
+                     const int crop_w,
+                     const int crop_h);
+
+// ============================================================
+// Decoder
+// ============================================================
+//
+// Decodes the JPEGs tje_transform takes, which include the frames of MJPEG
+// cameras, straight to YUYV 4:2:2 or to planar YCbCr, without going through
+// RGB. Optionally at 1/2, 1/4 or 1/8 of the size. Only 1/8 skips the inverse
+// DCT, using just the DC coefficients; 1/2 and 1/4 run the full inverse DCT
+// and box-average each 8x8 block down. At any size, a block with only a DC
+// coefficient skips it.
+//
+// The inverse DCT is the fast integer one of libjpeg (jidctfst), with SSE2
+// and NEON versions that give the same pixels as the plain C one.
+
+// Output formats.
+enum
+{
+    TJE_DECODE_YUYV = 0,    // Packed Y0 Cb Y1 Cr. Gray images get neutral chroma.
+    TJE_DECODE_PLANAR = 1,  // One plane per component, at its own resolution.
+};
+
+typedef struct
+{
+    int width;              // Of the decoded image, i.e. after scaling.
+    int height;
+    int num_components;     // 1 or 3.
+    int plane_width[3];     // Of each TJE_DECODE_PLANAR plane. 0 for the
+    int plane_height[3];    // chroma of gray images.
+} TJEImageInfo;
+
+typedef struct TJEDecoder TJEDecoder;
+
+// - tje_decoder_new -
+//
+//  RETURN:
+//      A new decoder, or NULL if out of memory. Free with tje_decoder_free.
+//      Reusing one for a stream of same-sized frames avoids allocations.
+
+TJEDecoder* tje_decoder_new(void);
+
+// - tje_decoder_parse -
+//
+// Usage
+//  Reads the headers of `jpeg`, up to its image data, and describes the
+//  decoded image in *info. `jpeg` must stay valid until tje_decoder_decode
+//  is done with it.
+//
+//  PARAMETERS
+//      scale:              1, 2, 4 or 8, to decode at 1/scale of the size.
+//                          Sizes round up.
+//
+//  RETURN:
+//      1, or 0 if the JPEG is invalid or unsupported.
+
+int tje_decoder_parse(TJEDecoder* decoder,
+                      const unsigned char* jpeg,
+                      const size_t jpeg_size,
+                      const int scale,
+                      TJEImageInfo* info);
+
+// - tje_decoder_decode -
+//
+// Usage
+//  Decodes the JPEG given to tje_decoder_parse.
+//
+//  PARAMETERS
+//      format:             one of TJE_DECODE_*
+//      planes, strides:    Destination of each plane, and its bytes per row.
+//                          YUYV has one plane, and rows of width rounded up
+//                          to even pixels, 2 bytes each. The last pixel of
+//                          an odd width is repeated.
+//
+//  RETURN:
+//      1, or 0 on corrupt data. The rows above the error are decoded.
+
+int tje_decoder_decode(TJEDecoder* decoder,
+                       const int format,
+                       unsigned char* const planes[],
+                       const int strides[]);
+
+void tje_decoder_free(TJEDecoder* decoder);
+
 #endif // TJE_HEADER_GUARD
 
 
@@ -172,29 +673,56 @@ int tje_encode_with_func(tje_write_func* func,
 #ifdef TJE_IMPLEMENTATION
 
 
-#define tjei_min(a, b) ((a) < b) ? (a) : (b);
-#define tjei_max(a, b) ((a) < b) ? (b) : (a);
+#define tjei_min(a, b) (((a) < (b)) ? (a) : (b))
+#define tjei_max(a, b) (((a) < (b)) ? (b) : (a))
 
 
 #if defined(_MSC_VER)
 #define TJEI_FORCE_INLINE __forceinline
 // #define TJEI_FORCE_INLINE __declspec(noinline)  // For profiling
+#elif defined(__GNUC__) || defined(__clang__)
+#define TJEI_FORCE_INLINE static inline __attribute__((always_inline))
 #else
-#define TJEI_FORCE_INLINE static // TODO: equivalent for gcc & clang
+#define TJEI_FORCE_INLINE static
 #endif
 
 // Only use zero for debugging and/or inspection.
 #define TJE_USE_FAST_DCT 1
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 // C std lib
 #include <assert.h>
 #include <inttypes.h>
 #include <math.h>   // floorf, ceilf
+#include <stddef.h> // offsetof
 #include <stdio.h>  // FILE, puts
+#include <stdlib.h> // malloc, realloc, free
 #include <string.h> // memcpy
 
+#ifdef TJE_THREADS
+#include <pthread.h>
+#endif
+
+#ifndef TJE_MALLOC
+#define TJE_MALLOC(size) malloc(size)
+#endif
+#ifndef TJE_REALLOC
+#define TJE_REALLOC(ptr, size) realloc(ptr, size)
+#endif
+#ifndef TJE_FREE
+#define TJE_FREE(ptr) free(ptr)
+#endif
+
 
-#define TJEI_BUFFER_SIZE 1024
+// Size of the output buffer handed to the write callback. Large enough that
+// the callback runs rarely, and that the entropy coder can check for room once
+// per block instead of once per byte.
+#define TJEI_BUFFER_SIZE (64 * 1024)
 
 #ifdef _WIN32
 
@@ -228,26 +756,103 @@ typedef struct
     tje_write_func* func;
 } TJEWriteContext;
 
+// Destination for tje_encode_to_buffer and tje_encode_to_growable_buffer.
+typedef struct
+{
+    uint8_t*        data;
+    size_t          size;
+    size_t          count;
+    int             growable;   // realloc() data when it fills up.
+    int             overflow;   // Ran out of room. The encode fails.
+} TJEBufferSink;
+
+// Where the encoded bytes go. Separate from TJEState so that several
+// outputs can share one set of tables.
+typedef struct
+{
+    // fwrite by default. User-defined when using tje_encode_with_func.
+    TJEWriteContext write_context;
+
+    // Set when encoding to memory. The entropy coder then writes straight
+    // into sink->data for as long as there is room.
+    TJEBufferSink*  sink;
+
+    // Buffered output. Big performance win when using the usual stdlib implementations.
+    // Points at `staging`, or at sink->data.
+    uint8_t*        output_buffer;
+    size_t          output_buffer_size;
+    size_t          output_buffer_count;
+    uint8_t         staging[TJEI_BUFFER_SIZE];
+} TJEOutput;
+
+#if TJE_USE_FAST_DCT
+struct TJEProcessedQT
+{
+    float chroma[64];
+    float luma[64];
+};
+#endif
+
 typedef struct
 {
     // Huffman data.
     uint8_t         ehuffsize[4][257];
     uint16_t        ehuffcode[4][256];
+    uint32_t        ehuff[4][256];  // (size << 16) | code, one load per symbol.
     uint8_t const * ht_bits[4];
     uint8_t const * ht_vals[4];
 
     // Cuantization tables.
     uint8_t         qt_luma[64];
     uint8_t         qt_chroma[64];
+#if TJE_USE_FAST_DCT
+    struct TJEProcessedQT pqt;  // Same, pre-scaled for the AAN DCT.
+#endif
 
-    // fwrite by default. User-defined when using tje_encode_with_func.
-    TJEWriteContext write_context;
+    // Luma blocks per MCU, horizontally and vertically. Chroma always has one.
+    int             h_samp;
+    int             v_samp;
 
-    // Buffered output. Big performance win when using the usual stdlib implementations.
-    size_t          output_buffer_count;
-    uint8_t         output_buffer[TJEI_BUFFER_SIZE];
+    // Restart interval, in MCU rows. 0 for none.
+    int             restart_rows;
+
+    // Outputs for encoding restart intervals in parallel with the main one.
+    struct TJESlice* slices;
+    int             num_slices;
+
+    // When set, the mean of each block is stored here, one byte per block,
+    // as Y, Cb and Cr planes with rows dc_stride[i] bytes apart.
+    uint8_t*        dc_planes[3];
+    int             dc_stride[3];
+
+    TJEOutput       output;
 } TJEState;
 
+// A run of restart intervals encoded into its own buffer, possibly on its own
+// thread, to be stitched into the main output afterwards.
+typedef struct TJESlice
+{
+    TJEOutput            output;
+    TJEBufferSink        sink;
+
+    // The states to encode for, with their outputs: the slice's own, or
+    // those of the matching slices of other encoders of a ladder.
+    const TJEState*      states[TJE_MAX_LADDER];
+    TJEOutput*           outputs[TJE_MAX_LADDER];
+    int                  num_states;
+    const unsigned char* src_data;
+    int                  width;
+    int                  height;
+    int                  src_num_components;
+    int                  mcu_row_begin;
+    int                  mcu_row_end;
+    int                  result;
+#ifdef TJE_THREADS
+    pthread_t            thread;
+    int                  running;
+#endif
+} TJESlice;
+
 // ============================================================
 // Table definitions.
 //
@@ -275,8 +880,7 @@ static const uint8_t tjei_default_qt_luma_from_spec[] =
    72,92,95,98,112,100,103, 99,
 };
 
-// Unused
-#if 0
+// Used for the 1..100 qualities. See tjei_set_scaled_qt.
 static const uint8_t tjei_default_qt_chroma_from_spec[] =
 {
     // K.1 - suggested chrominance QT
@@ -289,7 +893,6 @@ static const uint8_t tjei_default_qt_chroma_from_spec[] =
    99,99,99,99,99,99,99,99,
    99,99,99,99,99,99,99,99,
 };
-#endif
 
 static const uint8_t tjei_default_qt_chroma_from_paper[] =
 {
@@ -443,7 +1046,7 @@ typedef struct
     uint8_t          precision;             // Sample precision (bits per sample).
     uint16_t         height;
     uint16_t         width;
-    uint8_t          num_components;        // For this implementation, will be equal to 3.
+    uint8_t          num_components;        // 3, or 1 for grayscale.
     TJEComponentSpec component_spec[3];
 } TJEFrameHeader;
 
@@ -457,7 +1060,7 @@ typedef struct
 {
     uint16_t              SOS;
     uint16_t              len;
-    uint8_t               num_components;  // 3.
+    uint8_t               num_components;  // 3, or 1 for grayscale.
     TJEFrameComponentSpec component_spec[3];
     uint8_t               first;  // 0
     uint8_t               last;  // 63
@@ -466,41 +1069,114 @@ typedef struct
 #pragma pack(pop)
 
 
-static void tjei_write(TJEState* state, const void* data, size_t num_bytes, size_t num_elements)
+static void tjei_set_output(TJEOutput* out, uint8_t* buffer, size_t size)
 {
-    size_t to_write = num_bytes * num_elements;
+    out->output_buffer = buffer;
+    out->output_buffer_size = size;
+    out->output_buffer_count = 0;
+}
 
-    // Cap to the buffer available size and copy memory.
-    size_t capped_count = tjei_min(to_write, TJEI_BUFFER_SIZE - 1 - state->output_buffer_count);
+// Bytes written so far.
+static size_t tjei_output_count(const TJEOutput* out)
+{
+    if ( out->sink && out->output_buffer == out->sink->data ) {
+        return out->output_buffer_count;
+    }
+    return (out->sink ? out->sink->count : 0) + out->output_buffer_count;
+}
 
-    memcpy(state->output_buffer + state->output_buffer_count, data, capped_count);
-    state->output_buffer_count += capped_count;
+// Hand the buffered output to the user callback.
+static void tjei_flush_output(TJEOutput* out)
+{
+    if ( out->sink && out->output_buffer == out->sink->data ) {
+        // Already written in place.
+        out->sink->count = out->output_buffer_count;
+        return;
+    }
+    if (out->output_buffer_count) {
+        out->write_context.func(out->write_context.context, out->output_buffer, (int)out->output_buffer_count);
+        out->output_buffer_count = 0;
+    }
+}
 
-    assert (state->output_buffer_count <= TJEI_BUFFER_SIZE - 1);
+// Memory destination, used through the write callback once the encoder has
+// fallen back to the staging buffer.
+static void tjei_sink_func(void* context, void* data, int size)
+{
+    TJEBufferSink* sink = (TJEBufferSink*)context;
+    if ( sink->overflow || sink->size - sink->count < (size_t)size ) {
+        sink->overflow = 1;
+        return;
+    }
+    memcpy(sink->data + sink->count, data, (size_t)size);
+    sink->count += (size_t)size;
+}
 
-    // Flush the buffer.
-    if ( state->output_buffer_count == TJEI_BUFFER_SIZE - 1 ) {
-        state->write_context.func(state->write_context.context, state->output_buffer, (int)state->output_buffer_count);
-        state->output_buffer_count = 0;
+// Make room for at least `needed` more bytes in the output buffer.
+static void tjei_reserve(TJEOutput* out, size_t needed)
+{
+    TJEBufferSink* sink = out->sink;
+
+    if ( sink && out->output_buffer == sink->data ) {
+        size_t count = out->output_buffer_count;
+        if ( sink->growable ) {
+            size_t size = sink->size * 2;
+            if ( size < count + needed ) {
+                size = count + needed;
+            }
+            uint8_t* data = (uint8_t*)TJE_REALLOC(sink->data, size);
+            if ( data ) {
+                sink->data = data;
+                sink->size = size;
+                out->output_buffer = data;
+                out->output_buffer_size = size;
+                return;
+            }
+        }
+        // Not enough room left to write a whole block in place. Carry on
+        // through the staging buffer, whose contents are copied over only if
+        // they still fit.
+        sink->count = count;
+        tjei_set_output(out, out->staging, TJEI_BUFFER_SIZE);
+        return;
     }
+    tjei_flush_output(out);
+}
+
+static void tjei_write(TJEOutput* out, const void* data, size_t num_bytes, size_t num_elements)
+{
+    size_t to_write = num_bytes * num_elements;
+    const uint8_t* src = (const uint8_t*)data;
 
-    // Recursively calling ourselves with the rest of the buffer.
-    if (capped_count < to_write) {
-        tjei_write(state, (const uint8_t*)data+capped_count, to_write - capped_count, 1);
+    while (to_write) {
+        // Cap to the buffer available size and copy memory.
+        size_t capped_count = tjei_min(to_write, out->output_buffer_size - out->output_buffer_count);
+
+        memcpy(out->output_buffer + out->output_buffer_count, src, capped_count);
+        out->output_buffer_count += capped_count;
+        src      += capped_count;
+        to_write -= capped_count;
+
+        assert (out->output_buffer_count <= out->output_buffer_size);
+
+        // Flush the buffer.
+        if ( out->output_buffer_count == out->output_buffer_size ) {
+            tjei_reserve(out, to_write);
+        }
     }
 }
 
-static void tjei_write_DQT(TJEState* state, const uint8_t* matrix, uint8_t id)
+static void tjei_write_DQT(TJEOutput* out, const uint8_t* matrix, uint8_t id)
 {
     uint16_t DQT = tjei_be_word(0xffdb);
-    tjei_write(state, &DQT, sizeof(uint16_t), 1);
+    tjei_write(out, &DQT, sizeof(uint16_t), 1);
     uint16_t len = tjei_be_word(0x0043); // 2(len) + 1(id) + 64(matrix) = 67 = 0x43
-    tjei_write(state, &len, sizeof(uint16_t), 1);
+    tjei_write(out, &len, sizeof(uint16_t), 1);
     assert(id < 4);
     uint8_t precision_and_id = id;  // 0x0000 8 bits | 0x00id
-    tjei_write(state, &precision_and_id, sizeof(uint8_t), 1);
+    tjei_write(out, &precision_and_id, sizeof(uint8_t), 1);
     // Write matrix
-    tjei_write(state, matrix, 64*sizeof(uint8_t), 1);
+    tjei_write(out, matrix, 64*sizeof(uint8_t), 1);
 }
 
 typedef enum
@@ -509,7 +1185,7 @@ typedef enum
     TJEI_AC = 1
 } TJEHuffmanTableClass;
 
-static void tjei_write_DHT(TJEState* state,
+static void tjei_write_DHT(TJEOutput* out,
                            uint8_t const * matrix_len,
                            uint8_t const * matrix_val,
                            TJEHuffmanTableClass ht_class,
@@ -527,11 +1203,11 @@ static void tjei_write_DHT(TJEState* state,
     assert(id < 4);
     uint8_t tc_th = (uint8_t)((((uint8_t)ht_class) << 4) | id);
 
-    tjei_write(state, &DHT, sizeof(uint16_t), 1);
-    tjei_write(state, &len, sizeof(uint16_t), 1);
-    tjei_write(state, &tc_th, sizeof(uint8_t), 1);
-    tjei_write(state, matrix_len, sizeof(uint8_t), 16);
-    tjei_write(state, matrix_val, sizeof(uint8_t), (size_t)num_values);
+    tjei_write(out, &DHT, sizeof(uint16_t), 1);
+    tjei_write(out, &len, sizeof(uint16_t), 1);
+    tjei_write(out, &tc_th, sizeof(uint8_t), 1);
+    tjei_write(out, matrix_len, sizeof(uint8_t), 16);
+    tjei_write(out, matrix_val, sizeof(uint8_t), (size_t)num_values);
 }
 // ============================================================
 //  Huffman deflation code.
@@ -587,54 +1263,148 @@ static void tjei_huff_get_extended(uint8_t* out_ehuffsize,
 }
 // ============================================================
 
-// Returns:
-//  out[1] : number of bits
-//  out[0] : bits
-TJEI_FORCE_INLINE void tjei_calculate_variable_length_int(int value, uint16_t out[2])
+// Number of significant bits in v, for v > 0.
+TJEI_FORCE_INLINE uint32_t tjei_bit_count(uint32_t v)
 {
-    int abs_val = value;
-    if ( value < 0 ) {
-        abs_val = -abs_val;
-        --value;
+#if defined(__GNUC__) || defined(__clang__)
+    return 32 - (uint32_t)__builtin_clz(v);
+#else
+    uint32_t n = 0;
+    while ( v ) {
+        ++n;
+        v >>= 1;
     }
-    out[1] = 1;
-    while( abs_val >>= 1 ) {
-        ++out[1];
+    return n;
+#endif
+}
+
+// Index of the lowest set bit in v, for v > 0.
+TJEI_FORCE_INLINE int tjei_ctz64(uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(v);
+#else
+    int n = 0;
+    while ( !(v & 1) ) {
+        ++n;
+        v >>= 1;
     }
-    out[0] = (uint16_t)(value & ((1 << out[1]) - 1));
+    return n;
+#endif
 }
 
-// Write bits to file.
-TJEI_FORCE_INLINE void tjei_write_bits(TJEState* state,
-                                       uint32_t* bitbuffer, uint32_t* location,
-                                       uint16_t num_bits, uint16_t bits)
+// Returns the number of bits of the magnitude category of `value` (F.1.2.1)
+// and writes the additional bits that encode it to *bits.
+TJEI_FORCE_INLINE uint32_t tjei_calculate_variable_length_int(int value, uint32_t* bits)
 {
-    //   v-- location
-    //  [                     ]   <-- bit buffer
-    // 32                     0
-    //
-    // This call pushes to the bitbuffer and saves the location. Data is pushed
-    // from most significant to less significant.
-    // When we can write a full byte, we write a byte and shift.
-
-    // Push the stack.
-    uint32_t nloc = *location + num_bits;
-    *bitbuffer |= (uint32_t)(bits << (32 - nloc));
-    *location = nloc;
-    while ( *location >= 8 ) {
-        // Grab the most significant byte.
-        uint8_t c = (uint8_t)((*bitbuffer) >> 24);
-        // Write it to file.
-        tjei_write(state, &c, 1, 1);
-        if ( c == 0xff )  {
+    int sign = -(value < 0);
+    uint32_t abs_val = (uint32_t)((value ^ sign) - sign);
+    uint32_t num_bits = abs_val ? tjei_bit_count(abs_val) : 0;
+    *bits = (uint32_t)(value + sign) & ((1u << num_bits) - 1);
+    return num_bits;
+}
+
+// ============================================================
+//  Bit writer.
+//
+//  Bits are pushed most significant first into a 64-bit accumulator, which is
+//  written to the output buffer a whole word at a time. Only words that
+//  contain a 0xff byte take the slow path, since every 0xff in entropy-coded
+//  data has to be followed by a stuffed zero byte (B.1.1.5).
+//
+//  Callers make sure there is room for a block's worth of output before
+//  encoding it (see TJEI_MAX_BLOCK_BYTES), so writes are not bounds-checked.
+// ============================================================
+
+typedef struct
+{
+    uint64_t put_buffer;  // Pending bits, right-aligned.
+    int      free_bits;   // Bits still unused in put_buffer.
+} TJEBitWriter;
+
+// Worst case for one 8x8 block: 64 symbols of at most 16 code bits plus 11
+// amplitude bits, every byte stuffed, plus a word left over in the accumulator.
+#define TJEI_MAX_BLOCK_BYTES (2 * (64 * 27 / 8) + 2 * 8)
+
+// Non-zero when any byte of x is 0xff, i.e. when ~x has a zero byte.
+#define TJEI_HAS_FF_BYTE(x) ((~(x) - 0x0101010101010101ULL) & (x) & 0x8080808080808080ULL)
+
+static void tjei_bit_writer_init(TJEBitWriter* bw)
+{
+    bw->put_buffer = 0;
+    bw->free_bits = 64;
+}
+
+TJEI_FORCE_INLINE void tjei_write_word(TJEOutput* out, uint64_t word)
+{
+    uint8_t* dst = out->output_buffer + out->output_buffer_count;
+
+    if ( !TJEI_HAS_FF_BYTE(word) ) {
+        dst[0] = (uint8_t)(word >> 56);
+        dst[1] = (uint8_t)(word >> 48);
+        dst[2] = (uint8_t)(word >> 40);
+        dst[3] = (uint8_t)(word >> 32);
+        dst[4] = (uint8_t)(word >> 24);
+        dst[5] = (uint8_t)(word >> 16);
+        dst[6] = (uint8_t)(word >> 8);
+        dst[7] = (uint8_t)(word);
+        out->output_buffer_count += 8;
+        return;
+    }
+
+    size_t n = 0;
+    for ( int shift = 56; shift >= 0; shift -= 8 ) {
+        uint8_t c = (uint8_t)(word >> shift);
+        dst[n++] = c;
+        if ( c == 0xff ) {
             // Special case: tell JPEG this is not a marker.
-            char z = 0;
-            tjei_write(state, &z, 1, 1);
+            dst[n++] = 0;
+        }
+    }
+    out->output_buffer_count += n;
+}
+
+// Push the num_bits low bits of `bits`. num_bits must be at most 32.
+TJEI_FORCE_INLINE void tjei_write_bits(TJEOutput* out, TJEBitWriter* bw,
+                                       uint32_t bits, int num_bits)
+{
+    bw->free_bits -= num_bits;
+    if ( bw->free_bits >= 0 ) {
+        bw->put_buffer = (bw->put_buffer << num_bits) | bits;
+    } else {
+        // Top off the accumulator, write it out, and keep the spilled bits.
+        int spill = -bw->free_bits;
+        tjei_write_word(out, (bw->put_buffer << (num_bits - spill)) | (bits >> spill));
+        // Bits above the spilled ones have been written and will shift out.
+        bw->put_buffer = bits;
+        bw->free_bits += 64;
+    }
+}
+
+// Write out all pending bits, padding the last byte with zeros.
+static void tjei_flush_bits(TJEOutput* out, TJEBitWriter* bw)
+{
+    int num_bits = 64 - bw->free_bits;
+    if ( num_bits & 7 ) {
+        tjei_write_bits(out, bw, 0, 8 - (num_bits & 7));
+        num_bits = 64 - bw->free_bits;
+    }
+    if ( bw->free_bits == 0 ) {
+        // The padding completed a word, which tjei_write_bits holds on to.
+        tjei_write_word(out, bw->put_buffer);
+        num_bits = 0;
+    }
+    uint8_t* dst = out->output_buffer + out->output_buffer_count;
+    size_t n = 0;
+    for ( int shift = num_bits - 8; shift >= 0; shift -= 8 ) {
+        uint8_t c = (uint8_t)(bw->put_buffer >> shift);
+        dst[n++] = c;
+        if ( c == 0xff ) {
+            dst[n++] = 0;
         }
-        // Pop the stack.
-        *bitbuffer <<= 8;
-        *location -= 8;
     }
+    out->output_buffer_count += n;
+    tjei_bit_writer_init(bw);
 }
 
 // DCT implementation by Thomas G. Lane.
@@ -757,7 +1527,7 @@ static void tjei_fdct (float * data)
     }
 }
 #if !TJE_USE_FAST_DCT
-static float slow_fdct(int u, int v, float* data)
+static float slow_fdct(int u, int v, const float* data)
 {
 #define kPI 3.14159265f
     float res = 0.0f;
@@ -778,26 +1548,35 @@ static float slow_fdct(int u, int v, float* data)
 
 #define ABS(x) ((x) < 0 ? -(x) : (x))
 
-static void tjei_encode_and_write_MCU(TJEState* state,
-                                      float* mcu,
+// Forward DCT of a block. Returns the mean of the block, which is the DC
+// coefficient over 8.
+TJEI_FORCE_INLINE float tjei_transform_block(const float* mcu, float dct_mcu[64])
+{
+#if TJE_USE_FAST_DCT
+    memcpy(dct_mcu, mcu, 64 * sizeof(float));
+    tjei_fdct(dct_mcu);
+    // The AAN DCT leaves out a factor of 8.
+    return dct_mcu[0] / 64;
+#else
+    for ( int v = 0; v < 8; ++v ) {
+        for ( int u = 0; u < 8; ++u ) {
+            dct_mcu[v * 8 + u] = slow_fdct(u, v, mcu);
+        }
+    }
+    return dct_mcu[0] / 8;
+#endif
+}
+
+// Quantizes a transformed block into data unit `du`, in zig-zag order.
+TJEI_FORCE_INLINE void tjei_quantize_dct(const float dct_mcu[64],
 #if TJE_USE_FAST_DCT
-                                      float* qt,  // Pre-processed quantization matrix.
+                                         float const * qt,  // Pre-processed quantization matrix.
 #else
-                                      uint8_t* qt,
+                                         uint8_t const * qt,
 #endif
-                                      uint8_t* huff_dc_len, uint16_t* huff_dc_code, // Huffman tables
-                                      uint8_t* huff_ac_len, uint16_t* huff_ac_code,
-                                      int* pred,  // Previous DC coefficient
-                                      uint32_t* bitbuffer,  // Bitstack.
-                                      uint32_t* location)
+                                         int du[64])
 {
-    int du[64];  // Data unit in zig-zag order
-
-    float dct_mcu[64];
-    memcpy(dct_mcu, mcu, 64 * sizeof(float));
-
 #if TJE_USE_FAST_DCT
-    tjei_fdct(dct_mcu);
     for ( int i = 0; i < 64; ++i ) {
         float fval = dct_mcu[i];
         fval *= qt[i];
@@ -811,76 +1590,138 @@ static void tjei_encode_and_write_MCU(TJEState* state,
         du[tjei_zig_zag[i]] = val;
     }
 #else
-    for ( int v = 0; v < 8; ++v ) {
-        for ( int u = 0; u < 8; ++u ) {
-            dct_mcu[v * 8 + u] = slow_fdct(u, v, mcu);
-        }
-    }
     for ( int i = 0; i < 64; ++i ) {
         float fval = dct_mcu[i] / (qt[i]);
         int val = (int)((fval > 0) ? floorf(fval + 0.5f) : ceilf(fval - 0.5f));
         du[tjei_zig_zag[i]] = val;
     }
 #endif
+}
+
+// Transforms and quantizes a block into data unit `du`, in zig-zag order.
+TJEI_FORCE_INLINE void tjei_quantize_block(const float* mcu,
+#if TJE_USE_FAST_DCT
+                                           float const * qt,  // Pre-processed quantization matrix.
+#else
+                                           uint8_t const * qt,
+#endif
+                                           int du[64])
+{
+    float dct_mcu[64];
+    tjei_transform_block(mcu, dct_mcu);
+    tjei_quantize_dct(dct_mcu, qt, du);
+}
+
+// Entropy-codes data unit `du`, in zig-zag order.
+TJEI_FORCE_INLINE void tjei_write_du(TJEOutput* out,
+                                     const int du[64],
+                                     uint32_t const * huff_dc, // Huffman tables
+                                     uint32_t const * huff_ac,
+                                     int* pred,  // Previous DC coefficient
+                                     TJEBitWriter* writer)
+{
+    // Make sure the whole block fits before writing without bounds checks.
+    if ( out->output_buffer_size - out->output_buffer_count < TJEI_MAX_BLOCK_BYTES ) {
+        tjei_reserve(out, TJEI_MAX_BLOCK_BYTES);
+    }
 
-    uint16_t vli[2];
+    TJEBitWriter bw = *writer;
+    uint32_t bits, num_bits, sym;
 
     // Encode DC coefficient.
     int diff = du[0] - *pred;
     *pred = du[0];
-    if ( diff != 0 ) {
-        tjei_calculate_variable_length_int(diff, vli);
-        // Write number of bits with Huffman coding
-        tjei_write_bits(state, bitbuffer, location, huff_dc_len[vli[1]], huff_dc_code[vli[1]]);
-        // Write the bits.
-        tjei_write_bits(state, bitbuffer, location, vli[1], vli[0]);
-    } else {
-        tjei_write_bits(state, bitbuffer, location, huff_dc_len[0], huff_dc_code[0]);
-    }
+    // Write number of bits with Huffman coding, followed by the bits.
+    num_bits = tjei_calculate_variable_length_int(diff, &bits);
+    sym = huff_dc[num_bits];
+    tjei_write_bits(out, &bw, ((sym & 0xffff) << num_bits) | bits, (int)((sym >> 16) + num_bits));
 
     // ==== Encode AC coefficients ====
 
-    int last_non_zero_i = 0;
-    // Find the last non-zero element.
-    for ( int i = 63; i > 0; --i ) {
-        if (du[i] != 0) {
-            last_non_zero_i = i;
-            break;
-        }
+    // One bit per non-zero coefficient, so runs of zeros are skipped at once.
+    uint64_t non_zero = 0;
+    for ( int i = 1; i < 64; ++i ) {
+        non_zero |= (uint64_t)(du[i] != 0) << i;
     }
 
-    for ( int i = 1; i <= last_non_zero_i; ++i ) {
-        // If zero, increase count. If >=15, encode (FF,00)
-        int zero_count = 0;
-        while ( du[i] == 0 ) {
-            ++zero_count;
-            ++i;
-            if (zero_count == 16) {
-                // encode (ff,00) == 0xf0
-                tjei_write_bits(state, bitbuffer, location, huff_ac_len[0xf0], huff_ac_code[0xf0]);
-                zero_count = 0;
-            }
+    int last_i = 0;
+    while ( non_zero ) {
+        int i = tjei_ctz64(non_zero);
+        non_zero &= non_zero - 1;
+
+        // If >15 zeros precede the coefficient, encode (ff,00) == 0xf0
+        int zero_count = i - last_i - 1;
+        while ( zero_count >= 16 ) {
+            tjei_write_bits(out, &bw, huff_ac[0xf0] & 0xffff, (int)(huff_ac[0xf0] >> 16));
+            zero_count -= 16;
         }
-        tjei_calculate_variable_length_int(du[i], vli);
+        num_bits = tjei_calculate_variable_length_int(du[i], &bits);
 
-        assert(zero_count < 0x10);
-        assert(vli[1] <= 10);
+        assert(num_bits <= 10);
 
-        uint16_t sym1 = (uint16_t)((uint16_t)zero_count << 4) | vli[1];
+        sym = huff_ac[((uint32_t)zero_count << 4) | num_bits];
 
-        assert(huff_ac_len[sym1] != 0);
+        assert((sym >> 16) != 0);
 
-        // Write symbol 1  --- (RUNLENGTH, SIZE)
-        tjei_write_bits(state, bitbuffer, location, huff_ac_len[sym1], huff_ac_code[sym1]);
-        // Write symbol 2  --- (AMPLITUDE)
-        tjei_write_bits(state, bitbuffer, location, vli[1], vli[0]);
+        // Write symbol 1 --- (RUNLENGTH, SIZE) and symbol 2 --- (AMPLITUDE)
+        // with a single push.
+        tjei_write_bits(out, &bw, ((sym & 0xffff) << num_bits) | bits, (int)((sym >> 16) + num_bits));
+        last_i = i;
     }
 
-    if (last_non_zero_i != 63) {
+    if (last_i != 63) {
         // write EOB HUFF(00,00)
-        tjei_write_bits(state, bitbuffer, location, huff_ac_len[0], huff_ac_code[0]);
+        tjei_write_bits(out, &bw, huff_ac[0] & 0xffff, (int)(huff_ac[0] >> 16));
+    }
+
+    *writer = bw;
+}
+
+// Quantizes and entropy-codes a block transformed by tjei_transform_block.
+static void tjei_encode_and_write_MCU(TJEOutput* out,
+                                      const float* dct_mcu,
+#if TJE_USE_FAST_DCT
+                                      float const * qt,  // Pre-processed quantization matrix.
+#else
+                                      uint8_t const * qt,
+#endif
+                                      uint32_t const * huff_dc, // Huffman tables
+                                      uint32_t const * huff_ac,
+                                      int* pred,  // Previous DC coefficient
+                                      TJEBitWriter* writer)
+{
+    int du[64];  // Data unit in zig-zag order
+
+    tjei_quantize_dct(dct_mcu, qt, du);
+    tjei_write_du(out, du, huff_dc, huff_ac, pred, writer);
+}
+
+// Counts the Huffman symbols tjei_encode_and_write_MCU would write for `du`.
+static void tjei_count_MCU(const int du[64], int* pred, uint32_t* freq_dc, uint32_t* freq_ac)
+{
+    uint32_t bits;
+
+    int diff = du[0] - *pred;
+    *pred = du[0];
+    freq_dc[tjei_calculate_variable_length_int(diff, &bits)]++;
+
+    int last_i = 0;
+    for ( int i = 1; i < 64; ++i ) {
+        if ( du[i] == 0 ) {
+            continue;
+        }
+        int zero_count = i - last_i - 1;
+        while ( zero_count >= 16 ) {
+            freq_ac[0xf0]++;
+            zero_count -= 16;
+        }
+        freq_ac[((uint32_t)zero_count << 4) | tjei_calculate_variable_length_int(du[i], &bits)]++;
+        last_i = i;
+    }
+
+    if ( last_i != 63 ) {
+        freq_ac[0]++;  // EOB
     }
-    return;
 }
 
 enum {
@@ -890,28 +1731,12 @@ enum {
     TJEI_CHROMA_AC,
 };
 
-#if TJE_USE_FAST_DCT
-struct TJEProcessedQT
-{
-    float chroma[64];
-    float luma[64];
-};
-#endif
-
-// Set up huffman tables in state.
-static void tjei_huff_expand(TJEState* state)
+// Expands the tables in ht_bits and ht_vals into the encoding tables.
+static void tjei_huff_build(TJEState* state)
 {
-    assert(state);
-
-    state->ht_bits[TJEI_LUMA_DC]   = tjei_default_ht_luma_dc_len;
-    state->ht_bits[TJEI_LUMA_AC]   = tjei_default_ht_luma_ac_len;
-    state->ht_bits[TJEI_CHROMA_DC] = tjei_default_ht_chroma_dc_len;
-    state->ht_bits[TJEI_CHROMA_AC] = tjei_default_ht_chroma_ac_len;
-
-    state->ht_vals[TJEI_LUMA_DC]   = tjei_default_ht_luma_dc;
-    state->ht_vals[TJEI_LUMA_AC]   = tjei_default_ht_luma_ac;
-    state->ht_vals[TJEI_CHROMA_DC] = tjei_default_ht_chroma_dc;
-    state->ht_vals[TJEI_CHROMA_AC] = tjei_default_ht_chroma_ac;
+    // Symbols a table doesn't have must not keep codes from the last one.
+    memset(state->ehuffsize, 0, sizeof(state->ehuffsize));
+    memset(state->ehuffcode, 0, sizeof(state->ehuffcode));
 
     // How many codes in total for each of LUMA_(DC|AC) and CHROMA_(DC|AC)
     int32_t spec_tables_len[4] = { 0 };
@@ -937,25 +1762,130 @@ static void tjei_huff_expand(TJEState* state)
                                state->ht_vals[i],
                                &huffsize[i][0],
                                &huffcode[i][0], count);
+        for ( int k = 0; k < 256; ++k ) {
+            state->ehuff[i][k] = ((uint32_t)state->ehuffsize[i][k] << 16) | state->ehuffcode[i][k];
+        }
     }
 }
 
-static int tjei_encode_main(TJEState* state,
-                            const unsigned char* src_data,
-                            const int width,
-                            const int height,
-                            const int src_num_components)
+// Set up huffman tables in state.
+static void tjei_huff_expand(TJEState* state)
 {
-    if (src_num_components != 3 && src_num_components != 4) {
-        return 0;
+    assert(state);
+
+    state->ht_bits[TJEI_LUMA_DC]   = tjei_default_ht_luma_dc_len;
+    state->ht_bits[TJEI_LUMA_AC]   = tjei_default_ht_luma_ac_len;
+    state->ht_bits[TJEI_CHROMA_DC] = tjei_default_ht_chroma_dc_len;
+    state->ht_bits[TJEI_CHROMA_AC] = tjei_default_ht_chroma_ac_len;
+
+    state->ht_vals[TJEI_LUMA_DC]   = tjei_default_ht_luma_dc;
+    state->ht_vals[TJEI_LUMA_AC]   = tjei_default_ht_luma_ac;
+    state->ht_vals[TJEI_CHROMA_DC] = tjei_default_ht_chroma_dc;
+    state->ht_vals[TJEI_CHROMA_AC] = tjei_default_ht_chroma_ac;
+
+    tjei_huff_build(state);
+}
+
+// Builds an optimal Huffman table, limited to 16-bit codes, from the symbol
+// frequencies (JPEG K.2). As in the spec, a dummy symbol gets the longest
+// code, so that no code is all ones.
+static void tjei_huff_optimize(const uint32_t freq_in[256], uint8_t bits[16], uint8_t vals[256])
+{
+    uint64_t freq[257];
+    uint8_t  codesize[257];
+    int      others[257];
+    int      num_codes[258];  // Of each size, before limiting to 16 bits.
+
+    for ( int i = 0; i < 256; ++i ) {
+        freq[i] = freq_in[i];
+    }
+    freq[256] = 1;
+    memset(codesize, 0, sizeof(codesize));
+    memset(num_codes, 0, sizeof(num_codes));
+    for ( int i = 0; i < 257; ++i ) {
+        others[i] = -1;
     }
 
-    if (width > 0xffff || height > 0xffff) {
-        return 0;
+    // Figure K.1: merge the two least frequent symbols until one is left.
+    for ( ;; ) {
+        int c1 = -1;
+        int c2 = -1;
+        for ( int i = 0; i < 257; ++i ) {
+            if ( freq[i] == 0 ) {
+                continue;
+            }
+            if ( c1 < 0 || freq[i] <= freq[c1] ) {
+                c2 = c1;
+                c1 = i;
+            } else if ( c2 < 0 || freq[i] <= freq[c2] ) {
+                c2 = i;
+            }
+        }
+        if ( c2 < 0 ) {
+            break;
+        }
+
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+
+        ++codesize[c1];
+        while ( others[c1] >= 0 ) {
+            c1 = others[c1];
+            ++codesize[c1];
+        }
+        others[c1] = c2;
+
+        ++codesize[c2];
+        while ( others[c2] >= 0 ) {
+            c2 = others[c2];
+            ++codesize[c2];
+        }
+    }
+
+    // Figure K.2
+    for ( int i = 0; i < 257; ++i ) {
+        num_codes[codesize[i]] += codesize[i] != 0;
+    }
+
+    // Figure K.3: move pairs of codes longer than 16 bits up the tree.
+    for ( int i = 257; i > 16; --i ) {
+        while ( num_codes[i] > 0 ) {
+            int j = i - 2;
+            while ( num_codes[j] == 0 ) {
+                --j;
+            }
+            num_codes[i] -= 2;
+            num_codes[i - 1] += 1;
+            num_codes[j + 1] += 2;
+            num_codes[j] -= 1;
+        }
+    }
+    // Drop the dummy symbol, which has the longest code.
+    int longest = 16;
+    while ( num_codes[longest] == 0 ) {
+        --longest;
+    }
+    num_codes[longest]--;
+
+    for ( int i = 0; i < 16; ++i ) {
+        bits[i] = (uint8_t)num_codes[i + 1];
+    }
+
+    // Figure K.4: symbols in order of code size.
+    int k = 0;
+    for ( int size = 1; size < 257; ++size ) {
+        for ( int i = 0; i < 256; ++i ) {
+            if ( codesize[i] == size ) {
+                vals[k++] = (uint8_t)i;
+            }
+        }
     }
+}
 
 #if TJE_USE_FAST_DCT
-    struct TJEProcessedQT pqt;
+// Build the quantization tables used by tjei_encode_and_write_MCU.
+static void tjei_prepare_qt(TJEState* state)
+{
     // Again, taken from classic japanese implementation.
     //
     /* For float AA&N IDCT method, divisors are equal to quantization
@@ -975,12 +1905,22 @@ static int tjei_encode_main(TJEState* state,
     for(int y=0; y<8; y++) {
         for(int x=0; x<8; x++) {
             int i = y*8 + x;
-            pqt.luma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_luma[tjei_zig_zag[i]]);
-            pqt.chroma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_chroma[tjei_zig_zag[i]]);
+            state->pqt.luma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_luma[tjei_zig_zag[i]]);
+            state->pqt.chroma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_chroma[tjei_zig_zag[i]]);
         }
     }
+}
 #endif
 
+// Everything up to and including the start of scan.
+static void tjei_write_headers(TJEState* state,
+                               const int width,
+                               const int height,
+                               const int src_num_components)
+{
+    // Grayscale images only have luma, and don't need the chroma tables.
+    const int num_components = src_num_components == 1 ? 1 : 3;
+
     { // Write header
         TJEJPEGHeader header;
         // JFIF header.
@@ -996,7 +1936,7 @@ static int tjei_encode_main(TJEState* state,
         header.y_density = tjei_be_word(0x0060);  // 96 DPI
         header.x_thumb = 0;
         header.y_thumb = 0;
-        tjei_write(state, &header, sizeof(TJEJPEGHeader), 1);
+        tjei_write(&state->output, &header, sizeof(TJEJPEGHeader), 1);
     }
     {  // Write comment
         TJEJPEGComment com;
@@ -1005,58 +1945,72 @@ static int tjei_encode_main(TJEState* state,
         com.com = tjei_be_word(0xfffe);
         com.com_len = tjei_be_word(com_len);
         memcpy(com.com_str, (const void*)tjeik_com_str, sizeof(tjeik_com_str)-1);
-        tjei_write(state, &com, sizeof(TJEJPEGComment), 1);
+        tjei_write(&state->output, &com, sizeof(TJEJPEGComment), 1);
     }
 
     // Write quantization tables.
-    tjei_write_DQT(state, state->qt_luma, 0x00);
-    tjei_write_DQT(state, state->qt_chroma, 0x01);
+    tjei_write_DQT(&state->output, state->qt_luma, 0x00);
+    if ( num_components > 1 ) {
+        tjei_write_DQT(&state->output, state->qt_chroma, 0x01);
+    }
 
     {  // Write the frame marker.
         TJEFrameHeader header;
         header.SOF = tjei_be_word(0xffc0);
-        header.len = tjei_be_word(8 + 3 * 3);
+        header.len = tjei_be_word((uint16_t)(8 + 3 * num_components));
         header.precision = 8;
         assert(width <= 0xffff);
         assert(height <= 0xffff);
         header.width = tjei_be_word((uint16_t)width);
         header.height = tjei_be_word((uint16_t)height);
-        header.num_components = 3;
+        header.num_components = (uint8_t)num_components;
         uint8_t tables[3] = {
             0,  // Luma component gets luma table (see tjei_write_DQT call above.)
             1,  // Chroma component gets chroma table
             1,  // Chroma component gets chroma table
         };
-        for (int i = 0; i < 3; ++i) {
+        for (int i = 0; i < num_components; ++i) {
             TJEComponentSpec spec;
             spec.component_id = (uint8_t)(i + 1);  // No particular reason. Just 1, 2, 3.
-            spec.sampling_factors = (uint8_t)0x11;
+            spec.sampling_factors = (uint8_t)(i == 0 ? (state->h_samp << 4) | state->v_samp : 0x11);
             spec.qt = tables[i];
 
             header.component_spec[i] = spec;
         }
-        // Write to file.
-        tjei_write(state, &header, sizeof(TJEFrameHeader), 1);
+        // Write to file. The component specs are last.
+        tjei_write(&state->output, &header,
+                   sizeof(TJEFrameHeader) - (size_t)(3 - num_components) * sizeof(TJEComponentSpec), 1);
     }
 
-    tjei_write_DHT(state, state->ht_bits[TJEI_LUMA_DC],   state->ht_vals[TJEI_LUMA_DC], TJEI_DC, 0);
-    tjei_write_DHT(state, state->ht_bits[TJEI_LUMA_AC],   state->ht_vals[TJEI_LUMA_AC], TJEI_AC, 0);
-    tjei_write_DHT(state, state->ht_bits[TJEI_CHROMA_DC], state->ht_vals[TJEI_CHROMA_DC], TJEI_DC, 1);
-    tjei_write_DHT(state, state->ht_bits[TJEI_CHROMA_AC], state->ht_vals[TJEI_CHROMA_AC], TJEI_AC, 1);
+    tjei_write_DHT(&state->output, state->ht_bits[TJEI_LUMA_DC],   state->ht_vals[TJEI_LUMA_DC], TJEI_DC, 0);
+    tjei_write_DHT(&state->output, state->ht_bits[TJEI_LUMA_AC],   state->ht_vals[TJEI_LUMA_AC], TJEI_AC, 0);
+    if ( num_components > 1 ) {
+        tjei_write_DHT(&state->output, state->ht_bits[TJEI_CHROMA_DC], state->ht_vals[TJEI_CHROMA_DC], TJEI_DC, 1);
+        tjei_write_DHT(&state->output, state->ht_bits[TJEI_CHROMA_AC], state->ht_vals[TJEI_CHROMA_AC], TJEI_AC, 1);
+    }
+
+    if ( state->restart_rows ) {  // Define restart interval, in MCUs.
+        int mcus_per_row = (width + 8 * state->h_samp - 1) / (8 * state->h_samp);
+        uint16_t DRI[3];
+        DRI[0] = tjei_be_word(0xffdd);
+        DRI[1] = tjei_be_word(4);
+        DRI[2] = tjei_be_word((uint16_t)(mcus_per_row * state->restart_rows));
+        tjei_write(&state->output, DRI, sizeof(uint16_t), 3);
+    }
 
     // Write start of scan
     {
         TJEScanHeader header;
         header.SOS = tjei_be_word(0xffda);
-        header.len = tjei_be_word((uint16_t)(6 + (sizeof(TJEFrameComponentSpec) * 3)));
-        header.num_components = 3;
+        header.len = tjei_be_word((uint16_t)(6 + (sizeof(TJEFrameComponentSpec) * num_components)));
+        header.num_components = (uint8_t)num_components;
 
         uint8_t tables[3] = {
             0x00,
             0x11,
             0x11,
         };
-        for (int i = 0; i < 3; ++i) {
+        for (int i = 0; i < num_components; ++i) {
             TJEFrameComponentSpec cs;
             // Must be equal to component_id from frame header above.
             cs.component_id = (uint8_t)(i + 1);
@@ -1067,128 +2021,594 @@ static int tjei_encode_main(TJEState* state,
         header.first = 0;
         header.last  = 63;
         header.ah_al = 0;
-        tjei_write(state, &header, sizeof(TJEScanHeader), 1);
+        // Unused component specs sit between the used ones and `first`.
+        tjei_write(&state->output, &header,
+                   offsetof(TJEScanHeader, component_spec) + sizeof(TJEFrameComponentSpec) * (size_t)num_components, 1);
+        tjei_write(&state->output, &header.first, 3, 1);
 
     }
-    // Write compressed data.
-
-    float du_y[64];
-    float du_b[64];
-    float du_r[64];
+}
 
-    // Set diff to 0.
-    int pred_y = 0;
-    int pred_b = 0;
-    int pred_r = 0;
+// Converts the 8 pixels at `src`, RGB or RGBX, to level-shifted luma and to
+// chroma. The arithmetic is that of tjei_load_mcu, in the same order, so the
+// SIMD versions give the same results on x86.
+TJEI_FORCE_INLINE void tjei_rgb_to_ycbcr8(const unsigned char* src,
+                                          const int src_num_components,
+                                          float* luma,
+                                          float cb[8],
+                                          float cr[8])
+{
+#if defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi32(0xff);
+    for ( int half = 0; half < 2; ++half ) {
+        __m128i px;  // One pixel per 32-bit lane, R in the low byte.
+        if ( src_num_components == 4 ) {
+            px = _mm_loadu_si128((const __m128i*)(src + 16 * half));
+        } else {
+            // Bytes 12..23 for the second half, without reading past them.
+            __m128i v = half ? _mm_srli_si128(_mm_loadu_si128((const __m128i*)(src + 8)), 4)
+                             : _mm_loadu_si128((const __m128i*)src);
+            __m128i p01 = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3));
+            __m128i p23 = _mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9));
+            px = _mm_unpacklo_epi64(p01, p23);
+        }
+        __m128 r = _mm_cvtepi32_ps(_mm_and_si128(px, mask));
+        __m128 g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 8), mask));
+        __m128 b = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 16), mask));
+
+        __m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.299f), r),
+                                         _mm_mul_ps(_mm_set1_ps(0.587f), g)),
+                              _mm_mul_ps(_mm_set1_ps(0.114f), b));
+        _mm_storeu_ps(luma + 4 * half, _mm_sub_ps(y, _mm_set1_ps(128.0f)));
+        _mm_storeu_ps(cb + 4 * half,
+                      _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(-0.1687f), r),
+                                            _mm_mul_ps(_mm_set1_ps(0.3313f), g)),
+                                 _mm_mul_ps(_mm_set1_ps(0.5f), b)));
+        _mm_storeu_ps(cr + 4 * half,
+                      _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(0.5f), r),
+                                            _mm_mul_ps(_mm_set1_ps(0.4187f), g)),
+                                 _mm_mul_ps(_mm_set1_ps(0.0813f), b)));
+    }
+#elif defined(__ARM_NEON)
+    uint8x8_t r8, g8, b8;
+    if ( src_num_components == 4 ) {
+        uint8x8x4_t v = vld4_u8(src);
+        r8 = v.val[0];
+        g8 = v.val[1];
+        b8 = v.val[2];
+    } else {
+        uint8x8x3_t v = vld3_u8(src);
+        r8 = v.val[0];
+        g8 = v.val[1];
+        b8 = v.val[2];
+    }
+    uint16x8_t r16 = vmovl_u8(r8);
+    uint16x8_t g16 = vmovl_u8(g8);
+    uint16x8_t b16 = vmovl_u8(b8);
+    for ( int half = 0; half < 2; ++half ) {
+        float32x4_t r = vcvtq_f32_u32(vmovl_u16(half ? vget_high_u16(r16) : vget_low_u16(r16)));
+        float32x4_t g = vcvtq_f32_u32(vmovl_u16(half ? vget_high_u16(g16) : vget_low_u16(g16)));
+        float32x4_t b = vcvtq_f32_u32(vmovl_u16(half ? vget_high_u16(b16) : vget_low_u16(b16)));
+
+        float32x4_t y = vaddq_f32(vaddq_f32(vmulq_n_f32(r, 0.299f), vmulq_n_f32(g, 0.587f)),
+                                  vmulq_n_f32(b, 0.114f));
+        vst1q_f32(luma + 4 * half, vsubq_f32(y, vdupq_n_f32(128.0f)));
+        vst1q_f32(cb + 4 * half, vaddq_f32(vsubq_f32(vmulq_n_f32(r, -0.1687f), vmulq_n_f32(g, 0.3313f)),
+                                           vmulq_n_f32(b, 0.5f)));
+        vst1q_f32(cr + 4 * half, vsubq_f32(vsubq_f32(vmulq_n_f32(r, 0.5f), vmulq_n_f32(g, 0.4187f)),
+                                           vmulq_n_f32(b, 0.0813f)));
+    }
+#else
+    for ( int i = 0; i < 8; ++i ) {
+        const unsigned char* px = src + i * src_num_components;
+        uint8_t r = px[0];
+        uint8_t g = px[1];
+        uint8_t b = px[2];
+        luma[i] = 0.299f   * r + 0.587f    * g + 0.114f    * b - 128;
+        cb[i]   = -0.1687f * r - 0.3313f   * g + 0.5f      * b;
+        cr[i]   = 0.5f     * r - 0.4187f   * g - 0.0813f   * b;
+    }
+#endif
+}
 
-    // Bit stack
-    uint32_t bitbuffer = 0;
-    uint32_t location = 0;
+// tjei_load_mcu for an MCU that lies wholly inside the image, so needs no
+// edge checks. Takes 8 pixels at a time.
+static void tjei_load_mcu_interior(const TJEState* state,
+                                   const unsigned char* src_data,
+                                   const int width,
+                                   const int src_num_components,
+                                   const int x,
+                                   const int y,
+                                   float du_y[4][64],
+                                   float du_b[64],
+                                   float du_r[64])
+{
+    const int h_samp = state->h_samp;
+    const int v_samp = state->v_samp;
+
+    if ( src_num_components == 1 ) {
+        for ( int off_y = 0; off_y < 8; ++off_y ) {
+            const unsigned char* src_row = src_data + (size_t)(y + off_y) * (size_t)width + x;
+            for ( int off_x = 0; off_x < 8; ++off_x ) {
+                du_y[0][off_y * 8 + off_x] = (float)src_row[off_x] - 128;
+            }
+        }
+        return;
+    }
 
+    for ( int off_y = 0; off_y < 8 * v_samp; ++off_y ) {
+        const unsigned char* src_row = src_data +
+            ((size_t)(y + off_y) * (size_t)width + (size_t)x) * (size_t)src_num_components;
+        float* chroma_b = du_b + (off_y / v_samp) * 8;
+        float* chroma_r = du_r + (off_y / v_samp) * 8;
+
+        for ( int block_x = 0; block_x < h_samp; ++block_x ) {
+            float cb[8];
+            float cr[8];
+            tjei_rgb_to_ycbcr8(src_row + 8 * block_x * src_num_components, src_num_components,
+                               du_y[(off_y / 8) * h_samp + block_x] + (off_y % 8) * 8, cb, cr);
+
+            if ( h_samp == 1 ) {
+                memcpy(chroma_b, cb, sizeof(cb));
+                memcpy(chroma_r, cr, sizeof(cr));
+                continue;
+            }
+            // Sum in the order tjei_load_mcu does, which rounds the same.
+            for ( int i = 0; i < 4; ++i ) {
+                int ci = 4 * block_x + i;
+                if ( v_samp == 1 ) {
+                    chroma_b[ci] = (cb[2 * i] + cb[2 * i + 1]) * 0.5f;
+                    chroma_r[ci] = (cr[2 * i] + cr[2 * i + 1]) * 0.5f;
+                } else if ( off_y % 2 == 0 ) {
+                    chroma_b[ci] = cb[2 * i] + cb[2 * i + 1];
+                    chroma_r[ci] = cr[2 * i] + cr[2 * i + 1];
+                } else {
+                    chroma_b[ci] = ((chroma_b[ci] + cb[2 * i]) + cb[2 * i + 1]) * 0.25f;
+                    chroma_r[ci] = ((chroma_r[ci] + cr[2 * i]) + cr[2 * i + 1]) * 0.25f;
+                }
+            }
+        }
+    }
+}
 
-    for ( int y = 0; y < height; y += 8 ) {
-        for ( int x = 0; x < width; x += 8 ) {
-            // Block loop: ====
-            for ( int off_y = 0; off_y < 8; ++off_y ) {
-                for ( int off_x = 0; off_x < 8; ++off_x ) {
-                    int block_index = (off_y * 8 + off_x);
+// Gathers the MCU whose top-left pixel is (x, y) into YCbCr data units. Pixels
+// past the right and bottom edges repeat the last column and row. Chroma is
+// averaged over h_samp x v_samp pixels. Grayscale only fills du_y[0].
+static void tjei_load_mcu(const TJEState* state,
+                          const unsigned char* src_data,
+                          const int width,
+                          const int height,
+                          const int src_num_components,
+                          const int x,
+                          const int y,
+                          float du_y[4][64],
+                          float du_b[64],
+                          float du_r[64])
+{
+    const int h_samp = state->h_samp;
+    const int v_samp = state->v_samp;
 
-                    int src_index = (((y + off_y) * width) + (x + off_x)) * src_num_components;
+    if ( x + 8 * h_samp <= width && y + 8 * v_samp <= height ) {
+        tjei_load_mcu_interior(state, src_data, width, src_num_components, x, y, du_y, du_b, du_r);
+        return;
+    }
 
-                    int col = x + off_x;
-                    int row = y + off_y;
+    if ( src_num_components == 1 ) {
+        // Grayscale. The samples are luma already, and the MCU is one block.
+        for ( int off_y = 0; off_y < 8; ++off_y ) {
+            int row = tjei_min(y + off_y, height - 1);
+            const unsigned char* src_row = src_data + (size_t)row * (size_t)width;
+            for ( int off_x = 0; off_x < 8; ++off_x ) {
+                int col = tjei_min(x + off_x, width - 1);
+                du_y[0][off_y * 8 + off_x] = (float)src_row[col] - 128;
+            }
+        }
+        return;
+    }
 
-                    if(row >= height) {
-                        src_index -= (width * (row - height + 1)) * src_num_components;
-                    }
-                    if(col >= width) {
-                        src_index -= (col - width + 1) * src_num_components;
-                    }
-                    assert(src_index < width * height * src_num_components);
+    if ( h_samp * v_samp > 1 ) {
+        memset(du_b, 0, 64 * sizeof(float));
+        memset(du_r, 0, 64 * sizeof(float));
+    }
 
-                    uint8_t r = src_data[src_index + 0];
-                    uint8_t g = src_data[src_index + 1];
-                    uint8_t b = src_data[src_index + 2];
+    for ( int off_y = 0; off_y < 8 * v_samp; ++off_y ) {
+        int row = y + off_y;
+        if(row >= height) {
+            row = height - 1;
+        }
+        for ( int off_x = 0; off_x < 8 * h_samp; ++off_x ) {
+            int col = x + off_x;
+            if(col >= width) {
+                col = width - 1;
+            }
+            int src_index = ((row * width) + col) * src_num_components;
 
-                    float luma = 0.299f   * r + 0.587f    * g + 0.114f    * b - 128;
-                    float cb   = -0.1687f * r - 0.3313f   * g + 0.5f      * b;
-                    float cr   = 0.5f     * r - 0.4187f   * g - 0.0813f   * b;
+            assert(src_index < width * height * src_num_components);
 
-                    du_y[block_index] = luma;
-                    du_b[block_index] = cb;
-                    du_r[block_index] = cr;
-                }
-            }
+            uint8_t r = src_data[src_index + 0];
+            uint8_t g = src_data[src_index + 1];
+            uint8_t b = src_data[src_index + 2];
 
-            tjei_encode_and_write_MCU(state, du_y,
-#if TJE_USE_FAST_DCT
-                                     pqt.luma,
-#else
-                                     state->qt_luma,
-#endif
-                                     state->ehuffsize[TJEI_LUMA_DC], state->ehuffcode[TJEI_LUMA_DC],
-                                     state->ehuffsize[TJEI_LUMA_AC], state->ehuffcode[TJEI_LUMA_AC],
-                                     &pred_y, &bitbuffer, &location);
-            tjei_encode_and_write_MCU(state, du_b,
-#if TJE_USE_FAST_DCT
-                                     pqt.chroma,
-#else
-                                     state->qt_chroma,
-#endif
-                                     state->ehuffsize[TJEI_CHROMA_DC], state->ehuffcode[TJEI_CHROMA_DC],
-                                     state->ehuffsize[TJEI_CHROMA_AC], state->ehuffcode[TJEI_CHROMA_AC],
-                                     &pred_b, &bitbuffer, &location);
-            tjei_encode_and_write_MCU(state, du_r,
-#if TJE_USE_FAST_DCT
-                                     pqt.chroma,
-#else
-                                     state->qt_chroma,
-#endif
-                                     state->ehuffsize[TJEI_CHROMA_DC], state->ehuffcode[TJEI_CHROMA_DC],
-                                     state->ehuffsize[TJEI_CHROMA_AC], state->ehuffcode[TJEI_CHROMA_AC],
-                                     &pred_r, &bitbuffer, &location);
+            float luma = 0.299f   * r + 0.587f    * g + 0.114f    * b - 128;
+            float cb   = -0.1687f * r - 0.3313f   * g + 0.5f      * b;
+            float cr   = 0.5f     * r - 0.4187f   * g - 0.0813f   * b;
 
+            int block = (off_y / 8) * h_samp + (off_x / 8);
+            du_y[block][(off_y % 8) * 8 + (off_x % 8)] = luma;
 
+            int chroma_index = (off_y / v_samp) * 8 + (off_x / h_samp);
+            if ( h_samp * v_samp > 1 ) {
+                du_b[chroma_index] += cb;
+                du_r[chroma_index] += cr;
+            } else {
+                du_b[chroma_index] = cb;
+                du_r[chroma_index] = cr;
+            }
         }
     }
 
-    // Finish the image.
-    { // Flush
-        if (location > 0 && location < 8) {
-            tjei_write_bits(state, &bitbuffer, &location, (uint16_t)(8 - location), 0);
+    if ( h_samp * v_samp > 1 ) {
+        float scale = 1.0f / (float)(h_samp * v_samp);
+        for ( int i = 0; i < 64; ++i ) {
+            du_b[i] *= scale;
+            du_r[i] *= scale;
         }
     }
-    uint16_t EOI = tjei_be_word(0xffd9);
-    tjei_write(state, &EOI, sizeof(uint16_t), 1);
-
-    if (state->output_buffer_count) {
-        state->write_context.func(state->write_context.context, state->output_buffer, (int)state->output_buffer_count);
-        state->output_buffer_count = 0;
-    }
-
-    return 1;
 }
 
-int tje_encode_to_file(const char* dest_path,
-                       const int width,
-                       const int height,
-                       const int num_components,
-                       const unsigned char* src_data)
+// Turns the mean of a block back into an 8-bit sample.
+TJEI_FORCE_INLINE uint8_t tjei_dc_sample(const float mean)
 {
-    int res = tje_encode_to_file_at_quality(dest_path, 3, width, height, num_components, src_data);
-    return res;
+    return (uint8_t)tjei_min(tjei_max(mean + 128.5f, 0.0f), 255.0f);
 }
 
-static void tjei_stdlib_func(void* context, void* data, int size)
+// Ends the current restart interval: pads out the entropy-coded data to a
+// byte boundary, writes RSTn and resets the DC predictions (F.1.2.3).
+static void tjei_write_restart(TJEOutput* out, TJEBitWriter* bw, int pred[3], int interval)
 {
-    FILE* fd = (FILE*)context;
-    fwrite(data, size, 1, fd);
+    if ( out->output_buffer_size - out->output_buffer_count < TJEI_MAX_BLOCK_BYTES ) {
+        tjei_reserve(out, TJEI_MAX_BLOCK_BYTES);
+    }
+    tjei_flush_bits(out, bw);
+
+    uint16_t RST = tjei_be_word((uint16_t)(0xffd0 + (interval & 7)));
+    tjei_write(out, &RST, sizeof(uint16_t), 1);
+
+    pred[0] = pred[1] = pred[2] = 0;
 }
 
-// Define public interface.
-int tje_encode_to_file_at_quality(const char* dest_path,
-                                  const int quality,
-                                  const int width,
+// Entropy-codes MCU rows [mcu_row_begin, mcu_row_end) once for each of
+// `num_states` states, which differ only in their tables, into outs[k]. The
+// colour conversion and the DCT are shared. `preds` holds the previous DC
+// coefficient of each component, per state. Returns 0 if an output
+// overflowed.
+static int tjei_encode_mcu_rows(const TJEState* const states[],
+                                TJEOutput* const outs[],
+                                TJEBitWriter bws[],
+                                int preds[][3],
+                                const int num_states,
+                                const unsigned char* src_data,
+                                const int width,
+                                const int height,
+                                const int src_num_components,
+                                const int mcu_row_begin,
+                                const int mcu_row_end)
+{
+    const TJEState* state = states[0];  // The layout is the same for all.
+    const int mcu_w = 8 * state->h_samp;
+    const int mcu_h = 8 * state->v_samp;
+    const int num_luma = state->h_samp * state->v_samp;
+    const int num_blocks = num_luma + (src_num_components == 1 ? 0 : 2);
+    const int num_mcu_rows = (height + mcu_h - 1) / mcu_h;
+
+    float du_y[4][64];
+    float du_b[64];
+    float du_r[64];
+    float dct[64];
+
+    for ( int mcu_row = mcu_row_begin; mcu_row < mcu_row_end; ++mcu_row ) {
+        int y = mcu_row * mcu_h;
+        for ( int x = 0; x < width; x += mcu_w ) {
+            tjei_load_mcu(state, src_data, width, height, src_num_components, x, y, du_y, du_b, du_r);
+
+            for ( int b = 0; b < num_blocks; ++b ) {
+                // Luma blocks, then Cb and Cr.
+                int c = b < num_luma ? 0 : b - num_luma + 1;
+                float mean = tjei_transform_block(c == 0 ? du_y[b] : c == 1 ? du_b : du_r, dct);
+
+                for ( int k = 0; k < num_states; ++k ) {
+                    const TJEState* st = states[k];
+                    tjei_encode_and_write_MCU(outs[k], dct,
+#if TJE_USE_FAST_DCT
+                                              c ? st->pqt.chroma : st->pqt.luma,
+#else
+                                              c ? st->qt_chroma : st->qt_luma,
+#endif
+                                              st->ehuff[c ? TJEI_CHROMA_DC : TJEI_LUMA_DC],
+                                              st->ehuff[c ? TJEI_CHROMA_AC : TJEI_LUMA_AC],
+                                              &preds[k][c], &bws[k]);
+
+                    if ( st->dc_planes[0] ) {
+                        // The planes are padded out to whole MCUs.
+                        size_t row = (size_t)mcu_row;
+                        size_t col = (size_t)(x / mcu_w);
+                        if ( c == 0 ) {
+                            row = row * (size_t)st->v_samp + (size_t)(b / st->h_samp);
+                            col = col * (size_t)st->h_samp + (size_t)(b % st->h_samp);
+                        }
+                        st->dc_planes[c][row * (size_t)st->dc_stride[c] + col] = tjei_dc_sample(mean);
+                    }
+                }
+            }
+        }
+
+        // Close the restart interval, unless it is the last in the image.
+        int next_row = mcu_row + 1;
+        if ( state->restart_rows && next_row % state->restart_rows == 0 && next_row < num_mcu_rows ) {
+            for ( int k = 0; k < num_states; ++k ) {
+                tjei_write_restart(outs[k], &bws[k], preds[k], next_row / state->restart_rows - 1);
+            }
+        }
+
+        // Don't bother with the rest if a destination is already full.
+        for ( int k = 0; k < num_states; ++k ) {
+            if ( outs[k]->sink && outs[k]->sink->overflow ) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// First pass of Huffman optimization: counts the symbols of the whole image,
+// as tjei_encode_mcu_rows would write them.
+static void tjei_count_mcu_rows(const TJEState* state,
+                                const unsigned char* src_data,
+                                const int width,
+                                const int height,
+                                const int src_num_components,
+                                uint32_t freq[4][256])
+{
+#if TJE_USE_FAST_DCT
+    const float* qt_luma   = state->pqt.luma;
+    const float* qt_chroma = state->pqt.chroma;
+#else
+    const uint8_t* qt_luma   = state->qt_luma;
+    const uint8_t* qt_chroma = state->qt_chroma;
+#endif
+    const int mcu_w = 8 * state->h_samp;
+    const int mcu_h = 8 * state->v_samp;
+    const int num_luma = state->h_samp * state->v_samp;
+    const int num_mcu_rows = (height + mcu_h - 1) / mcu_h;
+
+    int pred[3] = { 0, 0, 0 };
+    int du[64];
+    float du_y[4][64];
+    float du_b[64];
+    float du_r[64];
+
+    for ( int mcu_row = 0; mcu_row < num_mcu_rows; ++mcu_row ) {
+        int y = mcu_row * mcu_h;
+        for ( int x = 0; x < width; x += mcu_w ) {
+            tjei_load_mcu(state, src_data, width, height, src_num_components, x, y, du_y, du_b, du_r);
+
+            for ( int i = 0; i < num_luma; ++i ) {
+                tjei_quantize_block(du_y[i], qt_luma, du);
+                tjei_count_MCU(du, &pred[0], freq[TJEI_LUMA_DC], freq[TJEI_LUMA_AC]);
+            }
+            if ( src_num_components == 1 ) {
+                continue;
+            }
+            tjei_quantize_block(du_b, qt_chroma, du);
+            tjei_count_MCU(du, &pred[1], freq[TJEI_CHROMA_DC], freq[TJEI_CHROMA_AC]);
+            tjei_quantize_block(du_r, qt_chroma, du);
+            tjei_count_MCU(du, &pred[2], freq[TJEI_CHROMA_DC], freq[TJEI_CHROMA_AC]);
+        }
+
+        if ( state->restart_rows && (mcu_row + 1) % state->restart_rows == 0 ) {
+            pred[0] = pred[1] = pred[2] = 0;
+        }
+    }
+}
+
+// Encodes a run of whole restart intervals into the slice's outputs.
+static void tjei_encode_slice(TJESlice* slice)
+{
+    TJEBitWriter bws[TJE_MAX_LADDER];
+    int preds[TJE_MAX_LADDER][3];
+
+    for ( int k = 0; k < slice->num_states; ++k ) {
+        TJEOutput* out = slice->outputs[k];
+        out->sink->count = 0;
+        out->sink->overflow = 0;
+        tjei_set_output(out, out->sink->data, out->sink->size);
+        tjei_bit_writer_init(&bws[k]);
+        preds[k][0] = preds[k][1] = preds[k][2] = 0;
+    }
+
+    slice->result = tjei_encode_mcu_rows(slice->states, slice->outputs, bws, preds, slice->num_states,
+                                         slice->src_data, slice->width, slice->height,
+                                         slice->src_num_components,
+                                         slice->mcu_row_begin, slice->mcu_row_end);
+
+    for ( int k = 0; k < slice->num_states; ++k ) {
+        TJEOutput* out = slice->outputs[k];
+        if ( out->output_buffer_size - out->output_buffer_count < TJEI_MAX_BLOCK_BYTES ) {
+            tjei_reserve(out, TJEI_MAX_BLOCK_BYTES);
+        }
+        tjei_flush_bits(out, &bws[k]);
+        tjei_flush_output(out);
+
+        if ( out->sink->overflow ) {
+            slice->result = 0;
+        }
+    }
+}
+
+#ifdef TJE_THREADS
+static void* tjei_slice_thread(void* arg)
+{
+    tjei_encode_slice((TJESlice*)arg);
+    return NULL;
+}
+#endif
+
+static void tjei_start_slice(TJESlice* slice)
+{
+#ifdef TJE_THREADS
+    slice->running = (0 == pthread_create(&slice->thread, NULL, tjei_slice_thread, slice));
+    if ( slice->running ) {
+        return;
+    }
+#endif
+    // No threads. Slices don't depend on each other, so just encode it now.
+    tjei_encode_slice(slice);
+}
+
+static void tjei_finish_slice(TJESlice* slice)
+{
+#ifdef TJE_THREADS
+    if ( slice->running ) {
+        pthread_join(slice->thread, NULL);
+        slice->running = 0;
+    }
+#else
+    (void)slice;
+#endif
+}
+
+// Encodes the image once for each of `num_states` states, into their own
+// outputs. The states must have the same subsampling and restart interval.
+static int tjei_encode_ladder(TJEState* const states[],
+                              const int num_states,
+                              const unsigned char* src_data,
+                              const int width,
+                              const int height,
+                              const int src_num_components)
+{
+    if (src_num_components != 1 && src_num_components != 3 && src_num_components != 4) {
+        return 0;
+    }
+
+    if (width > 0xffff || height > 0xffff) {
+        return 0;
+    }
+
+    assert(num_states >= 1 && num_states <= TJE_MAX_LADDER);
+
+    const TJEState* state = states[0];
+    TJEOutput* outs[TJE_MAX_LADDER];
+    TJEBitWriter bws[TJE_MAX_LADDER];
+    int preds[TJE_MAX_LADDER][3];
+
+    for ( int k = 0; k < num_states; ++k ) {
+        tjei_write_headers(states[k], width, height, src_num_components);
+
+        // Write compressed data.
+        outs[k] = &states[k]->output;
+        tjei_bit_writer_init(&bws[k]);
+        // Set diff to 0.
+        preds[k][0] = preds[k][1] = preds[k][2] = 0;
+    }
+
+    int mcu_rows = (height + 8 * state->v_samp - 1) / (8 * state->v_samp);
+
+    // Split the restart intervals evenly between this thread and the slices.
+    // Every state needs a slice for each part.
+    int num_parts = 1;
+    int num_intervals = 0;
+    if ( state->restart_rows ) {
+        int num_slices = state->num_slices;
+        for ( int k = 1; k < num_states; ++k ) {
+            num_slices = tjei_min(num_slices, states[k]->num_slices);
+        }
+        num_intervals = (mcu_rows + state->restart_rows - 1) / state->restart_rows;
+        num_parts = tjei_max(tjei_min(num_slices + 1, num_intervals), 1);
+    }
+#define TJEI_PART_ROW(p) tjei_min(((p) * num_intervals / num_parts) * state->restart_rows, mcu_rows)
+
+    for ( int p = 1; p < num_parts; ++p ) {
+        TJESlice* slice = &state->slices[p - 1];
+        for ( int k = 0; k < num_states; ++k ) {
+            slice->states[k] = states[k];
+            slice->outputs[k] = &states[k]->slices[p - 1].output;
+        }
+        slice->num_states = num_states;
+        slice->src_data = src_data;
+        slice->width = width;
+        slice->height = height;
+        slice->src_num_components = src_num_components;
+        slice->mcu_row_begin = TJEI_PART_ROW(p);
+        slice->mcu_row_end = TJEI_PART_ROW(p + 1);
+        tjei_start_slice(slice);
+    }
+
+    int result = tjei_encode_mcu_rows((const TJEState* const*)states, outs, bws, preds, num_states,
+                                      src_data, width, height, src_num_components,
+                                      0, num_parts > 1 ? TJEI_PART_ROW(1) : mcu_rows);
+#undef TJEI_PART_ROW
+
+    // Stitch the slices on in order. Each ends on a byte boundary, after its
+    // RSTn marker if another interval follows.
+    for ( int p = 1; p < num_parts; ++p ) {
+        tjei_finish_slice(&state->slices[p - 1]);
+        result = result && state->slices[p - 1].result;
+        for ( int k = 0; k < num_states && result; ++k ) {
+            TJESlice* slice = &states[k]->slices[p - 1];
+            tjei_write(outs[k], slice->sink.data, slice->sink.count, 1);
+        }
+    }
+
+    if ( !result ) {
+        return 0;
+    }
+
+    // Finish the images.
+    for ( int k = 0; k < num_states; ++k ) {
+        TJEOutput* out = outs[k];
+        if ( out->output_buffer_size - out->output_buffer_count < TJEI_MAX_BLOCK_BYTES ) {
+            tjei_reserve(out, TJEI_MAX_BLOCK_BYTES);
+        }
+        tjei_flush_bits(out, &bws[k]);
+
+        uint16_t EOI = tjei_be_word(0xffd9);
+        tjei_write(out, &EOI, sizeof(uint16_t), 1);
+
+        tjei_flush_output(out);
+    }
+
+    return 1;
+}
+
+static int tjei_encode_main(TJEState* state,
+                            const unsigned char* src_data,
+                            const int width,
+                            const int height,
+                            const int src_num_components)
+{
+    return tjei_encode_ladder(&state, 1, src_data, width, height, src_num_components);
+}
+
+int tje_encode_to_file(const char* dest_path,
+                       const int width,
+                       const int height,
+                       const int num_components,
+                       const unsigned char* src_data)
+{
+    int res = tje_encode_to_file_at_quality(dest_path, 3, width, height, num_components, src_data);
+    return res;
+}
+
+static void tjei_stdlib_func(void* context, void* data, int size)
+{
+    FILE* fd = (FILE*)context;
+    fwrite(data, size, 1, fd);
+}
+
+// Define public interface.
+int tje_encode_to_file_at_quality(const char* dest_path,
+                                  const int quality,
+                                  const int width,
                                   const int height,
                                   const int num_components,
                                   const unsigned char* src_data)
@@ -1207,41 +2627,169 @@ int tje_encode_to_file_at_quality(const char* dest_path,
     return result;
 }
 
-int tje_encode_with_func(tje_write_func* func,
-                         void* context,
-                         const int quality,
-                         const int width,
-                         const int height,
-                         const int num_components,
-                         const unsigned char* src_data)
+// Loads the 8x8 block of plane `c` whose top-left sample is (x, y) into
+// `du`, centred on 0, repeating the last row and column past the edges.
+// Tiles are multiples of 8, so the block lies within one.
+static void tjei_load_planar_du(const TJEPlanes* img, const int c, int x, int y, float* du)
+{
+    const unsigned char* base = img->planes[c];
+    int width = img->width[c];
+    int height = img->height[c];
+    size_t stride = (size_t)img->stride[c];
+
+    if ( img->tile_width[c] ) {
+        // Whole rows of tiles above, then whole tiles to the left.
+        int tx = x - x % img->tile_width[c];
+        int ty = y - y % img->tile_height[c];
+        int tw = tjei_min(img->tile_width[c], width - tx);
+        int th = tjei_min(img->tile_height[c], height - ty);
+        base += (size_t)ty * (size_t)width + (size_t)th * (size_t)tx;
+        stride = (size_t)tw;
+        width = tw;
+        height = th;
+        x -= tx;
+        y -= ty;
+    }
+
+    if ( x + 8 <= width && y + 8 <= height ) {
+        for ( int off_y = 0; off_y < 8; ++off_y ) {
+            const unsigned char* src_row = base + (size_t)(y + off_y) * stride + x;
+            for ( int off_x = 0; off_x < 8; ++off_x ) {
+                du[off_y * 8 + off_x] = (float)src_row[off_x] - 128;
+            }
+        }
+        return;
+    }
+
+    for ( int off_y = 0; off_y < 8; ++off_y ) {
+        const unsigned char* src_row = base + (size_t)tjei_min(y + off_y, height - 1) * stride;
+        for ( int off_x = 0; off_x < 8; ++off_x ) {
+            du[off_y * 8 + off_x] = (float)src_row[tjei_min(x + off_x, width - 1)] - 128;
+        }
+    }
+}
+
+// Encodes planar YCbCr, subsampled to match the state, without restart
+// intervals. Planes 1 and 2 are NULL for grayscale.
+static int tjei_encode_planar(TJEState* state, const TJEPlanes* img)
+{
+#if TJE_USE_FAST_DCT
+    const float* qt_luma   = state->pqt.luma;
+    const float* qt_chroma = state->pqt.chroma;
+#else
+    const uint8_t* qt_luma   = state->qt_luma;
+    const uint8_t* qt_chroma = state->qt_chroma;
+#endif
+    TJEOutput* out = &state->output;
+    const int num_components = img->planes[1] ? 3 : 1;
+    const int mcu_w = 8 * state->h_samp;
+    const int mcu_h = 8 * state->v_samp;
+
+    tjei_write_headers(state, img->width[0], img->height[0], num_components);
+
+    int pred[3] = { 0, 0, 0 };
+    TJEBitWriter bw;
+    tjei_bit_writer_init(&bw);
+
+    float du[64];
+    float dct[64];
+    for ( int y = 0; y < img->height[0]; y += mcu_h ) {
+        for ( int x = 0; x < img->width[0]; x += mcu_w ) {
+            for ( int c = 0; c < num_components; ++c ) {
+                // The luma blocks of the MCU, or its one chroma block.
+                int num_blocks = c ? 1 : state->h_samp * state->v_samp;
+                for ( int i = 0; i < num_blocks; ++i ) {
+                    int bx = c ? x / state->h_samp : x + (i % state->h_samp) * 8;
+                    int by = c ? y / state->v_samp : y + (i / state->h_samp) * 8;
+                    tjei_load_planar_du(img, c, bx, by, du);
+                    tjei_transform_block(du, dct);
+                    tjei_encode_and_write_MCU(out, dct, c ? qt_chroma : qt_luma,
+                                              state->ehuff[c ? TJEI_CHROMA_DC : TJEI_LUMA_DC],
+                                              state->ehuff[c ? TJEI_CHROMA_AC : TJEI_LUMA_AC],
+                                              &pred[c], &bw);
+                }
+            }
+        }
+    }
+
+    if ( out->output_buffer_size - out->output_buffer_count < TJEI_MAX_BLOCK_BYTES ) {
+        tjei_reserve(out, TJEI_MAX_BLOCK_BYTES);
+    }
+    tjei_flush_bits(out, &bw);
+
+    uint16_t EOI = tjei_be_word(0xffd9);
+    tjei_write(out, &EOI, sizeof(uint16_t), 1);
+
+    tjei_flush_output(out);
+
+    return !(out->sink && out->sink->overflow);
+}
+
+// Scales the Annex K quantization tables to IJG quality 1..100, as libjpeg
+// does. The Annex K tables are in natural order; qt_* are in zig-zag order.
+static void tjei_set_scaled_qt(TJEState* state, const int quality)
+{
+    int scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+
+    for ( int i = 0; i < 64; ++i ) {
+        int luma   = (tjei_default_qt_luma_from_spec[i] * scale + 50) / 100;
+        int chroma = (tjei_default_qt_chroma_from_spec[i] * scale + 50) / 100;
+        // Baseline only has 8-bit quantizers.
+        state->qt_luma[tjei_zig_zag[i]]   = (uint8_t)tjei_min(tjei_max(luma, 1), 255);
+        state->qt_chroma[tjei_zig_zag[i]] = (uint8_t)tjei_min(tjei_max(chroma, 1), 255);
+    }
+#if TJE_USE_FAST_DCT
+    tjei_prepare_qt(state);
+#endif
+}
+
+// Sets up quantization and Huffman tables. Returns 0 on an invalid quality
+// or subsampling.
+static int tjei_init_state(TJEState* state, const int quality, const int subsampling)
 {
     if (quality < 1 || quality > 3) {
         tje_log("[ERROR] -- Valid 'quality' values are 1 (lowest), 2, or 3 (highest)\n");
         return 0;
     }
 
-    TJEState state = { 0 };
+    switch (subsampling) {
+    case TJE_SUBSAMPLING_444:
+        state->h_samp = 1;
+        state->v_samp = 1;
+        break;
+    case TJE_SUBSAMPLING_422:
+        state->h_samp = 2;
+        state->v_samp = 1;
+        break;
+    case TJE_SUBSAMPLING_420:
+        state->h_samp = 2;
+        state->v_samp = 2;
+        break;
+    default:
+        tje_log("[ERROR] -- Invalid 'subsampling'\n");
+        return 0;
+    }
 
     uint8_t qt_factor = 1;
     switch(quality) {
     case 3:
         for ( int i = 0; i < 64; ++i ) {
-            state.qt_luma[i]   = 1;
-            state.qt_chroma[i] = 1;
+            state->qt_luma[i]   = 1;
+            state->qt_chroma[i] = 1;
         }
         break;
     case 2:
         qt_factor = 10;
-        // don't break. fall through.
+        // fall through
     case 1:
         for ( int i = 0; i < 64; ++i ) {
-            state.qt_luma[i]   = tjei_default_qt_luma_from_spec[i] / qt_factor;
-            if (state.qt_luma[i] == 0) {
-                state.qt_luma[i] = 1;
+            state->qt_luma[i]   = tjei_default_qt_luma_from_spec[i] / qt_factor;
+            if (state->qt_luma[i] == 0) {
+                state->qt_luma[i] = 1;
             }
-            state.qt_chroma[i] = tjei_default_qt_chroma_from_paper[i] / qt_factor;
-            if (state.qt_chroma[i] == 0) {
-                state.qt_chroma[i] = 1;
+            state->qt_chroma[i] = tjei_default_qt_chroma_from_paper[i] / qt_factor;
+            if (state->qt_chroma[i] == 0) {
+                state->qt_chroma[i] = 1;
             }
         }
         break;
@@ -1250,20 +2798,2354 @@ int tje_encode_with_func(tje_write_func* func,
         break;
     }
 
+#if TJE_USE_FAST_DCT
+    tjei_prepare_qt(state);
+#endif
+    tjei_huff_expand(state);
+
+    return 1;
+}
+
+int tje_encode_with_func(tje_write_func* func,
+                         void* context,
+                         const int quality,
+                         const int width,
+                         const int height,
+                         const int num_components,
+                         const unsigned char* src_data)
+{
+    TJEState state = { 0 };
+
+    if ( !tjei_init_state(&state, quality, TJE_SUBSAMPLING_444) ) {
+        return 0;
+    }
+
     TJEWriteContext wc = { 0 };
 
     wc.context = context;
     wc.func = func;
 
-    state.write_context = wc;
+    state.output.write_context = wc;
 
-
-    tjei_huff_expand(&state);
+    tjei_set_output(&state.output, state.output.staging, TJEI_BUFFER_SIZE);
 
     int result = tjei_encode_main(&state, src_data, width, height, num_components);
 
     return result;
 }
+
+// Points the state's output at an empty memory sink.
+static void tjei_set_sink(TJEState* state, TJEBufferSink* sink)
+{
+    sink->count = 0;
+    sink->overflow = 0;
+
+    TJEOutput* out = &state->output;
+    out->write_context.context = sink;
+    out->write_context.func = tjei_sink_func;
+    out->sink = sink;
+
+    if ( sink->data ) {
+        tjei_set_output(out, sink->data, sink->size);
+    } else {
+        tjei_set_output(out, out->staging, TJEI_BUFFER_SIZE);
+    }
+}
+
+// Encodes into memory with an initialized state.
+static size_t tjei_encode_to_sink(TJEState* state,
+                                  TJEBufferSink* sink,
+                                  const int width,
+                                  const int height,
+                                  const int num_components,
+                                  const unsigned char* src_data)
+{
+    tjei_set_sink(state, sink);
+
+    int result = tjei_encode_main(state, src_data, width, height, num_components);
+
+    if ( !result || sink->overflow ) {
+        return 0;
+    }
+    return sink->count;
+}
+
+size_t tje_encode_to_buffer(unsigned char* dest,
+                            size_t dest_size,
+                            const int quality,
+                            const int width,
+                            const int height,
+                            const int num_components,
+                            const unsigned char* src_data)
+{
+    TJEState state = { 0 };
+    TJEBufferSink sink = { 0 };
+
+    if ( !tjei_init_state(&state, quality, TJE_SUBSAMPLING_444) ) {
+        return 0;
+    }
+
+    sink.data = dest;
+    sink.size = dest ? dest_size : 0;
+
+    return tjei_encode_to_sink(&state, &sink, width, height, num_components, src_data);
+}
+
+size_t tje_encode_to_growable_buffer(unsigned char** dest,
+                                     size_t* dest_size,
+                                     const int quality,
+                                     const int width,
+                                     const int height,
+                                     const int num_components,
+                                     const unsigned char* src_data)
+{
+    TJEState state = { 0 };
+    TJEBufferSink sink = { 0 };
+
+    if ( !tjei_init_state(&state, quality, TJE_SUBSAMPLING_444) ) {
+        return 0;
+    }
+
+    sink.data = *dest;
+    sink.size = *dest ? *dest_size : 0;
+    sink.growable = 1;
+
+    if ( !sink.data ) {
+        // Start out with the size of the uncompressed image.
+        sink.size = (size_t)width * (size_t)height * 3;
+        sink.data = (uint8_t*)TJE_REALLOC(NULL, sink.size);
+        if ( !sink.data ) {
+            return 0;
+        }
+    }
+
+    size_t len = tjei_encode_to_sink(&state, &sink, width, height, num_components, src_data);
+
+    *dest = sink.data;
+    *dest_size = sink.size;
+
+    return len;
+}
+
+size_t tje_encode_planes_to_growable_buffer(unsigned char** dest,
+                                            size_t* dest_size,
+                                            const int quality,
+                                            const int subsampling,
+                                            const TJEPlanes* img)
+{
+    TJEState state = { 0 };
+    TJEBufferSink sink = { 0 };
+
+    if ( !tjei_init_state(&state, quality, subsampling) ) {
+        return 0;
+    }
+
+    // The chroma planes must be the luma plane's size over the subsampling.
+    int num_components = img->planes[1] ? 3 : 1;
+    if ( img->width[0] < 1 || img->height[0] < 1 || img->width[0] > 0xffff || img->height[0] > 0xffff ||
+         (num_components == 3 && !img->planes[2]) ) {
+        return 0;
+    }
+    for ( int c = 0; c < num_components; ++c ) {
+        int h_samp = c ? state.h_samp : 1;
+        int v_samp = c ? state.v_samp : 1;
+        if ( !img->planes[c] ||
+             img->width[c] != (img->width[0] + h_samp - 1) / h_samp ||
+             img->height[c] != (img->height[0] + v_samp - 1) / v_samp ||
+             (img->tile_width[c] ? img->tile_width[c] < 8 || img->tile_width[c] % 8 || img->tile_height[c] < 8 || img->tile_height[c] % 8
+                                 : img->stride[c] < img->width[c]) ) {
+            return 0;
+        }
+    }
+
+    sink.data = *dest;
+    sink.size = *dest ? *dest_size : 0;
+    sink.growable = 1;
+
+    if ( !sink.data ) {
+        // Start out with the size of the planes.
+        sink.size = (size_t)img->width[0] * (size_t)img->height[0] * 2;
+        sink.data = (uint8_t*)TJE_REALLOC(NULL, sink.size);
+        if ( !sink.data ) {
+            return 0;
+        }
+    }
+
+    tjei_set_sink(&state, &sink);
+    int result = tjei_encode_planar(&state, img);
+
+    *dest = sink.data;
+    *dest_size = sink.size;
+
+    return result && !sink.overflow ? sink.count : 0;
+}
+
+struct TJEStream
+{
+    TJEState       state;
+    int            width;
+    int            height;
+    int            num_components;
+    int            result;            // 0 once anything went wrong.
+
+    // Entropy coder state, carried from one row of MCUs to the next.
+    TJEBitWriter   bw;
+    int            pred[3];
+
+    int            num_rows;          // Rows pushed so far.
+    int            strip_rows;        // Of those, rows waiting in `strip`.
+    unsigned char* strip;             // One row of MCUs.
+};
+
+TJEStream* tje_begin(tje_write_func* func,
+                     void* context,
+                     const int quality,
+                     const int width,
+                     const int height,
+                     const int num_components,
+                     const int subsampling)
+{
+    if ( width <= 0 || height <= 0 || width > 0xffff || height > 0xffff ) {
+        tje_log("[ERROR] -- Invalid image size\n");
+        return NULL;
+    }
+    if ( num_components != 1 && num_components != 3 && num_components != 4 ) {
+        tje_log("[ERROR] -- Valid 'num_components' values are 1, 3 or 4\n");
+        return NULL;
+    }
+
+    TJEStream* stream = (TJEStream*)TJE_MALLOC(sizeof(TJEStream));
+    if ( !stream ) {
+        return NULL;
+    }
+    memset(stream, 0, sizeof(TJEStream));
+
+    TJEState* state = &stream->state;
+    if ( !tjei_init_state(state, quality, num_components == 1 ? TJE_SUBSAMPLING_444 : subsampling) ) {
+        TJE_FREE(stream);
+        return NULL;
+    }
+    stream->strip = (unsigned char*)TJE_MALLOC((size_t)width * (size_t)num_components * (size_t)(8 * state->v_samp));
+    if ( !stream->strip ) {
+        TJE_FREE(stream);
+        return NULL;
+    }
+    stream->width = width;
+    stream->height = height;
+    stream->num_components = num_components;
+    stream->result = 1;
+    tjei_bit_writer_init(&stream->bw);
+
+    state->output.write_context.context = context;
+    state->output.write_context.func = func;
+    tjei_set_output(&state->output, state->output.staging, TJEI_BUFFER_SIZE);
+
+    tjei_write_headers(state, width, height, num_components);
+
+    return stream;
+}
+
+// Encodes the MCU rows in `num_rows` rows of pixels. Only the last MCU row
+// of the image may be partial.
+static void tjei_stream_encode(TJEStream* stream, const unsigned char* rows, const int num_rows)
+{
+    const TJEState* state = &stream->state;
+    TJEOutput* out = &stream->state.output;
+    const int mcu_h = 8 * state->v_samp;
+
+    tjei_encode_mcu_rows(&state, &out, &stream->bw, &stream->pred, 1, rows,
+                         stream->width, num_rows, stream->num_components,
+                         0, (num_rows + mcu_h - 1) / mcu_h);
+}
+
+int tje_push_rows(TJEStream* stream, const unsigned char* rows, const int num_rows)
+{
+    const int mcu_h = 8 * stream->state.v_samp;
+    const size_t row_bytes = (size_t)stream->width * (size_t)stream->num_components;
+    int left = num_rows;
+
+    if ( num_rows < 0 || num_rows > stream->height - stream->num_rows ) {
+        tje_log("[ERROR] -- Too many rows\n");
+        stream->result = 0;
+    }
+    if ( !stream->result ) {
+        return 0;
+    }
+
+    while ( left ) {
+        if ( !stream->strip_rows && left >= mcu_h ) {
+            // Whole MCU rows, straight from the caller's buffer.
+            int n = left - left % mcu_h;
+            tjei_stream_encode(stream, rows, n);
+            rows += (size_t)n * row_bytes;
+            left -= n;
+            stream->num_rows += n;
+            continue;
+        }
+
+        int n = tjei_min(left, mcu_h - stream->strip_rows);
+        memcpy(stream->strip + (size_t)stream->strip_rows * row_bytes, rows, (size_t)n * row_bytes);
+        rows += (size_t)n * row_bytes;
+        left -= n;
+        stream->strip_rows += n;
+        stream->num_rows += n;
+
+        if ( stream->strip_rows == mcu_h || stream->num_rows == stream->height ) {
+            tjei_stream_encode(stream, stream->strip, stream->strip_rows);
+            stream->strip_rows = 0;
+        }
+    }
+    return 1;
+}
+
+int tje_end(TJEStream* stream)
+{
+    TJEOutput* out = &stream->state.output;
+    int result = stream->result && stream->num_rows == stream->height;
+
+    if ( result ) {
+        // Finish the image.
+        if ( out->output_buffer_size - out->output_buffer_count < TJEI_MAX_BLOCK_BYTES ) {
+            tjei_reserve(out, TJEI_MAX_BLOCK_BYTES);
+        }
+        tjei_flush_bits(out, &stream->bw);
+
+        uint16_t EOI = tjei_be_word(0xffd9);
+        tjei_write(out, &EOI, sizeof(uint16_t), 1);
+
+        tjei_flush_output(out);
+    }
+
+    TJE_FREE(stream->strip);
+    TJE_FREE(stream);
+    return result;
+}
+
+// Room for the markers and tables in front of the entropy-coded data.
+#define TJEI_MAX_HEADER_BYTES 2048
+
+size_t tje_encode_bound(const int width, const int height)
+{
+    if ( width <= 0 || height <= 0 ) {
+        return 0;
+    }
+    // Twelve blocks per 16x16 pixels covers both 4:4:4 and the larger MCUs of
+    // subsampled images, which pad out to 16 pixels.
+    size_t num_blocks = (size_t)((width + 15) / 16) * (size_t)((height + 15) / 16) * 12;
+    return TJEI_MAX_HEADER_BYTES + num_blocks * TJEI_MAX_BLOCK_BYTES;
+}
+
+size_t tje_standard_dht(unsigned char* dest, size_t dest_size)
+{
+    const uint8_t* bits[4] = {
+        tjei_default_ht_luma_dc_len, tjei_default_ht_luma_ac_len,
+        tjei_default_ht_chroma_dc_len, tjei_default_ht_chroma_ac_len,
+    };
+    const uint8_t* vals[4] = {
+        tjei_default_ht_luma_dc, tjei_default_ht_luma_ac,
+        tjei_default_ht_chroma_dc, tjei_default_ht_chroma_ac,
+    };
+    const uint8_t tc_th[4] = { 0x00, 0x10, 0x01, 0x11 };  // (class << 4) | id
+
+    if ( dest_size < TJE_STANDARD_DHT_SIZE ) {
+        return 0;
+    }
+
+    // One segment for all four tables.
+    size_t len = 4;
+    for ( int i = 0; i < 4; ++i ) {
+        int num_values = 0;
+        for ( int k = 0; k < 16; ++k ) {
+            num_values += bits[i][k];
+        }
+        dest[len++] = tc_th[i];
+        memcpy(dest + len, bits[i], 16);
+        len += 16;
+        memcpy(dest + len, vals[i], (size_t)num_values);
+        len += (size_t)num_values;
+    }
+    dest[0] = 0xff;
+    dest[1] = 0xc4;
+    dest[2] = (uint8_t)((len - 2) >> 8);
+    dest[3] = (uint8_t)((len - 2) & 0xff);
+
+    assert(len == TJE_STANDARD_DHT_SIZE);
+    return len;
+}
+
+struct TJEEncoder
+{
+    TJEState      state;
+    TJEBufferSink output;
+    int           width;
+    int           height;
+    int           num_components;
+
+    // 1..100, or 0 when using the 1..3 quality from tje_encoder_new.
+    int           quality;
+
+    // Rate control. See tje_encoder_set_target_size.
+    size_t        target_size;
+    int           rc_max_quality;
+    float         rc_ratio;           // Actual size over estimated size, lately.
+    float         rc_estimate[101];   // Estimate for each quality, this frame. 0 if unknown.
+
+    // Optimized Huffman tables. See tje_encoder_set_optimize_huffman.
+    int           huff_interval;      // 0 for the Annex K tables.
+    int           huff_age;           // Frames encoded with the current tables.
+    uint8_t       huff_bits[4][16];
+    uint8_t       huff_vals[4][256];
+
+    // Incremental encoding. See tje_encoder_set_incremental. The previous
+    // frame's JPEG is in inc_prev. Hashes and offsets of its rows are in
+    // slot inc_cur ^ 1 and those of the frame being encoded in inc_cur.
+    int           incremental;
+    TJEBufferSink inc_prev;
+    uint64_t*     inc_hash[2];        // Of the source pixels of each MCU row.
+    size_t*       inc_offset[2];      // Where each row's data starts, and the last ends.
+    int           inc_cur;
+    int           inc_valid;          // inc_prev and its tables can be reused.
+    uint8_t       inc_qt[2][64];      // Tables inc_prev was encoded with.
+    uint32_t      inc_ehuff[4][256];
+
+    // See tje_encoder_set_thumbnail. The planes point into thumb_data.
+    int           thumb_mode;
+    uint8_t*      thumb_data;
+    TJEThumbnail  thumbnail;
+    TJEState      thumb_state;        // Annex K Huffman tables; quantization copied per frame.
+    TJEBufferSink thumb_output;
+};
+
+// Builds Huffman tables for `src_data` at the current quantization. If
+// `complete`, every symbol gets a code, so that other images can use them.
+static void tjei_optimize_huffman(TJEEncoder* encoder, const unsigned char* src_data, const int complete)
+{
+    TJEState* state = &encoder->state;
+    uint32_t freq[4][256];
+
+    memset(freq, 0, sizeof(freq));
+    if ( complete ) {
+        for ( int i = 0; i < 4; i += 2 ) {
+            for ( int size = 0; size <= 11; ++size ) {
+                freq[i][size] = 1;
+            }
+            freq[i + 1][0x00] = 1;
+            freq[i + 1][0xf0] = 1;
+            for ( int run = 0; run < 16; ++run ) {
+                for ( int size = 1; size <= 10; ++size ) {
+                    freq[i + 1][(run << 4) | size] = 1;
+                }
+            }
+        }
+    }
+
+    tjei_count_mcu_rows(state, src_data, encoder->width, encoder->height, encoder->num_components, freq);
+
+    // Grayscale has no chroma symbols to build tables from.
+    int num_tables = encoder->num_components == 1 ? 2 : 4;
+    for ( int i = 0; i < num_tables; ++i ) {
+        tjei_huff_optimize(freq[i], encoder->huff_bits[i], encoder->huff_vals[i]);
+        state->ht_bits[i] = encoder->huff_bits[i];
+        state->ht_vals[i] = encoder->huff_vals[i];
+    }
+    tjei_huff_build(state);
+}
+
+// Rebuilds the optimized Huffman tables that are reused, if due. Done before
+// rate control, which then estimates sizes with them.
+static void tjei_refresh_huffman(TJEEncoder* encoder, const unsigned char* src_data)
+{
+    if ( encoder->huff_interval > 1 && encoder->huff_age++ % encoder->huff_interval == 0 ) {
+        tjei_optimize_huffman(encoder, src_data, 1);
+    }
+}
+
+// Encodes the thumbnail of the frame just encoded, if asked to. Returns 0
+// on error.
+static int tjei_encode_thumbnail(TJEEncoder* encoder)
+{
+    if ( encoder->thumb_mode != TJE_THUMBNAIL_JPEG ) {
+        return 1;
+    }
+
+    TJEState* thumb = &encoder->thumb_state;
+    memcpy(thumb->qt_luma, encoder->state.qt_luma, 64);
+    memcpy(thumb->qt_chroma, encoder->state.qt_chroma, 64);
+#if TJE_USE_FAST_DCT
+    thumb->pqt = encoder->state.pqt;
+#endif
+    TJEPlanes img = { { 0 } };
+    for ( int c = 0; c < 3; ++c ) {
+        img.planes[c] = encoder->thumbnail.planes[c];
+        img.width[c] = encoder->thumbnail.width[c];
+        img.height[c] = encoder->thumbnail.height[c];
+        img.stride[c] = encoder->thumbnail.stride[c];
+    }
+
+    tjei_set_sink(thumb, &encoder->thumb_output);
+    int result = tjei_encode_planar(thumb, &img);
+
+    encoder->thumbnail.jpeg = result ? encoder->thumb_output.data : NULL;
+    encoder->thumbnail.jpeg_size = result ? encoder->thumb_output.count : 0;
+    return result;
+}
+
+// Hash of `len` bytes for spotting rows that haven't changed. Every step is
+// invertible, so a change to any one 8-byte word always changes the hash.
+static uint64_t tjei_hash(const uint8_t* data, size_t len)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    size_t i = 0;
+    for ( ; i + 8 <= len; i += 8 ) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    for ( ; i < len; ++i ) {
+        h = (h ^ data[i]) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+// Encodes one frame with a restart marker after every MCU row, copying the
+// rows that haven't changed from the previous frame.
+static size_t tjei_encode_incremental(TJEEncoder* encoder, const unsigned char* src_data)
+{
+    TJEState* state = &encoder->state;
+    TJEOutput* out = &state->output;
+    const int mcu_h = 8 * state->v_samp;
+    const int mcu_rows = (encoder->height + mcu_h - 1) / mcu_h;
+    const size_t row_bytes = (size_t)encoder->width * (size_t)encoder->num_components;
+    uint64_t* hash = encoder->inc_hash[encoder->inc_cur];
+    size_t* offset = encoder->inc_offset[encoder->inc_cur];
+    const uint64_t* prev_hash = encoder->inc_hash[encoder->inc_cur ^ 1];
+    const size_t* prev_offset = encoder->inc_offset[encoder->inc_cur ^ 1];
+
+    assert(state->restart_rows == 1);
+
+    int reuse = encoder->inc_valid &&
+                !memcmp(encoder->inc_qt[0], state->qt_luma, 64) &&
+                !memcmp(encoder->inc_qt[1], state->qt_chroma, 64) &&
+                !memcmp(encoder->inc_ehuff, state->ehuff, sizeof(encoder->inc_ehuff));
+
+    tjei_set_sink(state, &encoder->output);
+    tjei_write_headers(state, encoder->width, encoder->height, encoder->num_components);
+
+    for ( int row = 0; row < mcu_rows; ++row ) {
+        int y = row * mcu_h;
+        int num_lines = tjei_min(mcu_h, encoder->height - y);
+        hash[row] = tjei_hash(src_data + (size_t)y * row_bytes, (size_t)num_lines * row_bytes);
+        offset[row] = tjei_output_count(out);
+
+        if ( reuse && hash[row] == prev_hash[row] ) {
+            // Its RSTn marker included.
+            tjei_write(out, encoder->inc_prev.data + prev_offset[row], prev_offset[row + 1] - prev_offset[row], 1);
+        } else {
+            int pred[3] = { 0, 0, 0 };
+            TJEBitWriter bw;
+            tjei_bit_writer_init(&bw);
+            tjei_encode_mcu_rows((const TJEState* const*)&state, &out, &bw, &pred, 1, src_data,
+                                 encoder->width, encoder->height, encoder->num_components, row, row + 1);
+            if ( row == mcu_rows - 1 ) {
+                // The others were flushed before their RSTn marker.
+                if ( out->output_buffer_size - out->output_buffer_count < TJEI_MAX_BLOCK_BYTES ) {
+                    tjei_reserve(out, TJEI_MAX_BLOCK_BYTES);
+                }
+                tjei_flush_bits(out, &bw);
+            }
+        }
+        if ( encoder->output.overflow ) {
+            return 0;
+        }
+    }
+    offset[mcu_rows] = tjei_output_count(out);
+
+    uint16_t EOI = tjei_be_word(0xffd9);
+    tjei_write(out, &EOI, sizeof(uint16_t), 1);
+    tjei_flush_output(out);
+
+    if ( encoder->output.overflow ) {
+        return 0;
+    }
+    memcpy(encoder->inc_qt[0], state->qt_luma, 64);
+    memcpy(encoder->inc_qt[1], state->qt_chroma, 64);
+    memcpy(encoder->inc_ehuff, state->ehuff, sizeof(encoder->inc_ehuff));
+    return encoder->output.count;
+}
+
+// Encodes one frame into the encoder's output, at the current quality.
+static size_t tjei_encoder_encode_frame(TJEEncoder* encoder, const unsigned char* src_data)
+{
+    if ( encoder->huff_interval == 1 ) {
+        tjei_optimize_huffman(encoder, src_data, 0);
+    }
+    if ( encoder->incremental ) {
+        return tjei_encode_incremental(encoder, src_data);
+    }
+    return tjei_encode_to_sink(&encoder->state, &encoder->output,
+                               encoder->width, encoder->height, encoder->num_components,
+                               src_data);
+}
+
+TJEEncoder* tje_encoder_new(const int quality,
+                            const int width,
+                            const int height,
+                            const int num_components,
+                            const int subsampling)
+{
+    if ( width <= 0 || height <= 0 || width > 0xffff || height > 0xffff ) {
+        tje_log("[ERROR] -- Invalid image size\n");
+        return NULL;
+    }
+    if ( num_components != 1 && num_components != 3 && num_components != 4 ) {
+        tje_log("[ERROR] -- Valid 'num_components' values are 1, 3 or 4\n");
+        return NULL;
+    }
+
+    TJEEncoder* encoder = (TJEEncoder*)TJE_MALLOC(sizeof(TJEEncoder));
+    if ( !encoder ) {
+        return NULL;
+    }
+    memset(encoder, 0, sizeof(TJEEncoder));
+
+    // A single component has nothing to subsample.
+    if ( !tjei_init_state(&encoder->state, quality, num_components == 1 ? TJE_SUBSAMPLING_444 : subsampling) ) {
+        TJE_FREE(encoder);
+        return NULL;
+    }
+    encoder->width = width;
+    encoder->height = height;
+    encoder->num_components = num_components;
+
+    // Typically plenty. Grows, once, for frames that don't fit.
+    encoder->output.size = (size_t)width * (size_t)height * 2;
+    encoder->output.data = (uint8_t*)TJE_MALLOC(encoder->output.size);
+    encoder->output.growable = 1;
+    if ( !encoder->output.data ) {
+        TJE_FREE(encoder);
+        return NULL;
+    }
+
+    return encoder;
+}
+
+// Rows of MCUs per row encoded by rate control trials.
+#define TJEI_RC_ROW_STRIDE 8
+// Encodes per frame, at most, when the first comes out over the target.
+#define TJEI_RC_MAX_ATTEMPTS 3
+
+// Estimates the size of `src_data` at `quality`, before correction by
+// rc_ratio, by encoding every TJEI_RC_ROW_STRIDE-th row of MCUs. Uses the
+// encoder's output buffer as scratch space.
+static float tjei_rc_estimate(TJEEncoder* encoder, const unsigned char* src_data, const int quality)
+{
+    if ( encoder->rc_estimate[quality] > 0 ) {
+        return encoder->rc_estimate[quality];
+    }
+
+    TJEState* state = &encoder->state;
+    TJEOutput* out = &state->output;
+    const int mcu_rows = (encoder->height + 8 * state->v_samp - 1) / (8 * state->v_samp);
+    // Small images are cheap enough to encode whole.
+    const int stride = mcu_rows >= 2 * TJEI_RC_ROW_STRIDE ? TJEI_RC_ROW_STRIDE : 1;
+
+    tjei_set_scaled_qt(state, quality);
+    tjei_set_sink(state, &encoder->output);
+    tjei_write_headers(state, encoder->width, encoder->height, encoder->num_components);
+    size_t header_bytes = out->output_buffer_count;
+
+    int pred[3] = { 0, 0, 0 };
+    TJEBitWriter bw;
+    tjei_bit_writer_init(&bw);
+
+    int num_rows = 0;
+    for ( int row = stride / 2; row < mcu_rows; row += stride ) {
+        tjei_encode_mcu_rows((const TJEState* const*)&state, &out, &bw, &pred, 1, src_data,
+                             encoder->width, encoder->height, encoder->num_components, row, row + 1);
+        ++num_rows;
+    }
+    if ( out->output_buffer_size - out->output_buffer_count < TJEI_MAX_BLOCK_BYTES ) {
+        tjei_reserve(out, TJEI_MAX_BLOCK_BYTES);
+    }
+    tjei_flush_bits(out, &bw);
+    tjei_flush_output(out);
+
+    float estimate = (float)header_bytes +
+                     (float)(encoder->output.count - header_bytes) * (float)mcu_rows / (float)num_rows;
+    encoder->rc_estimate[quality] = tjei_max(estimate, 1.0f);
+    return encoder->rc_estimate[quality];
+}
+
+static int tjei_rc_fits(TJEEncoder* encoder, const unsigned char* src_data, const int quality)
+{
+    return tjei_rc_estimate(encoder, src_data, quality) * encoder->rc_ratio <= (float)encoder->target_size;
+}
+
+// Highest quality estimated to fit the target, or 1. Searches outwards from
+// the last frame's quality first: a stream's frames tend to be alike, so this
+// usually needs only a few trials.
+static int tjei_rc_pick_quality(TJEEncoder* encoder, const unsigned char* src_data)
+{
+    int lo = 1;
+    int hi = encoder->rc_max_quality;  // The answer is in [lo, hi].
+    int step = 4;
+    int quality = tjei_min(encoder->quality, hi);
+
+    if ( tjei_rc_fits(encoder, src_data, quality) ) {
+        lo = quality;
+        while ( lo < hi ) {
+            int probe = tjei_min(lo + step, hi);
+            if ( !tjei_rc_fits(encoder, src_data, probe) ) {
+                hi = probe - 1;
+                break;
+            }
+            lo = probe;
+            step *= 2;
+        }
+    } else {
+        hi = quality - 1;
+        while ( lo < hi ) {
+            int probe = tjei_max(hi - step, lo);
+            if ( tjei_rc_fits(encoder, src_data, probe) ) {
+                lo = probe;
+                break;
+            }
+            hi = probe - 1;
+            step *= 2;
+        }
+    }
+
+    while ( lo < hi ) {
+        int mid = (lo + hi + 1) / 2;
+        if ( tjei_rc_fits(encoder, src_data, mid) ) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+static size_t tjei_rc_encode(TJEEncoder* encoder, const unsigned char* src_data)
+{
+    size_t len = 0;
+
+    for ( int i = 0; i <= 100; ++i ) {
+        encoder->rc_estimate[i] = 0;
+    }
+
+    for ( int attempt = 0; attempt < TJEI_RC_MAX_ATTEMPTS; ++attempt ) {
+        // Exact tables only fit the quality they were built for, so trials
+        // use the Annex K ones.
+        if ( encoder->huff_interval == 1 ) {
+            tjei_huff_expand(&encoder->state);
+        }
+        int quality = tjei_rc_pick_quality(encoder, src_data);
+        float estimate = tjei_rc_estimate(encoder, src_data, quality);
+
+        tjei_set_scaled_qt(&encoder->state, quality);
+        len = tjei_encoder_encode_frame(encoder, src_data);
+        if ( !len ) {
+            return 0;
+        }
+        encoder->quality = quality;
+
+        float ratio = (float)len / estimate;
+        if ( len <= encoder->target_size || quality == 1 ) {
+            // Smooth it out for the next frame.
+            encoder->rc_ratio = 0.5f * (encoder->rc_ratio + ratio);
+            break;
+        }
+        // Over budget. Try again knowing exactly how far off this frame's
+        // estimates are.
+        encoder->rc_ratio = ratio;
+    }
+    return len;
+}
+
+size_t tje_encoder_encode(TJEEncoder* encoder,
+                          const unsigned char* src_data,
+                          const unsigned char** jpeg)
+{
+    size_t len;
+
+    if ( encoder->incremental ) {
+        // Keep the last frame to copy rows from, and encode into the one
+        // before it.
+        TJEBufferSink prev = encoder->inc_prev;
+        encoder->inc_prev = encoder->output;
+        encoder->output = prev;
+        encoder->inc_cur ^= 1;
+    }
+
+    tjei_refresh_huffman(encoder, src_data);
+
+    if ( encoder->target_size ) {
+        len = tjei_rc_encode(encoder, src_data);
+    } else {
+        len = tjei_encoder_encode_frame(encoder, src_data);
+    }
+    encoder->inc_valid = encoder->incremental && len;
+
+    if ( len && !tjei_encode_thumbnail(encoder) ) {
+        len = 0;
+    }
+
+    if ( jpeg ) {
+        *jpeg = len ? encoder->output.data : NULL;
+    }
+    return len;
+}
+
+int tje_encoder_encode_ladder(TJEEncoder* const encoders[],
+                              const int num_encoders,
+                              const unsigned char* src_data,
+                              const unsigned char* jpegs[],
+                              size_t sizes[])
+{
+    TJEState* states[TJE_MAX_LADDER];
+
+    if ( num_encoders < 1 || num_encoders > TJE_MAX_LADDER ) {
+        tje_log("[ERROR] -- Invalid number of encoders\n");
+        return 0;
+    }
+    const TJEEncoder* first = encoders[0];
+    for ( int k = 0; k < num_encoders; ++k ) {
+        const TJEEncoder* encoder = encoders[k];
+        if ( encoder->width != first->width || encoder->height != first->height ||
+             encoder->num_components != first->num_components ||
+             encoder->state.h_samp != first->state.h_samp || encoder->state.v_samp != first->state.v_samp ||
+             encoder->state.restart_rows != first->state.restart_rows || encoder->target_size ) {
+            tje_log("[ERROR] -- Encoders don't match\n");
+            return 0;
+        }
+    }
+
+    for ( int k = 0; k < num_encoders; ++k ) {
+        TJEEncoder* encoder = encoders[k];
+        tjei_refresh_huffman(encoder, src_data);
+        if ( encoder->huff_interval == 1 ) {
+            tjei_optimize_huffman(encoder, src_data, 0);
+        }
+        tjei_set_sink(&encoder->state, &encoder->output);
+        states[k] = &encoder->state;
+        // Rows aren't tracked here.
+        encoder->inc_valid = 0;
+    }
+
+    int result = tjei_encode_ladder(states, num_encoders, src_data,
+                                    first->width, first->height, first->num_components);
+
+    for ( int k = 0; k < num_encoders; ++k ) {
+        TJEEncoder* encoder = encoders[k];
+        if ( encoder->output.overflow || (result && !tjei_encode_thumbnail(encoder)) ) {
+            result = 0;
+        }
+    }
+    for ( int k = 0; k < num_encoders; ++k ) {
+        jpegs[k] = result ? encoders[k]->output.data : NULL;
+        sizes[k] = result ? encoders[k]->output.count : 0;
+    }
+    return result;
+}
+
+static void tjei_free_slices(TJEState* state)
+{
+    for ( int i = 0; i < state->num_slices; ++i ) {
+        TJE_FREE(state->slices[i].sink.data);
+    }
+    TJE_FREE(state->slices);
+    state->slices = NULL;
+    state->num_slices = 0;
+}
+
+static void tjei_free_incremental(TJEEncoder* encoder)
+{
+    TJE_FREE(encoder->inc_prev.data);
+    for ( int i = 0; i < 2; ++i ) {
+        TJE_FREE(encoder->inc_hash[i]);
+        TJE_FREE(encoder->inc_offset[i]);
+        encoder->inc_hash[i] = NULL;
+        encoder->inc_offset[i] = NULL;
+    }
+    memset(&encoder->inc_prev, 0, sizeof(TJEBufferSink));
+    encoder->incremental = 0;
+    encoder->inc_valid = 0;
+}
+
+int tje_encoder_set_restart_interval(TJEEncoder* encoder,
+                                     const int mcu_rows,
+                                     const int num_threads)
+{
+    TJEState* state = &encoder->state;
+    int mcus_per_row = (encoder->width + 8 * state->h_samp - 1) / (8 * state->h_samp);
+
+    if ( mcu_rows < 0 || num_threads < 1 || (size_t)mcus_per_row * (size_t)mcu_rows > 0xffff ) {
+        tje_log("[ERROR] -- Invalid restart interval\n");
+        return 0;
+    }
+
+    tjei_free_slices(state);
+    tjei_free_incremental(encoder);
+    state->restart_rows = mcu_rows;
+
+    int num_slices = mcu_rows ? num_threads - 1 : 0;
+    if ( num_slices ) {
+        state->slices = (TJESlice*)TJE_MALLOC(num_slices * sizeof(TJESlice));
+        if ( !state->slices ) {
+            state->restart_rows = 0;
+            return 0;
+        }
+        memset(state->slices, 0, num_slices * sizeof(TJESlice));
+        state->num_slices = num_slices;
+
+        for ( int i = 0; i < num_slices; ++i ) {
+            TJESlice* slice = &state->slices[i];
+            slice->sink.size = encoder->output.size / (size_t)num_threads;
+            slice->sink.data = (uint8_t*)TJE_MALLOC(slice->sink.size);
+            slice->sink.growable = 1;
+            if ( !slice->sink.data ) {
+                tjei_free_slices(state);
+                state->restart_rows = 0;
+                return 0;
+            }
+            slice->output.write_context.context = &slice->sink;
+            slice->output.write_context.func = tjei_sink_func;
+            slice->output.sink = &slice->sink;
+        }
+    }
+    return 1;
+}
+
+int tje_encoder_set_incremental(TJEEncoder* encoder, const int enable)
+{
+    if ( !tje_encoder_set_restart_interval(encoder, enable ? 1 : 0, 1) || !enable ) {
+        return !enable;
+    }
+
+    const int mcu_rows = (encoder->height + 8 * encoder->state.v_samp - 1) / (8 * encoder->state.v_samp);
+    int ok = 1;
+    for ( int i = 0; i < 2; ++i ) {
+        encoder->inc_hash[i] = (uint64_t*)TJE_MALLOC((size_t)mcu_rows * sizeof(uint64_t));
+        encoder->inc_offset[i] = (size_t*)TJE_MALLOC((size_t)(mcu_rows + 1) * sizeof(size_t));
+        ok = ok && encoder->inc_hash[i] && encoder->inc_offset[i];
+    }
+    encoder->inc_prev.size = encoder->output.size;
+    encoder->inc_prev.data = (uint8_t*)TJE_MALLOC(encoder->inc_prev.size);
+    encoder->inc_prev.growable = 1;
+    if ( !ok || !encoder->inc_prev.data ) {
+        tjei_free_incremental(encoder);
+        tje_encoder_set_restart_interval(encoder, 0, 1);
+        return 0;
+    }
+    encoder->incremental = 1;
+    return 1;
+}
+
+int tje_encoder_set_quality(TJEEncoder* encoder, const int quality)
+{
+    if ( quality < 1 || quality > 100 ) {
+        tje_log("[ERROR] -- Valid 'quality' values are 1 (lowest) to 100 (highest)\n");
+        return 0;
+    }
+    encoder->quality = quality;
+    tjei_set_scaled_qt(&encoder->state, quality);
+    return 1;
+}
+
+int tje_encoder_set_target_size(TJEEncoder* encoder,
+                                const size_t target_size,
+                                const int max_quality)
+{
+    if ( max_quality < 1 || max_quality > 100 ) {
+        tje_log("[ERROR] -- Valid 'max_quality' values are 1 (lowest) to 100 (highest)\n");
+        return 0;
+    }
+    encoder->target_size = target_size;
+    encoder->rc_max_quality = max_quality;
+    encoder->rc_ratio = 1.0f;
+    if ( !encoder->quality ) {
+        encoder->quality = 75;  // First guess.
+    }
+    return 1;
+}
+
+int tje_encoder_set_optimize_huffman(TJEEncoder* encoder, const int interval)
+{
+    if ( interval < 0 ) {
+        tje_log("[ERROR] -- Invalid Huffman optimization interval\n");
+        return 0;
+    }
+    encoder->huff_interval = interval;
+    encoder->huff_age = 0;
+    if ( !interval ) {
+        tjei_huff_expand(&encoder->state);
+    }
+    return 1;
+}
+
+int tje_encoder_get_quality(const TJEEncoder* encoder)
+{
+    return encoder->quality;
+}
+
+static void tjei_free_thumbnail(TJEEncoder* encoder)
+{
+    TJE_FREE(encoder->thumb_data);
+    TJE_FREE(encoder->thumb_output.data);
+    encoder->thumb_data = NULL;
+    encoder->thumb_output.data = NULL;
+    encoder->thumb_mode = TJE_THUMBNAIL_NONE;
+    memset(&encoder->thumbnail, 0, sizeof(TJEThumbnail));
+    memset(encoder->state.dc_planes, 0, sizeof(encoder->state.dc_planes));
+}
+
+int tje_encoder_set_thumbnail(TJEEncoder* encoder, const int mode)
+{
+    if ( mode < TJE_THUMBNAIL_NONE || mode > TJE_THUMBNAIL_JPEG ) {
+        tje_log("[ERROR] -- Invalid thumbnail mode\n");
+        return 0;
+    }
+    tjei_free_thumbnail(encoder);
+    if ( mode == TJE_THUMBNAIL_NONE ) {
+        return 1;
+    }
+
+    TJEState* state = &encoder->state;
+    TJEThumbnail* thumb = &encoder->thumbnail;
+    const int mcus_x = (encoder->width + 8 * state->h_samp - 1) / (8 * state->h_samp);
+    const int mcus_y = (encoder->height + 8 * state->v_samp - 1) / (8 * state->v_samp);
+    const int num_planes = encoder->num_components == 1 ? 1 : 3;
+
+    // Blocks of padding MCUs land past the edges of the planes.
+    size_t offset[3];
+    size_t size = 0;
+    for ( int i = 0; i < num_planes; ++i ) {
+        int samp_x = i ? 1 : state->h_samp;
+        int samp_y = i ? 1 : state->v_samp;
+        state->dc_stride[i] = thumb->stride[i] = mcus_x * samp_x;
+        thumb->width[i] = (encoder->width + 8 * state->h_samp / samp_x - 1) / (8 * state->h_samp / samp_x);
+        thumb->height[i] = (encoder->height + 8 * state->v_samp / samp_y - 1) / (8 * state->v_samp / samp_y);
+        offset[i] = size;
+        size += (size_t)thumb->stride[i] * (size_t)(mcus_y * samp_y);
+    }
+
+    encoder->thumb_data = (uint8_t*)TJE_MALLOC(size);
+    if ( !encoder->thumb_data ) {
+        return 0;
+    }
+    memset(encoder->thumb_data, 0, size);
+    for ( int i = 0; i < num_planes; ++i ) {
+        state->dc_planes[i] = encoder->thumb_data + offset[i];
+        thumb->planes[i] = state->dc_planes[i];
+    }
+
+    if ( mode == TJE_THUMBNAIL_JPEG ) {
+        int subsampling = state->v_samp == 2 ? TJE_SUBSAMPLING_420 :
+                          state->h_samp == 2 ? TJE_SUBSAMPLING_422 : TJE_SUBSAMPLING_444;
+        tjei_init_state(&encoder->thumb_state, 1, subsampling);
+        encoder->thumb_output.size = tje_encode_bound(thumb->width[0], thumb->height[0]);
+        encoder->thumb_output.data = (uint8_t*)TJE_MALLOC(encoder->thumb_output.size);
+        if ( !encoder->thumb_output.data ) {
+            tjei_free_thumbnail(encoder);
+            return 0;
+        }
+    }
+    encoder->thumb_mode = mode;
+    return 1;
+}
+
+const TJEThumbnail* tje_encoder_get_thumbnail(const TJEEncoder* encoder)
+{
+    return encoder->thumb_mode != TJE_THUMBNAIL_NONE ? &encoder->thumbnail : NULL;
+}
+
+void tje_encoder_free(TJEEncoder* encoder)
+{
+    if ( encoder ) {
+        tjei_free_thumbnail(encoder);
+        tjei_free_incremental(encoder);
+        tjei_free_slices(&encoder->state);
+        TJE_FREE(encoder->output.data);
+        TJE_FREE(encoder);
+    }
+}
+// ============================================================
+// JPEG parsing and Huffman decoding
+// ============================================================
+
+// Codes of up to this many bits are decoded with one table lookup.
+#define TJEI_HUFF_FAST_BITS 9
+
+// Natural index of each coefficient in zig-zag order. The inverse of tjei_zig_zag.
+static const uint8_t tjei_dezigzag[64] =
+{
+    0,   1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+typedef struct
+{
+    // (length << 8) | symbol for each TJEI_HUFF_FAST_BITS-bit string that
+    // starts with a code of up to that length. 0 otherwise.
+    uint16_t        fast[1 << TJEI_HUFF_FAST_BITS];
+    // For AC tables: (value << 8) | (run << 4) | total length, for bit
+    // strings that hold both a code and its coefficient's value bits, when
+    // the value is within -128..127. 0 otherwise.
+    int16_t         fast_ac[1 << TJEI_HUFF_FAST_BITS];
+    // For each code length, one past its largest code, left-aligned to 16
+    // bits, and the index in `vals` of its first code minus that code.
+    uint32_t        maxcode[18];
+    int             delta[17];
+    uint8_t         vals[256];
+    int             defined;
+} TJEIHuffDecoder;
+
+// A baseline JPEG, parsed up to its entropy-coded data.
+typedef struct
+{
+    int             width;
+    int             height;
+    int             num_components;
+    int             h_max;          // Sampling factors of the luma, which is
+    int             v_max;          // the only component that can have more than 1.
+    int             mcus_x;
+    int             mcus_y;
+    struct
+    {
+        int         h, v;           // Sampling factors.
+        int         tq;             // Quantization table.
+        int         td, ta;         // DC and AC Huffman tables.
+    } comp[3];
+    uint8_t         qt[4][64];      // In natural order.
+    TJEIHuffDecoder huff[2][4];     // DC, then AC.
+    int             restart_interval;
+    const uint8_t*  scan;           // Entropy-coded data, up to the end of the file.
+    const uint8_t*  end;
+} TJEIJpeg;
+
+// Reads entropy-coded data. Stuffed zero bytes are dropped. At a marker it
+// stops and feeds zeros.
+typedef struct
+{
+    const uint8_t*  data;
+    const uint8_t*  end;
+    uint64_t        bits;           // Left-aligned.
+    int             num_bits;
+    int             marker;
+} TJEIBitReader;
+
+static int tjei_huff_decoder_build(TJEIHuffDecoder* h, const uint8_t bits[16], const uint8_t* vals)
+{
+    int code = 0;
+    int k = 0;
+
+    memset(h->fast, 0, sizeof(h->fast));
+    for ( int len = 1; len <= 16; ++len ) {
+        h->delta[len] = k - code;
+        // Check before filling `fast`: too many short codes would run past it.
+        if ( code + bits[len - 1] > (1 << len) ) {
+            return 0;  // More codes than fit in `len` bits.
+        }
+        if ( k + bits[len - 1] > (int)(sizeof(h->vals) / sizeof(h->vals[0])) ) {
+            return 0;
+        }
+        for ( int i = 0; i < bits[len - 1]; ++i, ++k, ++code ) {
+            h->vals[k] = vals[k];
+            if ( len <= TJEI_HUFF_FAST_BITS ) {
+                int first = code << (TJEI_HUFF_FAST_BITS - len);
+                for ( int j = 0; j < (1 << (TJEI_HUFF_FAST_BITS - len)); ++j ) {
+                    h->fast[first + j] = (uint16_t)((len << 8) | vals[k]);
+                }
+            }
+        }
+        h->maxcode[len] = (uint32_t)code << (16 - len);
+        code <<= 1;
+    }
+
+    for ( int i = 0; i < (1 << TJEI_HUFF_FAST_BITS); ++i ) {
+        int fast = h->fast[i];
+        int len = fast >> 8;
+        int run = (fast >> 4) & 15;
+        int size = fast & 15;
+        h->fast_ac[i] = 0;
+        if ( fast && size && len + size <= TJEI_HUFF_FAST_BITS ) {
+            int v = (i >> (TJEI_HUFF_FAST_BITS - len - size)) & ((1 << size) - 1);
+            if ( v < (1 << (size - 1)) ) {
+                v -= (1 << size) - 1;
+            }
+            if ( v >= -128 && v <= 127 ) {
+                h->fast_ac[i] = (int16_t)(v * 256 + (run << 4) + len + size);
+            }
+        }
+    }
+    h->maxcode[17] = 0xffffffff;
+    h->defined = 1;
+    return 1;
+}
+
+static void tjei_bit_reader_init(TJEIBitReader* br, const uint8_t* data, const uint8_t* end)
+{
+    br->data = data;
+    br->end = end;
+    br->bits = 0;
+    br->num_bits = 0;
+    br->marker = 0;
+}
+
+// Tops the reader up to at least 57 bits.
+static void tjei_bit_reader_fill(TJEIBitReader* br)
+{
+    if ( !br->marker && br->end - br->data >= 8 ) {
+        // As many whole bytes as fit in one go, unless one of them is 0xff.
+        const uint8_t* p = br->data;
+        int bytes = (64 - br->num_bits) / 8;
+        uint64_t word = ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+                        ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+                        ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+                        ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+        word &= ~0ULL << (64 - 8 * bytes);
+        if ( !TJEI_HAS_FF_BYTE(word) ) {
+            br->bits |= word >> br->num_bits;
+            br->num_bits += 8 * bytes;
+            br->data += bytes;
+            return;
+        }
+    }
+    while ( br->num_bits <= 56 ) {
+        uint64_t byte = 0;
+        if ( !br->marker && br->data < br->end ) {
+            byte = br->data[0];
+            if ( byte != 0xff ) {
+                br->data++;
+            } else if ( br->data + 1 < br->end && br->data[1] == 0x00 ) {
+                br->data += 2;
+            } else {
+                br->marker = 1;
+                byte = 0;
+            }
+        }
+        br->bits |= byte << (56 - br->num_bits);
+        br->num_bits += 8;
+    }
+}
+
+// Skips to just past the next RSTn marker. Returns 0 if there is none.
+static int tjei_bit_reader_restart(TJEIBitReader* br)
+{
+    const uint8_t* p = br->data;
+    while ( p + 1 < br->end && !(p[0] == 0xff && p[1] >= 0xd0 && p[1] <= 0xd7) ) {
+        ++p;
+    }
+    if ( p + 1 >= br->end ) {
+        return 0;
+    }
+    tjei_bit_reader_init(br, p + 2, br->end);
+    return 1;
+}
+
+// Returns the next Huffman-coded symbol, or -1 on a bad code.
+TJEI_FORCE_INLINE int tjei_huff_decode(TJEIBitReader* br, const TJEIHuffDecoder* h)
+{
+    if ( br->num_bits < 16 ) {
+        tjei_bit_reader_fill(br);
+    }
+    int len;
+    int sym;
+    unsigned fast = h->fast[br->bits >> (64 - TJEI_HUFF_FAST_BITS)];
+    if ( fast ) {
+        len = (int)(fast >> 8);
+        sym = (int)(fast & 0xff);
+    } else {
+        uint32_t peek = (uint32_t)(br->bits >> 48);
+        if ( peek < h->maxcode[TJEI_HUFF_FAST_BITS] ) {
+            return -1;
+        }
+        for ( len = TJEI_HUFF_FAST_BITS + 1; peek >= h->maxcode[len]; ++len ) {
+        }
+        if ( len > 16 ) {
+            return -1;
+        }
+        sym = h->vals[(int)(peek >> (16 - len)) + h->delta[len]];
+    }
+    br->bits <<= len;
+    br->num_bits -= len;
+    return sym;
+}
+
+// Reads `size` bits, 1 to 16, as a coefficient of that category (F.2.2.1).
+TJEI_FORCE_INLINE int tjei_receive_extend(TJEIBitReader* br, const int size)
+{
+    if ( br->num_bits < size ) {
+        tjei_bit_reader_fill(br);
+    }
+    int v = (int)(br->bits >> (64 - size));
+    br->bits <<= size;
+    br->num_bits -= size;
+    return v < (1 << (size - 1)) ? v - (1 << size) + 1 : v;
+}
+
+// Decodes a block's quantized coefficients, in natural order. Returns the
+// zig-zag index of the last coefficient plus 1, or 0 on corrupt data.
+static int tjei_decode_block(TJEIBitReader* br,
+                             const TJEIHuffDecoder* huff_dc,
+                             const TJEIHuffDecoder* huff_ac,
+                             int* pred,
+                             int16_t coef[64])
+{
+    memset(coef, 0, 64 * sizeof(int16_t));
+
+    int size = tjei_huff_decode(br, huff_dc);
+    if ( size < 0 || size > 11 ) {
+        return 0;
+    }
+    *pred += size ? tjei_receive_extend(br, size) : 0;
+    if ( *pred < -1024 || *pred > 1024 ) {
+        return 0;
+    }
+    coef[0] = (int16_t)*pred;
+
+    int last = 1;
+    for ( int k = 1; k < 64; ) {
+        if ( br->num_bits < 16 ) {
+            tjei_bit_reader_fill(br);
+        }
+        int fast = huff_ac->fast_ac[br->bits >> (64 - TJEI_HUFF_FAST_BITS)];
+        if ( fast ) {
+            int len = fast & 15;
+            br->bits <<= len;
+            br->num_bits -= len;
+            k += (fast >> 4) & 15;
+            if ( k > 63 ) {
+                return 0;
+            }
+            coef[tjei_dezigzag[k++]] = (int16_t)(fast >> 8);
+            last = k;
+            continue;
+        }
+
+        int rs = tjei_huff_decode(br, huff_ac);
+        if ( rs < 0 ) {
+            return 0;
+        }
+        int run = rs >> 4;
+        size = rs & 15;
+        if ( !size ) {
+            if ( run != 15 ) {
+                break;  // EOB
+            }
+            k += 16;
+            continue;
+        }
+        k += run;
+        if ( k > 63 || size > 10 ) {
+            return 0;
+        }
+        coef[tjei_dezigzag[k++]] = (int16_t)tjei_receive_extend(br, size);
+        last = k;
+    }
+    return last;
+}
+
+// Parses everything up to the entropy-coded data. Returns 0 if the JPEG is
+// invalid, or isn't a single-scan baseline JPEG tjei_decode_coefficients can
+// handle.
+static int tjei_parse_jpeg(TJEIJpeg* jpeg, const uint8_t* data, const size_t size)
+{
+    const uint8_t* p = data;
+    const uint8_t* end = data + size;
+    int qt_defined = 0;
+    int have_sof = 0;
+
+    memset(jpeg, 0, sizeof(TJEIJpeg));
+    if ( size < 4 || p[0] != 0xff || p[1] != 0xd8 ) {
+        return 0;
+    }
+    p += 2;
+
+    for (;;) {
+        // Markers may be preceded by any number of 0xff fill bytes.
+        if ( p >= end || *p != 0xff ) {
+            return 0;
+        }
+        while ( p < end && *p == 0xff ) {
+            ++p;
+        }
+        if ( p >= end ) {
+            return 0;
+        }
+        int marker = *p++;
+        if ( marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7) ) {
+            continue;
+        }
+        if ( marker == 0xd8 || marker == 0xd9 || end - p < 2 ) {
+            return 0;
+        }
+        size_t len = ((size_t)p[0] << 8) | p[1];
+        if ( len < 2 || (size_t)(end - p) < len ) {
+            return 0;
+        }
+        const uint8_t* seg = p + 2;
+        const uint8_t* seg_end = p + len;
+        p = seg_end;
+
+        switch ( marker ) {
+        case 0xdb:  // DQT
+            while ( seg < seg_end ) {
+                int tq = seg[0] & 15;
+                // 16-bit tables are for 12-bit samples only.
+                if ( (seg[0] >> 4) != 0 || tq > 3 || seg_end - seg < 65 ) {
+                    return 0;
+                }
+                for ( int k = 0; k < 64; ++k ) {
+                    jpeg->qt[tq][tjei_dezigzag[k]] = seg[1 + k];
+                }
+                qt_defined |= 1 << tq;
+                seg += 65;
+            }
+            break;
+        case 0xc4:  // DHT
+            while ( seg < seg_end ) {
+                int tc = seg[0] >> 4;
+                int th = seg[0] & 15;
+                if ( tc > 1 || th > 3 || seg_end - seg < 17 ) {
+                    return 0;
+                }
+                int count = 0;
+                for ( int i = 0; i < 16; ++i ) {
+                    count += seg[1 + i];
+                }
+                if ( count > 256 || seg_end - seg < 17 + count ||
+                     !tjei_huff_decoder_build(&jpeg->huff[tc][th], seg + 1, seg + 17) ) {
+                    return 0;
+                }
+                seg += 17 + count;
+            }
+            break;
+        case 0xdd:  // DRI
+            if ( len != 4 ) {
+                return 0;
+            }
+            jpeg->restart_interval = (seg[0] << 8) | seg[1];
+            break;
+        case 0xc0:  // Baseline
+        case 0xc1:  // Extended sequential, Huffman-coded
+            if ( have_sof || len < 8 || seg[0] != 8 ) {
+                return 0;
+            }
+            jpeg->height = (seg[1] << 8) | seg[2];
+            jpeg->width = (seg[3] << 8) | seg[4];
+            jpeg->num_components = seg[5];
+            if ( !jpeg->width || !jpeg->height ||
+                 (jpeg->num_components != 1 && jpeg->num_components != 3) ||
+                 len != 8 + 3 * (size_t)jpeg->num_components ) {
+                return 0;
+            }
+            for ( int c = 0; c < jpeg->num_components; ++c ) {
+                const uint8_t* spec = seg + 6 + 3 * c;
+                jpeg->comp[c].h = spec[1] >> 4;
+                jpeg->comp[c].v = spec[1] & 15;
+                jpeg->comp[c].tq = spec[2];
+                if ( jpeg->comp[c].tq > 3 ) {
+                    return 0;
+                }
+            }
+            have_sof = 1;
+            break;
+        case 0xda:  // SOS
+            if ( !have_sof || len != 6 + 2 * (size_t)jpeg->num_components ||
+                 seg[0] != jpeg->num_components ) {
+                return 0;  // Only a single scan with every component.
+            }
+            for ( int c = 0; c < jpeg->num_components; ++c ) {
+                // The component ids aren't checked. The scan lists the
+                // components in frame order in practice.
+                jpeg->comp[c].td = seg[2 + 2 * c] >> 4;
+                jpeg->comp[c].ta = seg[2 + 2 * c] & 15;
+                if ( jpeg->comp[c].td > 3 || jpeg->comp[c].ta > 3 ) {
+                    return 0;
+                }
+            }
+            {
+                const uint8_t* ss = seg + 1 + 2 * jpeg->num_components;
+                if ( ss[0] != 0 || ss[1] != 63 || ss[2] != 0 ) {
+                    return 0;
+                }
+            }
+            jpeg->scan = seg_end;
+            jpeg->end = end;
+            goto scan;
+        default:
+            // Other SOFn are progressive, lossless or arithmetic-coded.
+            if ( marker >= 0xc2 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc ) {
+                return 0;
+            }
+            break;  // APPn, COM and the like.
+        }
+    }
+
+scan:
+    if ( jpeg->num_components == 1 ) {
+        // A single component is coded block by block, whatever its factors.
+        jpeg->comp[0].h = jpeg->comp[0].v = 1;
+    }
+    jpeg->h_max = jpeg->comp[0].h;
+    jpeg->v_max = jpeg->comp[0].v;
+    if ( jpeg->h_max < 1 || jpeg->h_max > 2 || jpeg->v_max < 1 || jpeg->v_max > 2 ) {
+        return 0;
+    }
+    for ( int c = 0; c < jpeg->num_components; ++c ) {
+        if ( (c && (jpeg->comp[c].h != 1 || jpeg->comp[c].v != 1)) ||
+             !(qt_defined & (1 << jpeg->comp[c].tq)) ) {
+            return 0;
+        }
+        // Motion-JPEG frames rely on the Annex K tables.
+        int td = jpeg->comp[c].td;
+        int ta = jpeg->comp[c].ta;
+        if ( !jpeg->huff[0][td].defined ) {
+            tjei_huff_decoder_build(&jpeg->huff[0][td],
+                                    td ? tjei_default_ht_chroma_dc_len : tjei_default_ht_luma_dc_len,
+                                    td ? tjei_default_ht_chroma_dc : tjei_default_ht_luma_dc);
+        }
+        if ( !jpeg->huff[1][ta].defined ) {
+            tjei_huff_decoder_build(&jpeg->huff[1][ta],
+                                    ta ? tjei_default_ht_chroma_ac_len : tjei_default_ht_luma_ac_len,
+                                    ta ? tjei_default_ht_chroma_ac : tjei_default_ht_luma_ac);
+        }
+    }
+    jpeg->mcus_x = (jpeg->width + 8 * jpeg->h_max - 1) / (8 * jpeg->h_max);
+    jpeg->mcus_y = (jpeg->height + 8 * jpeg->v_max - 1) / (8 * jpeg->v_max);
+    return 1;
+}
+
+// Decodes the quantized coefficients of every block, 64 per block in natural
+// order. Component c's blocks are in rows of mcus_x * comp[c].h, and there
+// are mcus_y * comp[c].v rows. Returns 0 on corrupt data.
+static int tjei_decode_coefficients(const TJEIJpeg* jpeg, int16_t* coefs[3])
+{
+    TJEIBitReader br;
+    int pred[3] = { 0, 0, 0 };
+    int todo = jpeg->restart_interval;
+
+    tjei_bit_reader_init(&br, jpeg->scan, jpeg->end);
+
+    for ( int my = 0; my < jpeg->mcus_y; ++my ) {
+        for ( int mx = 0; mx < jpeg->mcus_x; ++mx ) {
+            if ( jpeg->restart_interval ) {
+                if ( !todo ) {
+                    if ( !tjei_bit_reader_restart(&br) ) {
+                        return 0;
+                    }
+                    pred[0] = pred[1] = pred[2] = 0;
+                    todo = jpeg->restart_interval;
+                }
+                --todo;
+            }
+            for ( int c = 0; c < jpeg->num_components; ++c ) {
+                const int h = jpeg->comp[c].h;
+                const int v = jpeg->comp[c].v;
+                const size_t stride = (size_t)jpeg->mcus_x * (size_t)h;
+                for ( int y = 0; y < v; ++y ) {
+                    for ( int x = 0; x < h; ++x ) {
+                        size_t block = (size_t)(my * v + y) * stride + (size_t)(mx * h + x);
+                        if ( !tjei_decode_block(&br,
+                                                &jpeg->huff[0][jpeg->comp[c].td],
+                                                &jpeg->huff[1][jpeg->comp[c].ta],
+                                                &pred[c], coefs[c] + block * 64) ) {
+                            return 0;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+// ============================================================
+// Lossless transforms
+// ============================================================
+
+typedef struct
+{
+    const TJEIJpeg* jpeg;
+    int16_t*        coefs[3];
+    int             transpose;      // Applied first, then the flips.
+    int             flip_x;         // Of the source, after cropping.
+    int             flip_y;
+    int             src_x;          // Crop origin, in MCUs.
+    int             src_y;
+    int             src_mcus_x;     // Cropped size, in MCUs.
+    int             src_mcus_y;
+    int             width;          // Of the result.
+    int             height;
+    int             mcus_x;
+    int             mcus_y;
+    uint8_t         src_k[64];      // Source natural index of each coefficient.
+    int8_t          sign[64];
+    TJEState        state;
+} TJEITransform;
+
+// Gathers data unit (x, y), in blocks, of component c of the result.
+static void tjei_transformed_du(const TJEITransform* t, const int c, const int x, const int y, int du[64])
+{
+    const TJEIJpeg* jpeg = t->jpeg;
+    const int h = jpeg->comp[c].h;
+    const int v = jpeg->comp[c].v;
+    const int src_w = t->src_mcus_x * h;
+    const int src_h = t->src_mcus_y * v;
+
+    int sx = t->transpose ? y : x;
+    int sy = t->transpose ? x : y;
+    if ( t->flip_x ) {
+        sx = src_w - 1 - sx;
+    }
+    if ( t->flip_y ) {
+        sy = src_h - 1 - sy;
+    }
+    // The padding blocks of the result needn't line up with the source's.
+    sx = tjei_min(tjei_max(sx, 0), src_w - 1) + t->src_x * h;
+    sy = tjei_min(tjei_max(sy, 0), src_h - 1) + t->src_y * v;
+
+    const int16_t* coef = t->coefs[c] + ((size_t)sy * (size_t)jpeg->mcus_x * (size_t)h + (size_t)sx) * 64;
+    for ( int k = 0; k < 64; ++k ) {
+        du[k] = coef[t->src_k[k]] * t->sign[k];
+    }
+}
+
+// Goes over the blocks of the result in scan order, counting their Huffman
+// symbols into `freq` if `out` is NULL, or else writing them.
+static void tjei_transform_scan(TJEITransform* t, TJEOutput* out, uint32_t freq[4][256])
+{
+    const TJEIJpeg* jpeg = t->jpeg;
+    TJEState* state = &t->state;
+    TJEBitWriter bw;
+    int pred[3] = { 0, 0, 0 };
+    int du[64];
+
+    tjei_bit_writer_init(&bw);
+    for ( int my = 0; my < t->mcus_y; ++my ) {
+        for ( int mx = 0; mx < t->mcus_x; ++mx ) {
+            for ( int c = 0; c < jpeg->num_components; ++c ) {
+                const int h = c ? 1 : state->h_samp;
+                const int v = c ? 1 : state->v_samp;
+                const int dc = c ? TJEI_CHROMA_DC : TJEI_LUMA_DC;
+                const int ac = c ? TJEI_CHROMA_AC : TJEI_LUMA_AC;
+                for ( int y = 0; y < v; ++y ) {
+                    for ( int x = 0; x < h; ++x ) {
+                        tjei_transformed_du(t, c, mx * h + x, my * v + y, du);
+                        if ( out ) {
+                            tjei_write_du(out, du, state->ehuff[dc], state->ehuff[ac], &pred[c], &bw);
+                        } else {
+                            tjei_count_MCU(du, &pred[c], freq[dc], freq[ac]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    if ( out ) {
+        if ( out->output_buffer_size - out->output_buffer_count < TJEI_MAX_BLOCK_BYTES ) {
+            tjei_reserve(out, TJEI_MAX_BLOCK_BYTES);
+        }
+        tjei_flush_bits(out, &bw);
+    }
+}
+
+size_t tje_transform(unsigned char** dest,
+                     size_t* dest_size,
+                     const unsigned char* jpeg_data,
+                     const size_t jpeg_size,
+                     const int transform,
+                     const int crop_x,
+                     const int crop_y,
+                     const int crop_w,
+                     const int crop_h)
+{
+    // Transpose, flip_x, flip_y: the flips are of the source.
+    static const uint8_t ops[8][3] = {
+        { 0, 0, 0 },  // NONE
+        { 0, 1, 0 },  // FLIP_H
+        { 0, 0, 1 },  // FLIP_V
+        { 1, 0, 0 },  // TRANSPOSE
+        { 1, 1, 1 },  // TRANSVERSE
+        { 1, 0, 1 },  // ROT_90
+        { 0, 1, 1 },  // ROT_180
+        { 1, 1, 0 },  // ROT_270
+    };
+    size_t len = 0;
+
+    if ( transform < TJE_TRANSFORM_NONE || transform > TJE_TRANSFORM_ROT_270 ) {
+        tje_log("[ERROR] -- Invalid transform\n");
+        return 0;
+    }
+
+    TJEITransform* t = (TJEITransform*)TJE_MALLOC(sizeof(TJEITransform));
+    TJEIJpeg* jpeg = (TJEIJpeg*)TJE_MALLOC(sizeof(TJEIJpeg));
+    if ( !t || !jpeg ) {
+        TJE_FREE(t);
+        TJE_FREE(jpeg);
+        return 0;
+    }
+    memset(t, 0, sizeof(TJEITransform));
+    t->jpeg = jpeg;
+
+    if ( !tjei_parse_jpeg(jpeg, jpeg_data, jpeg_size) ||
+         (jpeg->num_components == 3 && jpeg->comp[1].tq != jpeg->comp[2].tq) ) {
+        tje_log("[ERROR] -- Unsupported JPEG\n");
+        goto done;
+    }
+
+    for ( int c = 0; c < jpeg->num_components; ++c ) {
+        size_t num_blocks = (size_t)jpeg->mcus_x * (size_t)jpeg->comp[c].h *
+                            (size_t)jpeg->mcus_y * (size_t)jpeg->comp[c].v;
+        t->coefs[c] = (int16_t*)TJE_MALLOC(num_blocks * 64 * sizeof(int16_t));
+        if ( !t->coefs[c] ) {
+            goto done;
+        }
+    }
+    if ( !tjei_decode_coefficients(jpeg, t->coefs) ) {
+        tje_log("[ERROR] -- Corrupt JPEG\n");
+        goto done;
+    }
+
+    {
+        const int mcu_w = 8 * jpeg->h_max;
+        const int mcu_h = 8 * jpeg->v_max;
+
+        if ( crop_x < 0 || crop_y < 0 || crop_w < 0 || crop_h < 0 ||
+             crop_x >= jpeg->width || crop_y >= jpeg->height ) {
+            tje_log("[ERROR] -- Invalid crop\n");
+            goto done;
+        }
+        t->transpose = ops[transform][0];
+        t->flip_x = ops[transform][1];
+        t->flip_y = ops[transform][2];
+        t->src_x = crop_x / mcu_w;
+        t->src_y = crop_y / mcu_h;
+
+        int right = crop_w ? tjei_min(crop_x + crop_w, jpeg->width) : jpeg->width;
+        int bottom = crop_h ? tjei_min(crop_y + crop_h, jpeg->height) : jpeg->height;
+        int w = right - t->src_x * mcu_w;
+        int h = bottom - t->src_y * mcu_h;
+        // A partial MCU can't be flipped onto the top or left.
+        if ( t->flip_x ) {
+            w -= w % mcu_w;
+        }
+        if ( t->flip_y ) {
+            h -= h % mcu_h;
+        }
+        if ( !w || !h ) {
+            tje_log("[ERROR] -- Image too small to flip\n");
+            goto done;
+        }
+        t->src_mcus_x = (w + mcu_w - 1) / mcu_w;
+        t->src_mcus_y = (h + mcu_h - 1) / mcu_h;
+
+        TJEState* state = &t->state;
+        tjei_init_state(state, 1, TJE_SUBSAMPLING_444);
+        state->h_samp = t->transpose ? jpeg->v_max : jpeg->h_max;
+        state->v_samp = t->transpose ? jpeg->h_max : jpeg->v_max;
+        t->width = t->transpose ? h : w;
+        t->height = t->transpose ? w : h;
+        t->mcus_x = (t->width + 8 * state->h_samp - 1) / (8 * state->h_samp);
+        t->mcus_y = (t->height + 8 * state->v_samp - 1) / (8 * state->v_samp);
+    }
+
+    {
+        // Where each coefficient of a block of the result comes from.
+        uint8_t natural[64];
+        for ( int i = 0; i < 64; ++i ) {
+            natural[tjei_zig_zag[i]] = (uint8_t)i;
+        }
+        for ( int k = 0; k < 64; ++k ) {
+            int u = natural[k] % 8;  // Horizontal frequency.
+            int v = natural[k] / 8;
+            if ( t->transpose ) {
+                int tmp = u;
+                u = v;
+                v = tmp;
+            }
+            t->src_k[k] = (uint8_t)(v * 8 + u);
+            // Odd frequencies change sign when mirrored.
+            t->sign[k] = (int8_t)(((t->flip_x && (u & 1)) ^ (t->flip_y && (v & 1))) ? -1 : 1);
+        }
+    }
+
+    {
+        TJEState* state = &t->state;
+        uint32_t freq[4][256];
+        uint8_t bits[4][16];
+        uint8_t vals[4][256];
+
+        // The quantization tables turn along with the coefficients.
+        for ( int k = 0; k < 64; ++k ) {
+            state->qt_luma[k] = jpeg->qt[jpeg->comp[0].tq][t->src_k[k]];
+            if ( jpeg->num_components == 3 ) {
+                state->qt_chroma[k] = jpeg->qt[jpeg->comp[1].tq][t->src_k[k]];
+            }
+        }
+
+        memset(freq, 0, sizeof(freq));
+        tjei_transform_scan(t, NULL, freq);
+        int num_tables = jpeg->num_components == 1 ? 2 : 4;
+        for ( int i = 0; i < num_tables; ++i ) {
+            tjei_huff_optimize(freq[i], bits[i], vals[i]);
+            state->ht_bits[i] = bits[i];
+            state->ht_vals[i] = vals[i];
+        }
+        tjei_huff_build(state);
+
+        TJEBufferSink sink = { 0 };
+        sink.data = *dest;
+        sink.size = *dest ? *dest_size : 0;
+        sink.growable = 1;
+        if ( !sink.data ) {
+            // Rarely much bigger than the original.
+            sink.size = jpeg_size + TJEI_MAX_HEADER_BYTES;
+            sink.data = (uint8_t*)TJE_REALLOC(NULL, sink.size);
+            if ( !sink.data ) {
+                goto done;
+            }
+        }
+
+        tjei_set_sink(state, &sink);
+        tjei_write_headers(state, t->width, t->height, jpeg->num_components);
+        tjei_transform_scan(t, &state->output, NULL);
+
+        uint16_t EOI = tjei_be_word(0xffd9);
+        tjei_write(&state->output, &EOI, sizeof(uint16_t), 1);
+        tjei_flush_output(&state->output);
+
+        *dest = sink.data;
+        *dest_size = sink.size;
+        len = sink.overflow ? 0 : sink.count;
+    }
+
+done:
+    for ( int c = 0; c < 3; ++c ) {
+        TJE_FREE(t->coefs[c]);
+    }
+    TJE_FREE(jpeg);
+    TJE_FREE(t);
+    return len;
+}
+// ============================================================
+// Decoder
+// ============================================================
+
+// One pass of the AAN inverse DCT, as libjpeg's jidctfst, over d[0..7] into
+// o[0..7]. T is int16_t or a vector of them; ADD and SUB wrap around, SHL2
+// multiplies by 4, and MUL(x, c) is the high half of x * c. With x scaled by
+// 4 beforehand, that multiplies by c in 2.14 fixed point. The C and SIMD
+// versions all expand this, so they decode to the same pixels.
+#define TJEI_IDCT_PASS(T, ADD, SUB, SHL2, MUL, d, o)                     \
+    do {                                                                \
+        T even10 = ADD(d[0], d[4]);                                     \
+        T even11 = SUB(d[0], d[4]);                                     \
+        T even13 = ADD(d[2], d[6]);                                     \
+        T even12 = SUB(MUL(SHL2(SUB(d[2], d[6])), TJEI_IDCT_1_414), even13); \
+        T even0 = ADD(even10, even13);                                  \
+        T even3 = SUB(even10, even13);                                  \
+        T even1 = ADD(even11, even12);                                  \
+        T even2 = SUB(even11, even12);                                  \
+        T z13 = ADD(d[5], d[3]);                                        \
+        T z10 = SUB(d[5], d[3]);                                        \
+        T z11 = ADD(d[1], d[7]);                                        \
+        T z12 = SUB(d[1], d[7]);                                        \
+        T z5 = MUL(SHL2(ADD(z10, z12)), TJEI_IDCT_1_847);               \
+        T odd7 = ADD(z11, z13);                                         \
+        T odd11 = MUL(SHL2(SUB(z11, z13)), TJEI_IDCT_1_414);            \
+        T odd10 = SUB(MUL(SHL2(z12), TJEI_IDCT_1_082), z5);             \
+        T odd12 = SUB(z5, ADD(MUL(SHL2(z10), TJEI_IDCT_1_613), z10));   \
+        T odd6 = SUB(odd12, odd7);                                      \
+        T odd5 = SUB(odd11, odd6);                                      \
+        T odd4 = ADD(odd10, odd5);                                      \
+        o[0] = ADD(even0, odd7);                                        \
+        o[7] = SUB(even0, odd7);                                        \
+        o[1] = ADD(even1, odd6);                                        \
+        o[6] = SUB(even1, odd6);                                        \
+        o[2] = ADD(even2, odd5);                                        \
+        o[5] = SUB(even2, odd5);                                        \
+        o[4] = ADD(even3, odd4);                                        \
+        o[3] = SUB(even3, odd4);                                        \
+    } while ( 0 )
+
+// 2.14 fixed point. Even, so NEON can multiply by half of them and double.
+#define TJEI_IDCT_1_414 23170
+#define TJEI_IDCT_1_847 30274
+#define TJEI_IDCT_1_082 17734
+#define TJEI_IDCT_1_613 26430   // 2.613 - 1. 2.613 doesn't fit.
+
+// Bits of precision the dequantized coefficients get, for the multiplications.
+#define TJEI_IDCT_BITS 2
+// And the dequantization table on top of those, so that it keeps the small
+// AAN scale factors of high frequencies at high qualities.
+#define TJEI_DQ_BITS 4
+// Added to the output before scaling it down: the level shift and rounding.
+#define TJEI_IDCT_BIAS ((128 << (TJEI_IDCT_BITS + 3)) + (1 << (TJEI_IDCT_BITS + 2)))
+
+#define TJEI_ADD16(a, b) ((int16_t)((a) + (b)))
+#define TJEI_SUB16(a, b) ((int16_t)((a) - (b)))
+#define TJEI_SHL2_16(a) ((int16_t)((a) * 4))
+#define TJEI_MUL16(a, c) ((int16_t)(((int32_t)(a) * (c)) >> 16))
+
+// Coefficient times table entry, rounded to TJEI_IDCT_BITS and saturated.
+TJEI_FORCE_INLINE int16_t tjei_dequantize(const int16_t coef, const int16_t dq)
+{
+    int v = (coef * dq + (1 << (TJEI_DQ_BITS - 1))) >> TJEI_DQ_BITS;
+    return (int16_t)tjei_min(tjei_max(v, -32768), 32767);
+}
+
+#if defined(__SSE2__)
+#define TJEI_SHL2_SSE2(a) _mm_slli_epi16(a, 2)
+#define TJEI_MUL_SSE2(a, c) _mm_mulhi_epi16(a, _mm_set1_epi16(c))
+
+TJEI_FORCE_INLINE void tjei_transpose_sse2(__m128i r[8])
+{
+    __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]);
+    __m128i a1 = _mm_unpackhi_epi16(r[0], r[1]);
+    __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]);
+    __m128i a3 = _mm_unpackhi_epi16(r[2], r[3]);
+    __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]);
+    __m128i a5 = _mm_unpackhi_epi16(r[4], r[5]);
+    __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]);
+    __m128i a7 = _mm_unpackhi_epi16(r[6], r[7]);
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+    __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+    __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+    __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+    __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+    r[0] = _mm_unpacklo_epi64(b0, b4);
+    r[1] = _mm_unpackhi_epi64(b0, b4);
+    r[2] = _mm_unpacklo_epi64(b1, b5);
+    r[3] = _mm_unpackhi_epi64(b1, b5);
+    r[4] = _mm_unpacklo_epi64(b2, b6);
+    r[5] = _mm_unpackhi_epi64(b2, b6);
+    r[6] = _mm_unpacklo_epi64(b3, b7);
+    r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+#elif defined(__ARM_NEON)
+#define TJEI_SHL2_NEON(a) vshlq_n_s16(a, 2)
+#define TJEI_MUL_NEON(a, c) vqdmulhq_n_s16(a, (c) / 2)
+
+TJEI_FORCE_INLINE void tjei_transpose_neon(int16x8_t r[8])
+{
+    int16x8x2_t t01 = vtrnq_s16(r[0], r[1]);
+    int16x8x2_t t23 = vtrnq_s16(r[2], r[3]);
+    int16x8x2_t t45 = vtrnq_s16(r[4], r[5]);
+    int16x8x2_t t67 = vtrnq_s16(r[6], r[7]);
+    int32x4x2_t u02 = vtrnq_s32(vreinterpretq_s32_s16(t01.val[0]), vreinterpretq_s32_s16(t23.val[0]));
+    int32x4x2_t u13 = vtrnq_s32(vreinterpretq_s32_s16(t01.val[1]), vreinterpretq_s32_s16(t23.val[1]));
+    int32x4x2_t u46 = vtrnq_s32(vreinterpretq_s32_s16(t45.val[0]), vreinterpretq_s32_s16(t67.val[0]));
+    int32x4x2_t u57 = vtrnq_s32(vreinterpretq_s32_s16(t45.val[1]), vreinterpretq_s32_s16(t67.val[1]));
+    r[0] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(u02.val[0]), vget_low_s32(u46.val[0])));
+    r[1] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(u13.val[0]), vget_low_s32(u57.val[0])));
+    r[2] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(u02.val[1]), vget_low_s32(u46.val[1])));
+    r[3] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(u13.val[1]), vget_low_s32(u57.val[1])));
+    r[4] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(u02.val[0]), vget_high_s32(u46.val[0])));
+    r[5] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(u13.val[0]), vget_high_s32(u57.val[0])));
+    r[6] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(u02.val[1]), vget_high_s32(u46.val[1])));
+    r[7] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(u13.val[1]), vget_high_s32(u57.val[1])));
+}
+#endif
+
+// Inverse DCT of `coef`, in natural order, dequantized by `dq` (scaled by
+// tjei_decoder_prepare_dq), to 8x8 pixels.
+static void tjei_idct_block(const int16_t coef[64], const int16_t dq[64], uint8_t* out, const int stride)
+{
+#if defined(__SSE2__)
+    __m128i r[8];
+    __m128i o[8];
+    const __m128i round = _mm_set1_epi32(1 << (TJEI_DQ_BITS - 1));
+    for ( int i = 0; i < 8; ++i ) {
+        __m128i c = _mm_loadu_si128((const __m128i*)(coef + 8 * i));
+        __m128i q = _mm_loadu_si128((const __m128i*)(dq + 8 * i));
+        __m128i lo = _mm_mullo_epi16(c, q);
+        __m128i hi = _mm_mulhi_epi16(c, q);
+        __m128i p0 = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), round), TJEI_DQ_BITS);
+        __m128i p1 = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), round), TJEI_DQ_BITS);
+        r[i] = _mm_packs_epi32(p0, p1);
+    }
+    tjei_transpose_sse2(r);
+    TJEI_IDCT_PASS(__m128i, _mm_add_epi16, _mm_sub_epi16, TJEI_SHL2_SSE2, TJEI_MUL_SSE2, r, o);
+    tjei_transpose_sse2(o);
+    TJEI_IDCT_PASS(__m128i, _mm_add_epi16, _mm_sub_epi16, TJEI_SHL2_SSE2, TJEI_MUL_SSE2, o, r);
+
+    const __m128i bias = _mm_set1_epi16(TJEI_IDCT_BIAS);
+    for ( int y = 0; y < 8; y += 2 ) {
+        __m128i a = _mm_srai_epi16(_mm_add_epi16(r[y], bias), TJEI_IDCT_BITS + 3);
+        __m128i b = _mm_srai_epi16(_mm_add_epi16(r[y + 1], bias), TJEI_IDCT_BITS + 3);
+        __m128i p = _mm_packus_epi16(a, b);
+        _mm_storel_epi64((__m128i*)(out + y * stride), p);
+        _mm_storel_epi64((__m128i*)(out + (y + 1) * stride), _mm_srli_si128(p, 8));
+    }
+#elif defined(__ARM_NEON)
+    int16x8_t r[8];
+    int16x8_t o[8];
+    for ( int i = 0; i < 8; ++i ) {
+        int16x8_t c = vld1q_s16(coef + 8 * i);
+        int16x8_t q = vld1q_s16(dq + 8 * i);
+        r[i] = vcombine_s16(vqrshrn_n_s32(vmull_s16(vget_low_s16(c), vget_low_s16(q)), TJEI_DQ_BITS),
+                            vqrshrn_n_s32(vmull_s16(vget_high_s16(c), vget_high_s16(q)), TJEI_DQ_BITS));
+    }
+    tjei_transpose_neon(r);
+    TJEI_IDCT_PASS(int16x8_t, vaddq_s16, vsubq_s16, TJEI_SHL2_NEON, TJEI_MUL_NEON, r, o);
+    tjei_transpose_neon(o);
+    TJEI_IDCT_PASS(int16x8_t, vaddq_s16, vsubq_s16, TJEI_SHL2_NEON, TJEI_MUL_NEON, o, r);
+
+    const int16x8_t bias = vdupq_n_s16(TJEI_IDCT_BIAS);
+    for ( int y = 0; y < 8; ++y ) {
+        vst1_u8(out + y * stride, vqmovun_s16(vshrq_n_s16(vaddq_s16(r[y], bias), TJEI_IDCT_BITS + 3)));
+    }
+#else
+    int16_t ws[64];
+    int16_t d[8];
+    int16_t o[8];
+
+    // Rows, then columns, as the SIMD versions.
+    for ( int v = 0; v < 8; ++v ) {
+        for ( int u = 0; u < 8; ++u ) {
+            d[u] = tjei_dequantize(coef[v * 8 + u], dq[v * 8 + u]);
+        }
+        TJEI_IDCT_PASS(int16_t, TJEI_ADD16, TJEI_SUB16, TJEI_SHL2_16, TJEI_MUL16, d, o);
+        memcpy(ws + v * 8, o, sizeof(o));
+    }
+    for ( int x = 0; x < 8; ++x ) {
+        for ( int v = 0; v < 8; ++v ) {
+            d[v] = ws[v * 8 + x];
+        }
+        TJEI_IDCT_PASS(int16_t, TJEI_ADD16, TJEI_SUB16, TJEI_SHL2_16, TJEI_MUL16, d, o);
+        for ( int y = 0; y < 8; ++y ) {
+            int p = (int16_t)(o[y] + TJEI_IDCT_BIAS) >> (TJEI_IDCT_BITS + 3);
+            out[y * stride + x] = (uint8_t)tjei_min(tjei_max(p, 0), 255);
+        }
+    }
+#endif
+}
+
+// Every pixel tjei_idct_block gives for a block with only a DC coefficient,
+// and the mean of the pixels of any block.
+TJEI_FORCE_INLINE uint8_t tjei_idct_dc(const int16_t dc, const int16_t dq)
+{
+    int p = (int16_t)(tjei_dequantize(dc, dq) + TJEI_IDCT_BIAS) >> (TJEI_IDCT_BITS + 3);
+    return (uint8_t)tjei_min(tjei_max(p, 0), 255);
+}
+
+// Scales an 8x8 block down by 2 or 4, each pixel the mean of a square.
+static void tjei_box_average(const uint8_t block[64], const int scale, uint8_t* out, const int stride)
+{
+    if ( scale == 2 ) {
+        for ( int y = 0; y < 4; ++y ) {
+            const uint8_t* r0 = block + 16 * y;
+            const uint8_t* r1 = r0 + 8;
+            for ( int x = 0; x < 4; ++x ) {
+                out[y * stride + x] = (uint8_t)((r0[2 * x] + r0[2 * x + 1] + r1[2 * x] + r1[2 * x + 1] + 2) >> 2);
+            }
+        }
+    } else {
+        for ( int y = 0; y < 2; ++y ) {
+            int sum[2] = { 0, 0 };
+            for ( int j = 0; j < 4; ++j ) {
+                const uint8_t* r = block + (4 * y + j) * 8;
+                sum[0] += r[0] + r[1] + r[2] + r[3];
+                sum[1] += r[4] + r[5] + r[6] + r[7];
+            }
+            out[y * stride + 0] = (uint8_t)((sum[0] + 8) >> 4);
+            out[y * stride + 1] = (uint8_t)((sum[1] + 8) >> 4);
+        }
+    }
+}
+
+struct TJEDecoder
+{
+    TJEIJpeg        jpeg;
+    TJEImageInfo    info;
+    int             scale;
+    int             block_size;     // Of a decoded block, in pixels: 8 / scale.
+    // Dequantization table of each component, in natural order, scaled for
+    // tjei_idct_block.
+    int16_t         dq[3][64];
+    // One MCU row of each component, decoded.
+    uint8_t*        strip[3];
+    int             strip_stride[3];
+    size_t          strip_capacity[3];
+};
+
+TJEDecoder* tje_decoder_new(void)
+{
+    TJEDecoder* decoder = (TJEDecoder*)TJE_MALLOC(sizeof(TJEDecoder));
+    if ( decoder ) {
+        memset(decoder, 0, sizeof(TJEDecoder));
+    }
+    return decoder;
+}
+
+void tje_decoder_free(TJEDecoder* decoder)
+{
+    if ( decoder ) {
+        for ( int c = 0; c < 3; ++c ) {
+            TJE_FREE(decoder->strip[c]);
+        }
+        TJE_FREE(decoder);
+    }
+}
+
+static void tjei_decoder_prepare_dq(TJEDecoder* decoder)
+{
+    // The AAN scale factors, as in tjei_prepare_qt.
+    static const float aan_scales[] = {
+        1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+        1.0f, 0.785694958f, 0.541196100f, 0.275899379f
+    };
+    const TJEIJpeg* jpeg = &decoder->jpeg;
+
+    for ( int c = 0; c < jpeg->num_components; ++c ) {
+        const uint8_t* qt = jpeg->qt[jpeg->comp[c].tq];
+        for ( int i = 0; i < 64; ++i ) {
+            float dq = qt[i] * aan_scales[i % 8] * aan_scales[i / 8] * (1 << (TJEI_IDCT_BITS + TJEI_DQ_BITS));
+            decoder->dq[c][i] = (int16_t)(dq + 0.5f);
+        }
+    }
+}
+
+int tje_decoder_parse(TJEDecoder* decoder,
+                      const unsigned char* jpeg_data,
+                      const size_t jpeg_size,
+                      const int scale,
+                      TJEImageInfo* info)
+{
+    TJEIJpeg* jpeg = &decoder->jpeg;
+
+    if ( scale != 1 && scale != 2 && scale != 4 && scale != 8 ) {
+        tje_log("[ERROR] -- Valid 'scale' values are 1, 2, 4 or 8\n");
+        return 0;
+    }
+    if ( !tjei_parse_jpeg(jpeg, jpeg_data, jpeg_size) ) {
+        tje_log("[ERROR] -- Unsupported JPEG\n");
+        return 0;
+    }
+    decoder->scale = scale;
+    decoder->block_size = 8 / scale;
+
+    TJEImageInfo* out = &decoder->info;
+    memset(out, 0, sizeof(TJEImageInfo));
+    out->width = (jpeg->width + scale - 1) / scale;
+    out->height = (jpeg->height + scale - 1) / scale;
+    out->num_components = jpeg->num_components;
+
+    for ( int c = 0; c < jpeg->num_components; ++c ) {
+        const int h = jpeg->comp[c].h;
+        const int v = jpeg->comp[c].v;
+        int w = (jpeg->width * h + jpeg->h_max - 1) / jpeg->h_max;
+        int ht = (jpeg->height * v + jpeg->v_max - 1) / jpeg->v_max;
+        out->plane_width[c] = (w + scale - 1) / scale;
+        out->plane_height[c] = (ht + scale - 1) / scale;
+
+        // Room for whole blocks, and for 16-pixel SIMD loads past the edge.
+        decoder->strip_stride[c] = (jpeg->mcus_x * h * decoder->block_size + 31) & ~15;
+        size_t size = (size_t)decoder->strip_stride[c] * (size_t)(v * decoder->block_size);
+        if ( size > decoder->strip_capacity[c] ) {
+            TJE_FREE(decoder->strip[c]);
+            decoder->strip[c] = (uint8_t*)TJE_MALLOC(size);
+            decoder->strip_capacity[c] = decoder->strip[c] ? size : 0;
+            if ( !decoder->strip[c] ) {
+                jpeg->scan = NULL;
+                return 0;
+            }
+        }
+    }
+    tjei_decoder_prepare_dq(decoder);
+
+    if ( info ) {
+        *info = *out;
+    }
+    return 1;
+}
+
+// Decodes one block of component c to its place in the strip.
+TJEI_FORCE_INLINE void tjei_decode_pixels(const TJEDecoder* decoder, const int c,
+                                          const int16_t coef[64], const int last,
+                                          uint8_t* out, const int stride)
+{
+    const int n = decoder->block_size;
+
+    if ( last == 1 || n == 1 ) {
+        // Flat, or only its mean is wanted.
+        uint8_t pixel = tjei_idct_dc(coef[0], decoder->dq[c][0]);
+        for ( int y = 0; y < n; ++y ) {
+            memset(out + y * stride, pixel, (size_t)n);
+        }
+    } else if ( n == 8 ) {
+        tjei_idct_block(coef, decoder->dq[c], out, stride);
+    } else {
+        uint8_t block[64];
+        tjei_idct_block(coef, decoder->dq[c], block, 8);
+        tjei_box_average(block, decoder->scale, out, stride);
+    }
+}
+
+// Interleaves `rows` rows of the strips into YUYV rows.
+static void tjei_emit_yuyv(const TJEDecoder* decoder, const int rows, uint8_t* dest, const int stride)
+{
+    const int width = decoder->info.width;
+    const int pairs = width / 2;
+    const int gray = decoder->jpeg.num_components == 1;
+    const int h_max = decoder->jpeg.h_max;
+    const int v_max = decoder->jpeg.v_max;
+
+    for ( int r = 0; r < rows; ++r ) {
+        const uint8_t* py = decoder->strip[0] + r * decoder->strip_stride[0];
+        const uint8_t* pb = gray ? NULL : decoder->strip[1] + (r / v_max) * decoder->strip_stride[1];
+        const uint8_t* pr = gray ? NULL : decoder->strip[2] + (r / v_max) * decoder->strip_stride[2];
+        uint8_t* out = dest + (size_t)r * (size_t)stride;
+        int x = 0;
+
+        if ( gray ) {
+            for ( ; x < pairs; ++x ) {
+                out[4 * x + 0] = py[2 * x];
+                out[4 * x + 1] = 128;
+                out[4 * x + 2] = py[2 * x + 1];
+                out[4 * x + 3] = 128;
+            }
+        } else if ( h_max == 2 ) {
+            // The usual MJPEG layout, chroma already at 4:2:2.
+#if defined(__SSE2__)
+            for ( ; x + 8 <= pairs; x += 8 ) {
+                __m128i y = _mm_loadu_si128((const __m128i*)(py + 2 * x));
+                __m128i cbcr = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(pb + x)),
+                                                 _mm_loadl_epi64((const __m128i*)(pr + x)));
+                _mm_storeu_si128((__m128i*)(out + 4 * x), _mm_unpacklo_epi8(y, cbcr));
+                _mm_storeu_si128((__m128i*)(out + 4 * x + 16), _mm_unpackhi_epi8(y, cbcr));
+            }
+#elif defined(__ARM_NEON)
+            for ( ; x + 8 <= pairs; x += 8 ) {
+                uint8x8x2_t cbcr = vzip_u8(vld1_u8(pb + x), vld1_u8(pr + x));
+                uint8x16x2_t yuyv;
+                yuyv.val[0] = vld1q_u8(py + 2 * x);
+                yuyv.val[1] = vcombine_u8(cbcr.val[0], cbcr.val[1]);
+                vst2q_u8(out + 4 * x, yuyv);
+            }
+#endif
+            for ( ; x < pairs; ++x ) {
+                out[4 * x + 0] = py[2 * x];
+                out[4 * x + 1] = pb[x];
+                out[4 * x + 2] = py[2 * x + 1];
+                out[4 * x + 3] = pr[x];
+            }
+        } else {
+            for ( ; x < pairs; ++x ) {
+                out[4 * x + 0] = py[2 * x];
+                out[4 * x + 1] = (uint8_t)((pb[2 * x] + pb[2 * x + 1] + 1) >> 1);
+                out[4 * x + 2] = py[2 * x + 1];
+                out[4 * x + 3] = (uint8_t)((pr[2 * x] + pr[2 * x + 1] + 1) >> 1);
+            }
+        }
+
+        if ( width & 1 ) {
+            int last = width - 1;
+            int chroma = h_max == 2 ? last / 2 : last;
+            out[2 * last + 0] = py[last];
+            out[2 * last + 1] = gray ? 128 : pb[chroma];
+            out[2 * last + 2] = py[last];
+            out[2 * last + 3] = gray ? 128 : pr[chroma];
+        }
+    }
+}
+
+// Copies the strips of MCU row `mcu_row` to the planes.
+static void tjei_emit_planar(const TJEDecoder* decoder, const int mcu_row,
+                             unsigned char* const planes[], const int strides[])
+{
+    for ( int c = 0; c < decoder->jpeg.num_components; ++c ) {
+        const int strip_rows = decoder->jpeg.comp[c].v * decoder->block_size;
+        const int y0 = mcu_row * strip_rows;
+        const int rows = tjei_min(strip_rows, decoder->info.plane_height[c] - y0);
+        for ( int r = 0; r < rows; ++r ) {
+            memcpy(planes[c] + (size_t)(y0 + r) * (size_t)strides[c],
+                   decoder->strip[c] + r * decoder->strip_stride[c],
+                   (size_t)decoder->info.plane_width[c]);
+        }
+    }
+}
+
+int tje_decoder_decode(TJEDecoder* decoder,
+                       const int format,
+                       unsigned char* const planes[],
+                       const int strides[])
+{
+    const TJEIJpeg* jpeg = &decoder->jpeg;
+    const int bs = decoder->block_size;
+    TJEIBitReader br;
+    int pred[3] = { 0, 0, 0 };
+    int todo = jpeg->restart_interval;
+    int16_t coef[64];
+
+    if ( !jpeg->scan ) {
+        tje_log("[ERROR] -- Nothing to decode\n");
+        return 0;
+    }
+    if ( format != TJE_DECODE_YUYV && format != TJE_DECODE_PLANAR ) {
+        tje_log("[ERROR] -- Invalid 'format'\n");
+        return 0;
+    }
+
+    tjei_bit_reader_init(&br, jpeg->scan, jpeg->end);
+
+    for ( int my = 0; my < jpeg->mcus_y; ++my ) {
+        for ( int mx = 0; mx < jpeg->mcus_x; ++mx ) {
+            if ( jpeg->restart_interval ) {
+                if ( !todo ) {
+                    if ( !tjei_bit_reader_restart(&br) ) {
+                        return 0;
+                    }
+                    pred[0] = pred[1] = pred[2] = 0;
+                    todo = jpeg->restart_interval;
+                }
+                --todo;
+            }
+            for ( int c = 0; c < jpeg->num_components; ++c ) {
+                const int h = jpeg->comp[c].h;
+                const int v = jpeg->comp[c].v;
+                const int stride = decoder->strip_stride[c];
+                for ( int y = 0; y < v; ++y ) {
+                    for ( int x = 0; x < h; ++x ) {
+                        int last = tjei_decode_block(&br,
+                                                     &jpeg->huff[0][jpeg->comp[c].td],
+                                                     &jpeg->huff[1][jpeg->comp[c].ta],
+                                                     &pred[c], coef);
+                        if ( !last ) {
+                            return 0;
+                        }
+                        tjei_decode_pixels(decoder, c, coef, last,
+                                           decoder->strip[c] + y * bs * stride + (mx * h + x) * bs,
+                                           stride);
+                    }
+                }
+            }
+        }
+
+        if ( format == TJE_DECODE_YUYV ) {
+            const int y0 = my * jpeg->v_max * bs;
+            const int rows = tjei_min(jpeg->v_max * bs, decoder->info.height - y0);
+            tjei_emit_yuyv(decoder, rows, planes[0] + (size_t)y0 * (size_t)strides[0], strides[0]);
+        } else {
+            tjei_emit_planar(decoder, my, planes, strides);
+        }
+    }
+    return 1;
+}
 // ============================================================
 #endif // TJE_IMPLEMENTATION
 // ============================================================
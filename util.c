@@ -33,12 +33,23 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <zlib.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "util.h"
 
 #define TJE_IMPLEMENTATION
+#define TJE_THREADS
 #include "tiny_jpeg.h"
 
 #define CR_SAT_U (0x80 + 8)
@@ -47,269 +58,2369 @@
 #define CB_SAT_L (0x80 - 8)
 
 #define IMGBLK_SIDE (80) // 80 px on a side
-#define IMGBLK_AREA (IMGBLK_SIDE * IMGBLK_SIDE)
+
+// IMGBLK_QUANT_MAG drops 3 low bits of samples more than <hi> from mid-scale,
+// 2 of those more than <lo>: 0x20 and 0x10 for Y, 0x10 and 0x08 for Cb/Cr
+#define QDIST(v)         ((v) > 0x80 ? (v) - 0x80 : 0x80 - (v))
+#define QMAG(v, lo, hi)  (QDIST(v) > (hi) ? (v) & 0xF8 : QDIST(v) > (lo) ? (v) & 0xFC : (v))
+#define QY(v)            QMAG(v, 0x10, 0x20)
+#define QC(v)            QMAG(v, 0x08, 0x10)
+#define Q4(q, v)         q(v), q(v+1), q(v+2), q(v+3)
+#define Q16(q, v)        Q4(q, v), Q4(q, v+4), Q4(q, v+8), Q4(q, v+12)
+#define Q64(q, v)        Q16(q, v), Q16(q, v+16), Q16(q, v+32), Q16(q, v+48)
+#define Q256(q)          Q64(q, 0), Q64(q, 64), Q64(q, 128), Q64(q, 192)
+
+static const uint8_t imgblk_qy[256] = { Q256(QY) };
+static const uint8_t imgblk_qc[256] = { Q256(QC) };
+
+#if defined(__SSE2__)
+// IMGBLK_QUANT_MAG of 16 samples with thresholds <lo> and <hi> per byte
+static inline __m128i imgblk_quant_sse2(__m128i v, __m128i lo, __m128i hi) {
+  const __m128i mid  = _mm_set1_epi8((char)0x80);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i dist, lo_ok, hi_ok;
+
+  // |v - 0x80|, then whether that's within each threshold
+  dist  = _mm_or_si128(_mm_subs_epu8(v, mid), _mm_subs_epu8(mid, v));
+  lo_ok = _mm_cmpeq_epi8(_mm_subs_epu8(dist, lo), zero);
+  hi_ok = _mm_cmpeq_epi8(_mm_subs_epu8(dist, hi), zero);
+
+  // Past <lo>: clear 0x03. Past <hi> as well: clear 0x04 too.
+  v = _mm_andnot_si128(_mm_andnot_si128(lo_ok, _mm_set1_epi8(0x03)), v);
+  return _mm_andnot_si128(_mm_andnot_si128(hi_ok, _mm_set1_epi8(0x04)), v);
+}
+#elif defined(__ARM_NEON)
+static inline uint8x8_t imgblk_quant_neon(uint8x8_t v, uint8_t lo, uint8_t hi) {
+  uint8x8_t dist = vabd_u8(v, vdup_n_u8(0x80));
+
+  v = vbic_u8(v, vand_u8(vcgt_u8(dist, vdup_n_u8(lo)), vdup_n_u8(0x03)));
+  return vbic_u8(v, vand_u8(vcgt_u8(dist, vdup_n_u8(hi)), vdup_n_u8(0x04)));
+}
+#endif
+
+// Splits <n> YUYV macropixels at <src> into the planes, quantizing per <quant>
+static void imgblk_pack_row(uint8_t *blk_y, uint8_t *blk_cb, uint8_t *blk_cr,
+                            const uint8_t *src, uint32_t n, int quant) {
+  uint32_t ii = 0;
+
+#if defined(__SSE2__)
+  // Thresholds for Y, Cb, Y, Cr; all-ones bytes quantize nothing
+  const __m128i lo = quant == IMGBLK_QUANT_MAG ? _mm_set1_epi32(0x08100810) : _mm_set1_epi8(-1);
+  const __m128i hi = quant == IMGBLK_QUANT_MAG ? _mm_set1_epi32(0x10201020) : _mm_set1_epi8(-1);
+  const __m128i m  = _mm_set1_epi16(0x00ff);
+
+  for (; ii + 8 <= n; ii += 8)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i *)(src + 4*ii));
+    __m128i b = _mm_loadu_si128((const __m128i *)(src + 4*ii + 16));
+    __m128i c;
+
+    a = imgblk_quant_sse2(a, lo, hi);
+    b = imgblk_quant_sse2(b, lo, hi);
+
+    // Y is the even bytes. The odd ones alternate Cb, Cr.
+    _mm_storeu_si128((__m128i *)(blk_y + 2*ii),
+                     _mm_packus_epi16(_mm_and_si128(a, m), _mm_and_si128(b, m)));
+    c = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+    _mm_storel_epi64((__m128i *)(blk_cb + ii), _mm_packus_epi16(_mm_and_si128(c, m), c));
+    _mm_storel_epi64((__m128i *)(blk_cr + ii), _mm_packus_epi16(_mm_srli_epi16(c, 8), c));
+  }
+#elif defined(__ARM_NEON)
+  for (; ii + 8 <= n; ii += 8)
+  {
+    uint8x8x4_t v = vld4_u8(src + 4*ii);
+    uint8x8x2_t y;
+
+    if (quant == IMGBLK_QUANT_MAG) {
+      v.val[0] = imgblk_quant_neon(v.val[0], 0x10, 0x20);
+      v.val[1] = imgblk_quant_neon(v.val[1], 0x08, 0x10);
+      v.val[2] = imgblk_quant_neon(v.val[2], 0x10, 0x20);
+      v.val[3] = imgblk_quant_neon(v.val[3], 0x08, 0x10);
+    }
+    y.val[0] = v.val[0];
+    y.val[1] = v.val[2];
+    vst2_u8(blk_y + 2*ii, y);
+    vst1_u8(blk_cb + ii, v.val[1]);
+    vst1_u8(blk_cr + ii, v.val[3]);
+  }
+#endif
+
+  // Leftovers, or everything without SIMD
+  if (quant == IMGBLK_QUANT_MAG) {
+    for (; ii < n; ii++) {
+      blk_y[2*ii]   = imgblk_qy[src[4*ii+0]];
+      blk_cb[ii]    = imgblk_qc[src[4*ii+1]];
+      blk_y[2*ii+1] = imgblk_qy[src[4*ii+2]];
+      blk_cr[ii]    = imgblk_qc[src[4*ii+3]];
+    }
+  } else {
+    for (; ii < n; ii++) {
+      blk_y[2*ii]   = src[4*ii+0];
+      blk_cb[ii]    = src[4*ii+1];
+      blk_y[2*ii+1] = src[4*ii+2];
+      blk_cr[ii]    = src[4*ii+3];
+    }
+  }
+}
+
+// Inverse of imgblk_pack_row, less the quantization
+static void imgblk_unpack_row(uint8_t *dst, const uint8_t *blk_y, const uint8_t *blk_cb,
+                              const uint8_t *blk_cr, uint32_t n) {
+  uint32_t ii = 0;
+
+#if defined(__SSE2__)
+  for (; ii + 8 <= n; ii += 8)
+  {
+    __m128i y = _mm_loadu_si128((const __m128i *)(blk_y + 2*ii));
+    __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(blk_cb + ii)),
+                                  _mm_loadl_epi64((const __m128i *)(blk_cr + ii)));
+    _mm_storeu_si128((__m128i *)(dst + 4*ii),      _mm_unpacklo_epi8(y, c));
+    _mm_storeu_si128((__m128i *)(dst + 4*ii + 16), _mm_unpackhi_epi8(y, c));
+  }
+#elif defined(__ARM_NEON)
+  for (; ii + 8 <= n; ii += 8)
+  {
+    uint8x8x2_t y = vld2_u8(blk_y + 2*ii);
+    uint8x8x4_t v;
+
+    v.val[0] = y.val[0];
+    v.val[1] = vld1_u8(blk_cb + ii);
+    v.val[2] = y.val[1];
+    v.val[3] = vld1_u8(blk_cr + ii);
+    vst4_u8(dst + 4*ii, v);
+  }
+#endif
+
+  for (; ii < n; ii++) {
+    dst[4*ii+0] = blk_y[2*ii];
+    dst[4*ii+1] = blk_cb[ii];
+    dst[4*ii+2] = blk_y[2*ii+1];
+    dst[4*ii+3] = blk_cr[ii];
+  }
+}
+
+// Converts <w>x<h> YUYV image <yuyv> to the ImgBlk planes at <blk>, in blocks
+// of <side> macropixels by <side> rows. Each block reads <side> short runs of
+// the frame and writes its planes sequentially.
+static void imgblk_pack(uint8_t *blk, const uint8_t *yuyv, uint32_t w, uint32_t h,
+                        uint32_t side, int quant) {
+  uint32_t  bx, by, bw, bh, yy, mpw;
+  uint8_t  *blk_y, *blk_cb, *blk_cr;
+
+  mpw    = w/2;
+  blk_y  = blk;
+  blk_cb = blk + (size_t)w*h;
+  blk_cr = blk_cb + (size_t)mpw*h;
+
+  for (by = 0; by < h; by += side) {
+    bh = h - by < side ? h - by : side;
+    for (bx = 0; bx < mpw; bx += side) {
+      bw = mpw - bx < side ? mpw - bx : side;
+      for (yy = 0; yy < bh; yy++) {
+        imgblk_pack_row(blk_y, blk_cb, blk_cr,
+                        yuyv + 4*((size_t)(by + yy)*mpw + bx), bw, quant);
+        blk_y  += 2*bw;
+        blk_cb += bw;
+        blk_cr += bw;
+      }
+    }
+  }
+}
+
+// Inverse of imgblk_pack
+static void imgblk_unpack(uint8_t *yuyv, const uint8_t *blk, uint32_t w, uint32_t h,
+                          uint32_t side) {
+  uint32_t       bx, by, bw, bh, yy, mpw;
+  const uint8_t *blk_y, *blk_cb, *blk_cr;
+
+  mpw    = w/2;
+  blk_y  = blk;
+  blk_cb = blk + (size_t)w*h;
+  blk_cr = blk_cb + (size_t)mpw*h;
+
+  for (by = 0; by < h; by += side) {
+    bh = h - by < side ? h - by : side;
+    for (bx = 0; bx < mpw; bx += side) {
+      bw = mpw - bx < side ? mpw - bx : side;
+      for (yy = 0; yy < bh; yy++) {
+        imgblk_unpack_row(yuyv + 4*((size_t)(by + yy)*mpw + bx),
+                          blk_y, blk_cb, blk_cr, bw);
+        blk_y  += 2*bw;
+        blk_cb += bw;
+        blk_cr += bw;
+      }
+    }
+  }
+}
+
 uint8_t * yuyv2imgblk(const uint8_t *yuyv, uint32_t xres, uint32_t yres) {
-  uint32_t  idx, bx, by, xx, yy, npix, len;
-  uint8_t  *blk, *blk_y0, *blk_y1, *blk_cb, *blk_cr, y0, y1, cr, cb;
-
-  npix   = xres*yres;
-  len    = npix*2;
-
-  blk    = malloc(len);
-  blk_y0 = blk + 0;
-  blk_y1 = blk + 1;
-  blk_cb = blk + len/2;
-  blk_cr = blk + len/2 + len/4;
-
-  idx = 0;
-  for (by = 0; idx < len/4; by += IMGBLK_SIDE*xres/2) {
-    for (bx = 0; bx < xres/2; bx += IMGBLK_SIDE) {
-      for (yy = 0; yy < IMGBLK_SIDE*xres/2; yy += xres/2) {
-        for (xx = 0; xx < IMGBLK_SIDE; xx++) {
-
-          y0 = yuyv[4*(by + bx + yy + xx)+0];
-          cb = yuyv[4*(by + bx + yy + xx)+1];
-          y1 = yuyv[4*(by + bx + yy + xx)+2];
-          cr = yuyv[4*(by + bx + yy + xx)+3];
-
-/*
-          if (cr < 125 && cr >= 120) { cr = 122; }
-          if (cr < 120 && cr >= 116) { cr = 118; }
-          if (cr < 116 && cr >= 110) { cr = 113; }
-          if (cr < 110 && cr >= 100) { cr = 105; }
-          if (cr < 100) { cr = 95; }
-
-          if (cr > 131 && cr <= 136) { cr = 134; }
-          if (cr > 136 && cr <= 140) { cr = 138; }
-          if (cr > 140 && cr <= 150) { cr = 145; }
-          if (cr > 150 && cr <= 160) { cr = 155; }
-          if (cr > 160) { cr = 165; }
-
-          if (cb < 125 && cb >= 120) { cb = 122; }
-          if (cb < 120 && cb >= 116) { cb = 118; }
-          if (cb < 116 && cb >= 110) { cb = 113; }
-          if (cb < 110 && cb >= 100) { cb = 105; }
-          if (cb < 100) { cb = 95; }
-
-          if (cb > 131 && cb <= 136) { cb = 134; }
-          if (cb > 136 && cb <= 140) { cb = 138; }
-          if (cb > 140 && cb <= 150) { cb = 145; }
-          if (cb > 150 && cb <= 160) { cb = 155; }
-          if (cb > 160) { cb = 165; }
-          cb = cb > CR_SAT_L && cb < CR_SAT_U ? cb &= 0xFC : cb & 0xF0;
-          cr = cr > CR_SAT_L && cr < CR_SAT_U ? cr &= 0xFC : cr & 0xF0;
-*/
-
-          if      (abs(0x80 - y0) > 0x20) { y0 = (y0 & 0xF8); }
-          else if (abs(0x80 - y0) > 0x10) { y0 = (y0 & 0xFC); }
-
-          if      (abs(0x80 - y1) > 0x20) { y1 = (y1 & 0xF8); }
-          else if (abs(0x80 - y1) > 0x10) { y1 = (y1 & 0xFC); }
-
-          if      (abs(0x80 - cr) > 0x10) { cr = (cr & 0xF8); }
-          else if (abs(0x80 - cr) > 0x08) { cr = (cr & 0xFC); }
-
-          if      (abs(0x80 - cb) > 0x10) { cb = (cb & 0xF8); }
-          else if (abs(0x80 - cb) > 0x08) { cb = (cb & 0xFC); }
-
-
-          blk_y0[2*idx] = y0;
-          blk_cb[idx]   = cb;
-          blk_y1[2*idx] = y1;
-          blk_cr[idx]   = cr;
-          idx++;
+  uint8_t *blk;
+
+  blk = malloc((size_t)xres*yres*2);
+  if (!blk)
+    return NULL;
+
+  imgblk_pack(blk, yuyv, xres, yres, IMGBLK_SIDE, IMGBLK_QUANT_MAG);
+  return blk;
+}
+
+uint8_t * imgblk2yuyv(const uint8_t *blk, uint32_t xres, uint32_t yres) {
+  uint8_t *yuyv;
+
+  yuyv = malloc((size_t)xres*yres*2);
+  if (!yuyv)
+    return NULL;
+
+  imgblk_unpack(yuyv, blk, xres, yres, IMGBLK_SIDE);
+  return yuyv;
+}
+
+// In place, a frame goes through an intermediate layout with each block
+// row's Y, Cb and Cr planes in the block row's own bytes. Counted in units
+// of w/2 bytes, a quarter of a YUYV row, block row <by> of <bh> rows starts
+// at unit 4*by, and its Y, Cb and Cr planes are 2*bh, bh and bh units.
+// Finished planes start at units 2*by, 2*h + by and 3*h + by instead.
+
+// The unit of the intermediate layout that goes to unit <u> of the planes,
+// or, with <to_yuyv>, the other way around
+static size_t imgblk_unit_src(size_t u, uint32_t h, uint32_t side, int to_yuyv) {
+  size_t by, bh, row;
+
+  if (to_yuyv) {
+    by  = u/4 - u/4 % side;
+    bh  = h - by < side ? h - by : side;
+    row = u - 4*by;
+    return row < 2*bh ? 2*by + row : row < 3*bh ? 2*(size_t)h + by + row - 2*bh
+                                                : 3*(size_t)h + by + row - 3*bh;
+  }
+
+  row = u < 2*(size_t)h ? u/2 : u < 3*(size_t)h ? u - 2*(size_t)h : u - 3*(size_t)h;
+  by  = row - row % side;
+  bh  = h - by < side ? h - by : side;
+  return u < 2*(size_t)h ? 4*by + u - 2*by :
+         u < 3*(size_t)h ? 4*by + 2*bh + row - by : 4*by + 3*bh + row - by;
+}
+
+// Moves every unit of <buf> to where imgblk_unit_src says, following each
+// cycle of the permutation through one unit of <tmp>. <done> has a bit per
+// unit.
+static void imgblk_permute(uint8_t *buf, uint32_t w, uint32_t h, uint32_t side,
+                           int to_yuyv, uint8_t *tmp, uint8_t *done) {
+  size_t unit = w/2, nunits = 4*(size_t)h, start, u, src;
+
+  memset(done, 0, (nunits + 7) / 8);
+  for (start = 0; start < nunits; start++) {
+    if (done[start/8] & (1 << start%8))
+      continue;
+    done[start/8] |= 1 << start%8;
+    src = imgblk_unit_src(start, h, side, to_yuyv);
+    if (src == start)
+      continue;
+
+    memcpy(tmp, buf + start*unit, unit);
+    for (u = start; src != start; u = src, src = imgblk_unit_src(u, h, side, to_yuyv)) {
+      memcpy(buf + u*unit, buf + src*unit, unit);
+      done[src/8] |= 1 << src%8;
+    }
+    memcpy(buf + u*unit, tmp, unit);
+  }
+}
+
+// Same as imgblk_pack, converting the <w>x<h> image in <buf> in place with a
+// block row of scratch
+static int imgblk_pack_inplace(uint8_t *buf, uint32_t w, uint32_t h, uint32_t side,
+                               int quant) {
+  uint8_t  *row, *done;
+  uint32_t  by, bh;
+
+  row  = malloc(2*(size_t)w*side);
+  done = malloc((4*(size_t)h + 7) / 8);
+  if (!row || !done) {
+    free(row);
+    free(done);
+    return 0;
+  }
+
+  // Each block row becomes its own planes, then the planes are gathered
+  for (by = 0; by < h; by += side) {
+    bh = h - by < side ? h - by : side;
+    memcpy(row, buf + 2*(size_t)w*by, 2*(size_t)w*bh);
+    imgblk_pack(buf + 2*(size_t)w*by, row, w, bh, side, quant);
+  }
+  imgblk_permute(buf, w, h, side, 0, row, done);
+
+  free(row);
+  free(done);
+  return 1;
+}
+
+// Inverse of imgblk_pack_inplace
+static int imgblk_unpack_inplace(uint8_t *buf, uint32_t w, uint32_t h, uint32_t side) {
+  uint8_t  *row, *done;
+  uint32_t  by, bh;
+
+  row  = malloc(2*(size_t)w*side);
+  done = malloc((4*(size_t)h + 7) / 8);
+  if (!row || !done) {
+    free(row);
+    free(done);
+    return 0;
+  }
+
+  imgblk_permute(buf, w, h, side, 1, row, done);
+  for (by = 0; by < h; by += side) {
+    bh = h - by < side ? h - by : side;
+    memcpy(row, buf + 2*(size_t)w*by, 2*(size_t)w*bh);
+    imgblk_unpack(buf + 2*(size_t)w*by, row, w, bh, side);
+  }
+
+  free(row);
+  free(done);
+  return 1;
+}
+
+int yuyv2imgblk_inplace(uint8_t *buf, uint32_t xres, uint32_t yres) {
+  return imgblk_pack_inplace(buf, xres, yres, IMGBLK_SIDE, IMGBLK_QUANT_MAG);
+}
+
+int imgblk2yuyv_inplace(uint8_t *buf, uint32_t xres, uint32_t yres) {
+  return imgblk_unpack_inplace(buf, xres, yres, IMGBLK_SIDE);
+}
+
+static void put_le16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+  put_le16(p, v);
+  put_le16(p + 2, v >> 16);
+}
+
+static void put_le64(uint8_t *p, uint64_t v) {
+  put_le32(p, v);
+  put_le32(p + 4, v >> 32);
+}
+
+static uint16_t get_le16(const uint8_t *p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+  return get_le16(p) | ((uint32_t)get_le16(p + 2) << 16);
+}
+
+static uint64_t get_le64(const uint8_t *p) {
+  return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+// Whether this version can write and read ImgBlk files described by <hdr>
+static int imgblk_hdr_valid(const struct imgblk_hdr *hdr) {
+  return hdr->fourcc == IMGBLK_FOURCC_YUYV &&
+         hdr->w > 0 && hdr->w <= 0xffff && hdr->w % 2 == 0 &&
+         hdr->h > 0 && hdr->h <= 0xffff &&
+         hdr->side > 0 && hdr->side <= IMGBLK_MAX_SIDE && hdr->side % 8 == 0 &&
+         hdr->quant <= IMGBLK_QUANT_MAG &&
+         hdr->codec <= IMGBLK_CODEC_CHANGED;
+}
+
+// Number of blocks in the image
+static size_t imgblk_nblocks(const struct imgblk_hdr *hdr) {
+  return (size_t)((hdr->w/2 + hdr->side - 1) / hdr->side) *
+                 ((hdr->h + hdr->side - 1) / hdr->side);
+}
+
+// Position and size of block <ii>, in macropixels and rows
+static void imgblk_block(const struct imgblk_hdr *hdr, size_t ii,
+                         uint32_t *bx, uint32_t *by, uint32_t *bw, uint32_t *bh) {
+  uint32_t mpw = hdr->w/2, nbx = (mpw + hdr->side - 1) / hdr->side;
+
+  *bx = (ii % nbx) * hdr->side;
+  *by = (ii / nbx) * hdr->side;
+  *bw = mpw - *bx < hdr->side ? mpw - *bx : hdr->side;
+  *bh = hdr->h - *by < hdr->side ? hdr->h - *by : hdr->side;
+}
+
+// Where block <ii> starts in raw planes, in macropixels: whole block rows,
+// then whole blocks. Its Y samples start at twice that, its Cb and Cr samples
+// that far into their planes.
+static size_t imgblk_block_mp(const struct imgblk_hdr *hdr, size_t ii,
+                              uint32_t *bw, uint32_t *bh) {
+  uint32_t bx, by;
+
+  imgblk_block(hdr, ii, &bx, &by, bw, bh);
+  return (size_t)by*(hdr->w/2) + (size_t)*bh*bx;
+}
+
+// Stores each sample of <w>x<h> plane <src> as its difference from the one to
+// its left, or, down the first column, from the one above
+static void imgblk_delta(uint8_t *dst, const uint8_t *src, uint32_t w, uint32_t h) {
+  uint32_t xx, yy;
+
+  for (yy = 0; yy < h; yy++, src += w, dst += w) {
+    dst[0] = src[0] - (yy ? src[-(ptrdiff_t)w] : 0);
+    for (xx = 1; xx < w; xx++)
+      dst[xx] = src[xx] - src[xx-1];
+  }
+}
+
+// Inverse of imgblk_delta, in place
+static void imgblk_undelta(uint8_t *p, uint32_t w, uint32_t h) {
+  uint32_t xx, yy;
+
+  for (yy = 0; yy < h; yy++, p += w) {
+    p[0] += yy ? p[-(ptrdiff_t)w] : 0;
+    for (xx = 1; xx < w; xx++)
+      p[xx] += p[xx-1];
+  }
+}
+
+// A run of blocks deflated by one thread
+struct imgblk_slice {
+  const uint8_t           *yuyv;
+  const struct imgblk_hdr *hdr;
+  int                      level;
+  size_t                   first, last;  // blocks [first, last)
+  uint8_t                 *out;          // deflated blocks, back to back
+  size_t                  *lens;         // deflated length of each block
+  int                      err;
+  pthread_t                thread;
+  int                      running;
+};
+
+// Deflates each block of the slice on its own: its Y, Cb and Cr planes, delta
+// coded
+static void imgblk_deflate_slice(struct imgblk_slice *sl) {
+  const struct imgblk_hdr *hdr = sl->hdr;
+  z_stream  zs;
+  uint8_t  *raw, *delta, *out = sl->out;
+  uint32_t  bx, by, bw, bh, yy, mpw = hdr->w/2;
+  size_t    ii, n;
+
+  memset(&zs, 0, sizeof(zs));
+  raw = malloc(8*(size_t)hdr->side*hdr->side);
+  if (!raw || Z_OK != deflateInit(&zs, sl->level)) {
+    free(raw);
+    sl->err = 1;
+    return;
+  }
+  delta = raw + 4*(size_t)hdr->side*hdr->side;
+
+  for (ii = sl->first; ii < sl->last; ii++) {
+    imgblk_block(hdr, ii, &bx, &by, &bw, &bh);
+    n = 4*(size_t)bw*bh;
+
+    for (yy = 0; yy < bh; yy++)
+      imgblk_pack_row(raw + 2*yy*bw, raw + 2*bw*bh + yy*bw, raw + 3*bw*bh + yy*bw,
+                      sl->yuyv + 4*((size_t)(by + yy)*mpw + bx), bw, hdr->quant);
+    imgblk_delta(delta,           raw,           2*bw, bh);
+    imgblk_delta(delta + 2*bw*bh, raw + 2*bw*bh, bw,   bh);
+    imgblk_delta(delta + 3*bw*bh, raw + 3*bw*bh, bw,   bh);
+
+    zs.next_in   = delta;
+    zs.avail_in  = n;
+    zs.next_out  = out;
+    zs.avail_out = compressBound(n);
+    if (Z_STREAM_END != deflate(&zs, Z_FINISH)) {
+      sl->err = 1;
+      break;
+    }
+    sl->lens[ii - sl->first] = zs.total_out;
+    out += zs.total_out;
+    deflateReset(&zs);
+  }
+
+  deflateEnd(&zs);
+  free(raw);
+}
+
+static void * imgblk_slice_thread(void *arg) {
+  imgblk_deflate_slice(arg);
+  return NULL;
+}
+
+// Returns the deflated ImgBlk file, header and block table included
+static uint8_t * imgblk_deflate(const uint8_t *yuyv, const struct imgblk_hdr *hdr,
+                                int level, int threads, size_t *len) {
+  struct imgblk_slice *sl;
+  uint8_t             *file = NULL, *table;
+  uint32_t             bx, by, bw, bh;
+  size_t               nblocks, tlen, dlen = 0, cap, ofst, ii, jj;
+  int                  nsl, kk, err = 0;
+
+  nblocks = imgblk_nblocks(hdr);
+  tlen    = 8*(nblocks + 1);
+  nsl     = threads < 1 ? 1 : (size_t)threads > nblocks ? (int)nblocks : threads;
+
+  sl = calloc(nsl, sizeof(*sl));
+  if (!sl)
+    return NULL;
+
+  // Split the blocks evenly, each slice with room for its worst case
+  for (kk = 0; kk < nsl; kk++) {
+    sl[kk].yuyv  = yuyv;
+    sl[kk].hdr   = hdr;
+    sl[kk].level = level;
+    sl[kk].first = nblocks*kk/nsl;
+    sl[kk].last  = nblocks*(kk + 1)/nsl;
+    for (cap = 0, ii = sl[kk].first; ii < sl[kk].last; ii++) {
+      imgblk_block(hdr, ii, &bx, &by, &bw, &bh);
+      cap += compressBound(4*(size_t)bw*bh);
+    }
+    sl[kk].out  = malloc(cap);
+    sl[kk].lens = malloc((sl[kk].last - sl[kk].first)*sizeof(size_t));
+    if (!sl[kk].out || !sl[kk].lens)
+      err = 1;
+  }
+  if (err)
+    goto cleanup;
+
+  // The calling thread takes the first slice. Without a thread, a slice is
+  // just deflated in turn.
+  for (kk = 1; kk < nsl; kk++) {
+    sl[kk].running = (0 == pthread_create(&sl[kk].thread, NULL, imgblk_slice_thread, &sl[kk]));
+    if (!sl[kk].running)
+      imgblk_deflate_slice(&sl[kk]);
+  }
+  imgblk_deflate_slice(&sl[0]);
+  for (kk = 0; kk < nsl; kk++) {
+    if (sl[kk].running)
+      pthread_join(sl[kk].thread, NULL);
+    err |= sl[kk].err;
+  }
+  if (err)
+    goto cleanup;
+
+  for (kk = 0; kk < nsl; kk++)
+    for (ii = 0; ii < sl[kk].last - sl[kk].first; ii++)
+      dlen += sl[kk].lens[ii];
+
+  file = malloc(IMGBLK_HDR_LEN + tlen + dlen);
+  if (!file)
+    goto cleanup;
+
+  // Block table: where each block starts in the data after it, then the end
+  table = file + IMGBLK_HDR_LEN;
+  for (kk = 0, jj = 0, ofst = 0; kk < nsl; kk++) {
+    for (cap = 0, ii = 0; ii < sl[kk].last - sl[kk].first; ii++, jj++) {
+      put_le64(table + 8*jj, ofst + cap);
+      cap += sl[kk].lens[ii];
+    }
+    memcpy(table + tlen + ofst, sl[kk].out, cap);
+    ofst += cap;
+  }
+  put_le64(table + 8*nblocks, dlen);
+
+  *len = tlen + dlen;
+
+cleanup:
+  for (kk = 0; kk < nsl; kk++) {
+    free(sl[kk].out);
+    free(sl[kk].lens);
+  }
+  free(sl);
+  return file;
+}
+
+// Inflates block <ii> of <n> bytes from the <dlen> bytes of block table and
+// data at <data> into <raw>, and undoes the delta coding. Returns 0 if it is
+// corrupt.
+static int imgblk_inflate_block(z_stream *zs, uint8_t *raw, const uint8_t *data,
+                                size_t dlen, const struct imgblk_hdr *hdr, size_t ii) {
+  uint32_t bx, by, bw, bh;
+  size_t   tlen, start, end;
+  int      rc;
+
+  imgblk_block(hdr, ii, &bx, &by, &bw, &bh);
+  tlen  = 8*(imgblk_nblocks(hdr) + 1);
+  start = get_le64(data + 8*ii);
+  end   = get_le64(data + 8*ii + 8);
+  if (start > end || end > dlen - tlen)
+    return 0;
+
+  zs->next_in   = (Bytef *)(uintptr_t)(data + tlen + start);
+  zs->avail_in  = end - start;
+  zs->next_out  = raw;
+  zs->avail_out = 4*bw*bh;
+  rc = inflate(zs, Z_FINISH);
+  inflateReset(zs);
+  if (Z_STREAM_END != rc || zs->avail_out)
+    return 0;
+
+  imgblk_undelta(raw,           2*bw, bh);
+  imgblk_undelta(raw + 2*bw*bh, bw,   bh);
+  imgblk_undelta(raw + 3*bw*bh, bw,   bh);
+  return 1;
+}
+
+// Inverse of imgblk_deflate, for the <dlen> bytes of block table and data
+// at <data>. Returns 0 if they are corrupt.
+static int imgblk_inflate(uint8_t *yuyv, const uint8_t *data, size_t dlen,
+                          const struct imgblk_hdr *hdr) {
+  z_stream  zs;
+  uint8_t  *raw;
+  uint32_t  bx, by, bw, bh, yy, mpw = hdr->w/2;
+  size_t    nblocks, ii;
+  int       ok = 1;
+
+  nblocks = imgblk_nblocks(hdr);
+
+  memset(&zs, 0, sizeof(zs));
+  raw = malloc(4*(size_t)hdr->side*hdr->side);
+  if (!raw || Z_OK != inflateInit(&zs)) {
+    free(raw);
+    return 0;
+  }
+
+  for (ii = 0; ii < nblocks; ii++) {
+    if (!imgblk_inflate_block(&zs, raw, data, dlen, hdr, ii)) {
+      ok = 0;
+      break;
+    }
+    imgblk_block(hdr, ii, &bx, &by, &bw, &bh);
+    for (yy = 0; yy < bh; yy++)
+      imgblk_unpack_row(yuyv + 4*((size_t)(by + yy)*mpw + bx),
+                        raw + 2*yy*bw, raw + 2*bw*bh + yy*bw, raw + 3*bw*bh + yy*bw, bw);
+  }
+
+  inflateEnd(&zs);
+  free(raw);
+  return ok;
+}
+
+uint8_t * yuyv_to_imgblk_file(const uint8_t *yuyv, const struct imgblk_hdr *hdr,
+                              size_t *len) {
+  return yuyv_to_imgblk_file_z(yuyv, hdr, Z_DEFAULT_COMPRESSION, 1, len);
+}
+
+// Writes the header of an ImgBlk file with <dlen> bytes of data
+static void imgblk_put_hdr(uint8_t *file, const struct imgblk_hdr *hdr, size_t dlen) {
+  memcpy(file, "IBLK", 4);
+  put_le16(file + 4,  IMGBLK_VERSION);
+  put_le16(file + 6,  IMGBLK_HDR_LEN);
+  put_le32(file + 8,  hdr->fourcc);
+  put_le32(file + 12, hdr->w);
+  put_le32(file + 16, hdr->h);
+  put_le16(file + 20, hdr->side);
+  file[22] = hdr->quant;
+  file[23] = hdr->codec;
+  put_le64(file + 24, hdr->timestamp);
+  put_le64(file + 32, dlen);
+}
+
+uint8_t * yuyv_to_imgblk_file_z(const uint8_t *yuyv, const struct imgblk_hdr *hdr,
+                                int level, int threads, size_t *len) {
+  uint8_t *file;
+  size_t   dlen;
+
+  // Changed blocks only make sense in a stream; see imgblk_stream_frame
+  if (!imgblk_hdr_valid(hdr) || hdr->codec == IMGBLK_CODEC_CHANGED ||
+      level < Z_DEFAULT_COMPRESSION || level > 9)
+    return NULL;
+
+  if (hdr->codec == IMGBLK_CODEC_DEFLATE) {
+    file = imgblk_deflate(yuyv, hdr, level, threads, &dlen);
+  } else {
+    dlen = (size_t)hdr->w*hdr->h*2;
+    file = malloc(IMGBLK_HDR_LEN + dlen);
+    if (file)
+      imgblk_pack(file + IMGBLK_HDR_LEN, yuyv, hdr->w, hdr->h, hdr->side, hdr->quant);
+  }
+  if (!file)
+    return NULL;
+
+  imgblk_put_hdr(file, hdr, dlen);
+
+  if (len)
+    *len = IMGBLK_HDR_LEN + dlen;
+
+  return file;
+}
+
+size_t imgblk_file_hdr(const uint8_t *file, size_t len, struct imgblk_hdr *hdr) {
+  size_t   hlen;
+  uint64_t dlen;
+
+  if (len < IMGBLK_HDR_LEN || memcmp(file, "IBLK", 4) ||
+      get_le16(file + 4) != IMGBLK_VERSION)
+    return 0;
+
+  // Later revisions may add fields to the end of the header
+  hlen = get_le16(file + 6);
+  if (hlen < IMGBLK_HDR_LEN || hlen > len)
+    return 0;
+
+  hdr->fourcc    = get_le32(file + 8);
+  hdr->w         = get_le32(file + 12);
+  hdr->h         = get_le32(file + 16);
+  hdr->side      = get_le16(file + 20);
+  hdr->quant     = file[22];
+  hdr->codec     = file[23];
+  hdr->timestamp = get_le64(file + 24);
+  dlen           = get_le64(file + 32);
+
+  if (!imgblk_hdr_valid(hdr) || dlen > len - hlen)
+    return 0;
+
+  // Raw planes are always 2 bytes/pixel. Deflated ones have a block table,
+  // and changed blocks a bitmap.
+  if (hdr->codec == IMGBLK_CODEC_RAW     ? dlen != (uint64_t)hdr->w*hdr->h*2 :
+      hdr->codec == IMGBLK_CODEC_DEFLATE ? dlen < 8*(imgblk_nblocks(hdr) + 1) :
+                                           dlen < (imgblk_nblocks(hdr) + 7) / 8)
+    return 0;
+
+  return hlen;
+}
+
+uint8_t * imgblk_file_to_yuyv(const uint8_t *file, size_t len,
+                              struct imgblk_hdr *hdr) {
+  uint8_t *yuyv;
+  size_t   ofst;
+
+  // Changed blocks need the frames before them; see imgblk_stream_to_yuyv
+  ofst = imgblk_file_hdr(file, len, hdr);
+  if (!ofst || hdr->codec == IMGBLK_CODEC_CHANGED)
+    return NULL;
+
+  yuyv = malloc((size_t)hdr->w*hdr->h*2);
+  if (!yuyv)
+    return NULL;
+
+  if (hdr->codec == IMGBLK_CODEC_RAW) {
+    imgblk_unpack(yuyv, file + ofst, hdr->w, hdr->h, hdr->side);
+  } else if (!imgblk_inflate(yuyv, file + ofst, get_le64(file + 32), hdr)) {
+    free(yuyv);
+    return NULL;
+  }
+  return yuyv;
+}
+
+
+struct imgblk_reader {
+  struct imgblk_hdr  hdr;
+  const uint8_t     *data;     // block data, after the header
+  size_t             dlen;
+  void              *map;      // the file, mmap()ed
+  size_t             map_len;
+  uint8_t           *buf;      // or read into memory, if it can't be
+  z_stream           zs;
+  uint8_t           *raw;      // the last block inflated
+  size_t             raw_ii;
+  uint8_t           *line;     // one block row as YUYV, on its way to RGB
+};
+
+// Sets up reader <rd> for ImgBlk file <file> of <len> bytes
+static int imgblk_reader_init(struct imgblk_reader *rd, const uint8_t *file, size_t len) {
+  size_t ofst;
+
+  ofst = imgblk_file_hdr(file, len, &rd->hdr);
+  if (!ofst || rd->hdr.codec == IMGBLK_CODEC_CHANGED)
+    return 0;
+
+  rd->data   = file + ofst;
+  rd->dlen   = get_le64(file + 32);
+  rd->raw_ii = (size_t)-1;
+  rd->line   = malloc(4*(size_t)rd->hdr.side);
+  if (!rd->line)
+    return 0;
+
+  if (rd->hdr.codec == IMGBLK_CODEC_DEFLATE) {
+    rd->raw = malloc(4*(size_t)rd->hdr.side*rd->hdr.side);
+    if (!rd->raw || Z_OK != inflateInit(&rd->zs)) {
+      free(rd->raw);
+      rd->raw = NULL;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+struct imgblk_reader * imgblk_open(const char *fname, struct imgblk_hdr *hdr) {
+  struct imgblk_reader *rd;
+  struct stat           st;
+  size_t                len = 0;
+  int                   fd;
+
+  rd = calloc(1, sizeof(*rd));
+  if (!rd)
+    return NULL;
+
+  fd = open(fname, O_RDONLY);
+  if (0 > fd) {
+    free(rd);
+    return NULL;
+  }
+
+  // Map regular files, and let the page cache fetch only what gets decoded
+  if (0 == fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+    rd->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == rd->map) {
+      rd->map = NULL;
+    } else {
+      rd->map_len = st.st_size;
+      madvise(rd->map, rd->map_len, MADV_RANDOM);
+    }
+  }
+  close(fd);
+
+  if (!rd->map)
+    rd->buf = file_read(fname, &len);
+
+  if (rd->map ? !imgblk_reader_init(rd, rd->map, rd->map_len)
+              : !rd->buf || !imgblk_reader_init(rd, rd->buf, len)) {
+    imgblk_close(rd);
+    return NULL;
+  }
+
+  if (hdr)
+    *hdr = rd->hdr;
+
+  return rd;
+}
+
+struct imgblk_reader * imgblk_open_mem(const uint8_t *file, size_t len,
+                                       struct imgblk_hdr *hdr) {
+  struct imgblk_reader *rd;
+
+  rd = calloc(1, sizeof(*rd));
+  if (!rd)
+    return NULL;
+
+  if (!imgblk_reader_init(rd, file, len)) {
+    imgblk_close(rd);
+    return NULL;
+  }
+
+  if (hdr)
+    *hdr = rd->hdr;
+
+  return rd;
+}
+
+// Points *py, *pcb and *pcr at the Y, Cb and Cr planes of block <ii>, each
+// row after row
+static int imgblk_reader_block(struct imgblk_reader *rd, size_t ii, const uint8_t **py,
+                               const uint8_t **pcb, const uint8_t **pcr) {
+  const struct imgblk_hdr *hdr = &rd->hdr;
+  uint32_t                 bw, bh;
+  size_t                   mp;
+
+  mp = imgblk_block_mp(hdr, ii, &bw, &bh);
+
+  if (hdr->codec == IMGBLK_CODEC_RAW) {
+    *py  = rd->data + 2*mp;
+    *pcb = rd->data + (size_t)hdr->w*hdr->h + mp;
+    *pcr = *pcb + (size_t)(hdr->w/2)*hdr->h;
+    return 1;
+  }
+
+  if (rd->raw_ii != ii) {
+    rd->raw_ii = (size_t)-1;
+    if (!imgblk_inflate_block(&rd->zs, rd->raw, rd->data, rd->dlen, hdr, ii))
+      return 0;
+    rd->raw_ii = ii;
+  }
+  *py  = rd->raw;
+  *pcb = rd->raw + 2*bw*bh;
+  *pcr = rd->raw + 3*bw*bh;
+  return 1;
+}
+
+int imgblk_read(struct imgblk_reader *rd, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                enum imgblk_fmt fmt, uint8_t *dst, size_t stride) {
+  const struct imgblk_hdr *hdr = &rd->hdr;
+  const uint8_t           *py, *pcb, *pcr;
+  uint32_t                 side = hdr->side, nbx, bx, by, bw, bh, row, c0, c1;
+  uint8_t                 *out;
+  size_t                   ii, ofst;
+
+  if (!w || !h || x % 2 || w % 2 || fmt > IMGBLK_FMT_RGB24 ||
+      (uint64_t)x + w > hdr->w || (uint64_t)y + h > hdr->h)
+    return 0;
+
+  nbx = (hdr->w/2 + side - 1) / side;
+
+  // Only the blocks the rectangle touches, a block at a time
+  for (by = y - y % side; by < y + h; by += side) {
+    for (bx = x/2 - x/2 % side; bx < (x + w)/2; bx += side) {
+      ii = (size_t)(by/side)*nbx + bx/side;
+      if (!imgblk_reader_block(rd, ii, &py, &pcb, &pcr))
+        return 0;
+
+      bw = hdr->w/2 - bx < side ? hdr->w/2 - bx : side;
+      bh = hdr->h - by < side ? hdr->h - by : side;
+      c0 = x/2 > bx ? x/2 - bx : 0;
+      c1 = (x + w)/2 < bx + bw ? (x + w)/2 - bx : bw;
+
+      for (row = by > y ? by : y; row < by + bh && row < y + h; row++) {
+        ofst = (size_t)(row - by)*bw + c0;
+        out  = dst + (size_t)(row - y)*stride;
+        if (fmt == IMGBLK_FMT_YUYV) {
+          imgblk_unpack_row(out + 4*(bx + c0 - x/2), py + 2*ofst, pcb + ofst, pcr + ofst, c1 - c0);
+        } else {
+          imgblk_unpack_row(rd->line, py + 2*ofst, pcb + ofst, pcr + ofst, c1 - c0);
+          yuyv422_to_rgb24(out + 6*(bx + c0 - x/2), rd->line, 2*(c1 - c0));
         }
       }
     }
   }
-  return blk;
+  return 1;
+}
+
+void imgblk_close(struct imgblk_reader *rd) {
+  if (!rd)
+    return;
+
+  if (rd->raw)
+    inflateEnd(&rd->zs);
+  if (rd->map)
+    munmap(rd->map, rd->map_len);
+  free(rd->buf);
+  free(rd->raw);
+  free(rd->line);
+  free(rd);
+}
+
+// Sum of absolute differences of the <n> bytes at <a> and <b>, <n> at most
+// a block's Y plane
+static uint64_t imgblk_sad(const uint8_t *a, const uint8_t *b, size_t n) {
+  uint64_t sum = 0;
+  size_t   ii = 0;
+
+#if defined(__SSE2__)
+  __m128i acc = _mm_setzero_si128();
+
+  for (; ii + 16 <= n; ii += 16)
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + ii)),
+                                          _mm_loadu_si128((const __m128i *)(b + ii))));
+  sum = (uint32_t)_mm_cvtsi128_si32(acc) + (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#elif defined(__ARM_NEON)
+  uint64x2_t acc = vdupq_n_u64(0);
+
+  for (; ii + 16 <= n; ii += 16)
+    acc = vpadalq_u32(acc, vpaddlq_u16(vpaddlq_u8(vabdq_u8(vld1q_u8(a + ii),
+                                                           vld1q_u8(b + ii)))));
+  sum = vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1);
+#endif
+
+  for (; ii < n; ii++)
+    sum += a[ii] > b[ii] ? a[ii] - b[ii] : b[ii] - a[ii];
+  return sum;
+}
+
+// Where the Y, Cb and Cr samples of block <ii> are in raw planes, and how many
+// of each there are
+static void imgblk_block_runs(const struct imgblk_hdr *hdr, size_t ii,
+                              size_t ofst[3], size_t n[3]) {
+  uint32_t bw, bh;
+  size_t   mp;
+
+  mp      = imgblk_block_mp(hdr, ii, &bw, &bh);
+  ofst[0] = 2*mp;
+  ofst[1] = (size_t)hdr->w*hdr->h + mp;
+  ofst[2] = ofst[1] + (size_t)(hdr->w/2)*hdr->h;
+  n[0]    = 2*(size_t)bw*bh;
+  n[1]    = (size_t)bw*bh;
+  n[2]    = (size_t)bw*bh;
+}
+
+// Whether the samples of a block in raw planes <a> and <b> differ by more
+// than <thresh>, summed
+static int imgblk_block_differs(const uint8_t *a, const uint8_t *b, const size_t ofst[3],
+                                const size_t n[3], uint32_t thresh) {
+  uint64_t sad = 0;
+  int      kk;
+
+  for (kk = 0; kk < 3 && sad <= thresh; kk++)
+    sad += thresh ? imgblk_sad(a + ofst[kk], b + ofst[kk], n[kk])
+                  : 0 != memcmp(a + ofst[kk], b + ofst[kk], n[kk]);
+  return sad > thresh;
+}
+
+struct imgblk_stream {
+  struct imgblk_hdr  hdr;      // of the keyframes
+  uint32_t           keyint, thresh;
+  uint64_t           nframes;
+  uint8_t           *ref;      // raw planes, as a reader of the stream has them
+  uint8_t           *cur;      // raw planes of the frame being written
+  uint8_t           *map;      // the blocks of it that changed
+};
+
+struct imgblk_stream * imgblk_stream_new(const struct imgblk_hdr *hdr, uint32_t keyint,
+                                         uint32_t thresh) {
+  struct imgblk_stream *st;
+  size_t                plen;
+
+  if (!imgblk_hdr_valid(hdr) || hdr->codec == IMGBLK_CODEC_CHANGED || keyint < 1)
+    return NULL;
+
+  st = calloc(1, sizeof(*st));
+  if (!st)
+    return NULL;
+
+  plen       = (size_t)hdr->w*hdr->h*2;
+  st->hdr    = *hdr;
+  st->keyint = keyint;
+  st->thresh = thresh;
+  st->ref    = calloc(1, plen);
+  st->cur    = malloc(plen);
+  st->map    = malloc((imgblk_nblocks(hdr) + 7) / 8);
+  if (!st->ref || !st->cur || !st->map) {
+    imgblk_stream_free(st);
+    return NULL;
+  }
+  return st;
+}
+
+uint8_t * imgblk_stream_frame(struct imgblk_stream *st, const uint8_t *yuyv,
+                              uint64_t timestamp, size_t *len) {
+  struct imgblk_hdr  hdr = st->hdr;
+  uint8_t           *file, *out, *tmp;
+  size_t             nblocks, mlen, dlen, ii, ofst[3], n[3];
+  int                kk;
+
+  hdr.timestamp = timestamp;
+  nblocks       = imgblk_nblocks(&hdr);
+  mlen          = (nblocks + 7) / 8;
+
+  imgblk_pack(st->cur, yuyv, hdr.w, hdr.h, hdr.side, hdr.quant);
+
+  if (st->nframes % st->keyint == 0) {
+    // Keyframes stand alone
+    if (hdr.codec == IMGBLK_CODEC_DEFLATE) {
+      file = imgblk_deflate(yuyv, &hdr, Z_DEFAULT_COMPRESSION, 1, &dlen);
+    } else {
+      dlen = (size_t)hdr.w*hdr.h*2;
+      file = malloc(IMGBLK_HDR_LEN + dlen);
+      if (file)
+        memcpy(file + IMGBLK_HDR_LEN, st->cur, dlen);
+    }
+    if (!file)
+      return NULL;
+
+    tmp     = st->ref;
+    st->ref = st->cur;
+    st->cur = tmp;
+  } else {
+    // Others carry only the blocks that changed, which the reader then has
+    memset(st->map, 0, mlen);
+    for (dlen = mlen, ii = 0; ii < nblocks; ii++) {
+      imgblk_block_runs(&hdr, ii, ofst, n);
+      if (imgblk_block_differs(st->cur, st->ref, ofst, n, st->thresh)) {
+        st->map[ii/8] |= 1 << ii%8;
+        dlen += n[0] + n[1] + n[2];
+      }
+    }
+
+    file = malloc(IMGBLK_HDR_LEN + dlen);
+    if (!file)
+      return NULL;
+
+    memcpy(file + IMGBLK_HDR_LEN, st->map, mlen);
+    out = file + IMGBLK_HDR_LEN + mlen;
+    for (ii = 0; ii < nblocks; ii++) {
+      if (!(st->map[ii/8] & (1 << ii%8)))
+        continue;
+      imgblk_block_runs(&hdr, ii, ofst, n);
+      for (kk = 0; kk < 3; kk++) {
+        memcpy(out, st->cur + ofst[kk], n[kk]);
+        memcpy(st->ref + ofst[kk], out, n[kk]);
+        out += n[kk];
+      }
+    }
+    hdr.codec = IMGBLK_CODEC_CHANGED;
+  }
+
+  imgblk_put_hdr(file, &hdr, dlen);
+  st->nframes++;
+
+  if (len)
+    *len = IMGBLK_HDR_LEN + dlen;
+
+  return file;
+}
+
+void imgblk_stream_last(const struct imgblk_stream *st, uint8_t *yuyv) {
+  imgblk_unpack(yuyv, st->ref, st->hdr.w, st->hdr.h, st->hdr.side);
+}
+
+void imgblk_stream_free(struct imgblk_stream *st) {
+  if (!st)
+    return;
+
+  free(st->ref);
+  free(st->cur);
+  free(st->map);
+  free(st);
+}
+
+// Decodes the <dlen> bytes of data at <data> of a keyframe into raw planes
+// <planes>. Returns 0 if they are corrupt.
+static int imgblk_key_planes(uint8_t *planes, const uint8_t *data, size_t dlen,
+                             const struct imgblk_hdr *hdr) {
+  z_stream  zs;
+  uint8_t  *raw, *p;
+  size_t    nblocks, ii, ofst[3], n[3];
+  int       kk, ok = 1;
+
+  if (hdr->codec == IMGBLK_CODEC_RAW) {
+    memcpy(planes, data, dlen);
+    return 1;
+  }
+
+  nblocks = imgblk_nblocks(hdr);
+
+  memset(&zs, 0, sizeof(zs));
+  raw = malloc(4*(size_t)hdr->side*hdr->side);
+  if (!raw || Z_OK != inflateInit(&zs)) {
+    free(raw);
+    return 0;
+  }
+
+  // An inflated block holds its Y, Cb and Cr samples back to back
+  for (ii = 0; ii < nblocks && ok; ii++) {
+    ok = imgblk_inflate_block(&zs, raw, data, dlen, hdr, ii);
+    imgblk_block_runs(hdr, ii, ofst, n);
+    for (p = raw, kk = 0; kk < 3 && ok; p += n[kk], kk++)
+      memcpy(planes + ofst[kk], p, n[kk]);
+  }
+
+  inflateEnd(&zs);
+  free(raw);
+  return ok;
+}
+
+// Copies the blocks in the <dlen> bytes of data at <data> of an
+// IMGBLK_CODEC_CHANGED frame into raw planes <planes>. Returns 0 if they are
+// corrupt.
+static int imgblk_apply_changes(uint8_t *planes, const uint8_t *data, size_t dlen,
+                                const struct imgblk_hdr *hdr) {
+  size_t nblocks, pos, ii, ofst[3], n[3];
+  int    kk;
+
+  nblocks = imgblk_nblocks(hdr);
+  pos     = (nblocks + 7) / 8;
+
+  for (ii = 0; ii < nblocks; ii++) {
+    if (!(data[ii/8] & (1 << ii%8)))
+      continue;
+    imgblk_block_runs(hdr, ii, ofst, n);
+    for (kk = 0; kk < 3; kk++) {
+      if (n[kk] > dlen - pos)
+        return 0;
+      memcpy(planes + ofst[kk], data + pos, n[kk]);
+      pos += n[kk];
+    }
+  }
+  return pos == dlen;
+}
+
+uint8_t * imgblk_stream_to_yuyv(const uint8_t *stream, size_t len, size_t n,
+                                struct imgblk_hdr *hdr) {
+  struct imgblk_hdr  fh, key, ch;
+  uint8_t           *planes, *yuyv;
+  size_t             ofst, nofst, kofst = 0, hlen, ii;
+  int                have_key = 0;
+
+  // Find frame <n>, and the last keyframe at or before it
+  for (ofst = 0, ii = 0; ; ii++) {
+    hlen = imgblk_file_hdr(stream + ofst, len - ofst, &fh);
+    if (!hlen)
+      return NULL;
+    if (fh.codec != IMGBLK_CODEC_CHANGED) {
+      kofst    = ofst;
+      have_key = 1;
+    }
+    if (ii == n)
+      break;
+    ofst += hlen + get_le64(stream + ofst + 32);
+  }
+  nofst = ofst;
+  if (!have_key)
+    return NULL;
+
+  hlen   = imgblk_file_hdr(stream + kofst, len - kofst, &key);
+  planes = malloc((size_t)key.w*key.h*2);
+  yuyv   = malloc((size_t)key.w*key.h*2);
+  if (!planes || !yuyv ||
+      !imgblk_key_planes(planes, stream + kofst + hlen, get_le64(stream + kofst + 32), &key))
+    goto fail;
+
+  // Then the changes of each frame up to <n>, laid out like the keyframe
+  for (ofst = kofst + hlen + get_le64(stream + kofst + 32); ofst <= nofst; ) {
+    hlen = imgblk_file_hdr(stream + ofst, len - ofst, &ch);
+    if (ch.fourcc != key.fourcc || ch.w != key.w || ch.h != key.h ||
+        ch.side != key.side || ch.quant != key.quant ||
+        !imgblk_apply_changes(planes, stream + ofst + hlen, get_le64(stream + ofst + 32), &ch))
+      goto fail;
+    ofst += hlen + get_le64(stream + ofst + 32);
+  }
+
+  imgblk_unpack(yuyv, planes, key.w, key.h, key.side);
+  free(planes);
+  if (hdr)
+    *hdr = fh;
+  return yuyv;
+
+fail:
+  free(planes);
+  free(yuyv);
+  return NULL;
+}
+
+// Encodes raw planes <planes>, laid out as <hdr> describes, as a 4:2:2 JPEG.
+// Each plane's blocks are tiles of whole data units.
+static uint8_t * imgblk_planes_to_jpeg(const uint8_t *planes, const struct imgblk_hdr *hdr,
+                                       uint8_t qual, size_t *len) {
+  TJEPlanes  img = { 0 };
+  uint8_t   *jpeg;
+  size_t     size, jlen;
+  int        c;
+
+  img.planes[0] = planes;
+  img.planes[1] = planes + (size_t)hdr->w*hdr->h;
+  img.planes[2] = img.planes[1] + (size_t)(hdr->w/2)*hdr->h;
+  for (c = 0; c < 3; c++) {
+    img.width[c]       = c ? hdr->w/2 : hdr->w;
+    img.height[c]      = hdr->h;
+    img.tile_width[c]  = c ? hdr->side : 2*hdr->side;
+    img.tile_height[c] = hdr->side;
+  }
+
+  size = 2*(size_t)hdr->w*hdr->h;
+  jpeg = malloc(size);
+  if (!jpeg)
+    return NULL;
+
+  jlen = tje_encode_planes_to_growable_buffer(&jpeg, &size, qual, TJE_SUBSAMPLING_422, &img);
+  if (!jlen) {
+    free(jpeg);
+    return NULL;
+  }
+
+  if (len)
+    *len = jlen;
+
+  return jpeg;
+}
+
+uint8_t * imgblk2jpeg(const uint8_t *blk, uint32_t xres, uint32_t yres, uint8_t qual,
+                      size_t *len) {
+  struct imgblk_hdr hdr = { IMGBLK_FOURCC_YUYV, xres, yres, 80, IMGBLK_QUANT_MAG,
+                            IMGBLK_CODEC_RAW, 0 };
+
+  if (!imgblk_hdr_valid(&hdr))
+    return NULL;
+
+  return imgblk_planes_to_jpeg(blk, &hdr, qual, len);
+}
+
+uint8_t * imgblk_file_to_jpeg(const uint8_t *file, size_t len, uint8_t qual,
+                              struct imgblk_hdr *hdr, size_t *jlen) {
+  uint8_t *planes, *jpeg;
+  size_t   ofst, dlen;
+
+  ofst = imgblk_file_hdr(file, len, hdr);
+  if (!ofst || hdr->codec == IMGBLK_CODEC_CHANGED)
+    return NULL;
+
+  if (hdr->codec == IMGBLK_CODEC_RAW)
+    return imgblk_planes_to_jpeg(file + ofst, hdr, qual, jlen);
+
+  // Deflated blocks are inflated into raw planes first
+  dlen   = get_le64(file + 32);
+  planes = malloc((size_t)hdr->w*hdr->h*2);
+  if (!planes)
+    return NULL;
+
+  jpeg = imgblk_key_planes(planes, file + ofst, dlen, hdr) ?
+         imgblk_planes_to_jpeg(planes, hdr, qual, jlen) : NULL;
+  free(planes);
+  return jpeg;
+}
+
+
+uint8_t * file_read(const char *fname, size_t *fsize) {
+  ssize_t  rc;
+  size_t   blen, ofst;
+  uint8_t *buf;
+  int      fd, err = 0;
+
+  fd = open(fname, O_RDONLY);
+  if (0 > fd) { return NULL; }
+
+  // read up to 1 page first
+  blen = getpagesize();
+  buf  = NULL;
+  ofst = 0;
+  rc   = 1;
+
+  // read() returns bytes read, 0 on EOF, or -1 on error
+  while (rc) {
+    buf = realloc(buf, blen);
+    rc  = read(fd, buf + ofst, blen - ofst);
+    if (0 <= rc) {
+      ofst += rc;
+      // double the buffer if half or more full
+      blen *= (blen/(1+ofst) <= 1) ? 2 : 1;
+    }
+    else if (EINTR != errno) { err = 1; break; }
+  }
+
+  close(fd);
+
+  // realloc down to actual bytes read or 1 if no bytes read
+  buf = realloc(buf, ofst > 0 ? ofst : 1);
+
+  // An error occurred
+  if (err) {
+    free(buf);
+    return NULL;
+  }
+
+  if (fsize) { *fsize = ofst; }
+
+  return buf;
+}
+
+
+struct frame_reader {
+  int      fd;
+  size_t   frame_len;
+  uint8_t *map;       // a regular file, mapped copy-on-write
+  size_t   map_len;
+  size_t   ofst;      // of the next frame
+  size_t   dropped;   // bytes of the map given back so far
+  uint8_t *buf;       // or else each frame, read into here
+  int      err;       // the input ended partway through a frame, or failed
+};
+
+struct frame_reader * frame_reader_open(const char *fname, size_t frame_len) {
+  struct frame_reader *fr;
+  struct stat          st;
+
+  if (!frame_len)
+    return NULL;
+
+  fr = calloc(1, sizeof(*fr));
+  if (!fr)
+    return NULL;
+
+  fr->frame_len = frame_len;
+  fr->fd        = open(fname, O_RDONLY);
+  if (0 > fr->fd) {
+    free(fr);
+    return NULL;
+  }
+
+  // Map regular files. Private, so that frames can be converted in place.
+  if (0 == fstat(fr->fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+    fr->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fr->fd, 0);
+    if (MAP_FAILED == fr->map) {
+      fr->map = NULL;
+    } else {
+      fr->map_len = st.st_size;
+      madvise(fr->map, fr->map_len, MADV_SEQUENTIAL);
+    }
+  }
+
+  // Anything else is read a frame at a time into one page-aligned buffer
+  if (!fr->map && posix_memalign((void **)&fr->buf, getpagesize(), frame_len)) {
+    fr->buf = NULL;
+    frame_reader_close(fr);
+    return NULL;
+  }
+
+  return fr;
+}
+
+uint8_t * frame_reader_next(struct frame_reader *fr) {
+  uint8_t *frame;
+  size_t   got, drop;
+  ssize_t  rc;
+
+  if (fr->map) {
+    if (fr->map_len - fr->ofst < fr->frame_len) {
+      fr->err = fr->map_len != fr->ofst;
+      return NULL;
+    }
+
+    // Give back the pages of the frames already handed out
+    drop = fr->ofst - fr->ofst % getpagesize();
+    if (drop > fr->dropped) {
+      madvise(fr->map + fr->dropped, drop - fr->dropped, MADV_DONTNEED);
+      fr->dropped = drop;
+    }
+
+    frame     = fr->map + fr->ofst;
+    fr->ofst += fr->frame_len;
+    return frame;
+  }
+
+  // read() may return less than asked of a pipe; only a whole frame will do
+  for (got = 0; got < fr->frame_len; got += rc) {
+    rc = read(fr->fd, fr->buf + got, fr->frame_len - got);
+    if (0 > rc && EINTR == errno) {
+      rc = 0;
+    } else if (0 >= rc) {
+      fr->err = rc || got;
+      return NULL;
+    }
+  }
+  return fr->buf;
+}
+
+int frame_reader_error(const struct frame_reader *fr) {
+  return fr->err;
+}
+
+void frame_reader_close(struct frame_reader *fr) {
+  if (!fr)
+    return;
+
+  if (fr->map)
+    munmap(fr->map, fr->map_len);
+  free(fr->buf);
+  close(fr->fd);
+  free(fr);
+}
+
+
+static uint8_t ycr_to_r(uint8_t y, uint8_t cr)
+{
+  int _y = y;
+  int _cr = cr - 128;
+  int r;
+
+  // 1.403 ~= 45/32
+  r = (_y*32) + 45*_cr;
+  if (r <= 0)
+    r = 0;
+  else if (r >= 32*255)
+    r = 255;
+  else
+    r = r / 32;
+
+  return (uint8_t)r;
+}
+
+static uint8_t ycrcb_to_g(uint8_t y, uint8_t cr, uint8_t cb)
+{
+  int _y = y;
+  int _cr = cr - 128;
+  int _cb = cb - 128;
+  int g;
+
+  // 0.7169 ~= 23/32
+  // 0.3455 ~= 11/32
+  g = (_y*32) - 11*_cb - 23*_cr;
+  if (g <= 0)
+    g = 0;
+  else if (g >= 32*255)
+    g = 255;
+  else
+    g = g / 32;
+
+  return (uint8_t)g;
+}
+
+static uint8_t ycb_to_b(uint8_t y, uint8_t cb)
+{
+  int _y = y;
+  int _cb = cb - 128;
+  int b;
+
+  // 1.7790 ~= 57/32
+  b = (_y*32) + 57*_cb;
+  if (b <= 0)
+    b = 0;
+  else if (b >= 32*255)
+    b = 255;
+  else
+    b = b / 32;
+
+  return (uint8_t)b;
+}
+
+// Encode <comps>-channel image <pix> (RGB24 or 8-bit gray) to a malloc()ed
+// JPEG. The buffer starts out at 2 bytes/pixel, which only the very busiest
+// quality 3 frames exceed, and is grown by tiny_jpeg only if needed.
+static uint8_t * encode_jpeg(uint8_t *pix, int comps, uint32_t w, uint32_t h,
+                             uint8_t qual, size_t *len) {
+  uint8_t *jpeg;
+  size_t   size, jlen;
+
+  size = 2*w*h;
+  jpeg = malloc(size);
+  if (!jpeg)
+    return NULL;
+
+  jlen = tje_encode_to_growable_buffer(&jpeg, &size, qual, w, h, comps, pix);
+  if (!jlen) {
+    free(jpeg);
+    return NULL;
+  }
+
+  if (len)
+    *len = jlen;
+
+  return jpeg;
+}
+
+// Growable memory destination for tje_begin
+struct jpeg_buf {
+  uint8_t *data;
+  size_t   size, len;
+  int      err;
+};
+
+static void jpeg_buf_write(void *context, void *data, int size) {
+  struct jpeg_buf *buf = context;
+  uint8_t         *grown;
+
+  if (buf->err)
+    return;
+
+  if (buf->size - buf->len < (size_t)size) {
+    grown = realloc(buf->data, 2*buf->size + size);
+    if (!grown) {
+      buf->err = 1;
+      return;
+    }
+    buf->data = grown;
+    buf->size = 2*buf->size + size;
+  }
+
+  memcpy(buf->data + buf->len, data, size);
+  buf->len += size;
+}
+
+struct jpeg_encoder {
+  TJEEncoder *enc;
+};
+
+// JPEG-encode <comps>-channel image <pix> on the 1-100 quality scale
+static uint8_t * encode_jpeg_sized(uint8_t *pix, int comps, uint32_t w, uint32_t h,
+                                   uint8_t qual, size_t max_len, size_t *len) {
+  struct jpeg_encoder *je;
+  uint8_t             *jpeg;
+
+  je = jpeg_encoder_new(w, h, comps, qual, max_len);
+  if (!je)
+    return NULL;
+
+  jpeg = jpeg_encoder_encode(je, pix, len);
+  jpeg_encoder_free(je);
+  return jpeg;
+}
+
+
+// ----------------------------------------------------------------------------
+// Public API
+// ----------------------------------------------------------------------------
+
+struct jpeg_encoder * jpeg_encoder_new(uint32_t w, uint32_t h, int comps,
+                                      uint8_t qual, size_t max_len) {
+  struct jpeg_encoder *je;
+
+  if (comps != 1 && comps != 3)
+    return NULL;
+
+  je = malloc(sizeof(*je));
+  if (!je)
+    return NULL;
+
+  je->enc = tje_encoder_new(3, w, h, comps, TJE_SUBSAMPLING_444);
+  if (!je->enc)
+    goto err;
+
+  if (!tje_encoder_set_quality(je->enc, qual))
+    goto err;
+  if (max_len && !tje_encoder_set_target_size(je->enc, max_len, qual))
+    goto err;
+
+  // Image-specific Huffman tables: a few % smaller for one more DCT pass
+  tje_encoder_set_optimize_huffman(je->enc, 1);
+
+  return je;
+
+err:
+  jpeg_encoder_free(je);
+  return NULL;
+}
+
+uint8_t * jpeg_encoder_encode(struct jpeg_encoder *je, uint8_t *pix, size_t *len) {
+  const unsigned char *out;
+  uint8_t             *jpeg;
+  size_t               jlen;
+
+  jlen = tje_encoder_encode(je->enc, pix, &out);
+  if (!jlen)
+    return NULL;
+
+  jpeg = malloc(jlen);
+  if (!jpeg)
+    return NULL;
+  memcpy(jpeg, out, jlen);
+
+  if (len)
+    *len = jlen;
+
+  return jpeg;
+}
+
+void jpeg_encoder_free(struct jpeg_encoder *je) {
+  if (!je)
+    return;
+
+  tje_encoder_free(je->enc);
+  free(je);
+}
+
+ssize_t file_write_atomic(char *fname, uint8_t *data, size_t len) {
+  struct iovec iov;
+
+  iov.iov_base = data;
+  iov.iov_len  = len;
+
+  return file_writev_atomic(fname, &iov, 1);
+}
+
+// writev() that picks up after short writes
+static int writev_all(int fd, const struct iovec *iov, int iovcnt) {
+  const uint8_t *p;
+  size_t         skip, n;
+  ssize_t        rc;
+  int            ii;
+
+  rc = writev(fd, iov, iovcnt);
+  if (0 > rc && EINTR != errno)
+    return -1;
+
+  for (skip = rc > 0 ? rc : 0, ii = 0; ii < iovcnt; ii++) {
+    if (skip >= iov[ii].iov_len) {
+      skip -= iov[ii].iov_len;
+      continue;
+    }
+    p    = (const uint8_t *)iov[ii].iov_base + skip;
+    n    = iov[ii].iov_len - skip;
+    skip = 0;
+    while (n) {
+      rc = write(fd, p, n);
+      if (0 > rc && EINTR == errno)
+        continue;
+      if (0 > rc)
+        return -1;
+      p += rc;
+      n -= rc;
+    }
+  }
+  return 0;
 }
 
-uint8_t * imgblk2yuyv(const uint8_t *blk, uint32_t xres, uint32_t yres) {
-  uint32_t       idx, bx, by, xx, yy, npix, len;
-  uint8_t       *yuyv;
-  const uint8_t *blk_y0, *blk_y1, *blk_cb, *blk_cr;
-
-  npix   = xres*yres;
-  len    = npix*2;
-
-  blk_y0 = blk + 0;
-  blk_y1 = blk + 1;
-  blk_cb = blk + len/2;
-  blk_cr = blk + len/2 + len/4;
-  yuyv   = malloc(len);
-
-  idx = 0;
-  for (by = 0; idx < len/4; by += IMGBLK_SIDE*xres/2) {
-    for (bx = 0; bx < xres/2; bx += IMGBLK_SIDE) {
-      for (yy = 0; yy < IMGBLK_SIDE*xres/2; yy += xres/2) {
-        for (xx = 0; xx < IMGBLK_SIDE; xx++) {
-          yuyv[4*(by + bx + yy + xx)+0] = blk_y0[2*idx];
-          yuyv[4*(by + bx + yy + xx)+1] = blk_cb[idx];
-          yuyv[4*(by + bx + yy + xx)+2] = blk_y1[2*idx];
-          yuyv[4*(by + bx + yy + xx)+3] = blk_cr[idx];
-          idx++;
-        }
-      }
+ssize_t file_writev_atomic(char *fname, const struct iovec *iov, int iovcnt) {
+  static unsigned  seq;
+  char             tmp[PATH_MAX], dir[PATH_MAX], *slash;
+  int              fd = -1, ii, rc;
+  size_t           len = 0;
+
+  for (ii = 0; ii < iovcnt; ii++)
+    len += iov[ii].iov_len;
+
+  if (strlen(fname) + 32 >= sizeof(tmp))
+    return -1;
+
+#ifdef O_TMPFILE
+  // Write an unnamed file in the same directory, so a crash leaves nothing
+  // behind, then give it a temporary name
+  snprintf(dir, sizeof(dir), "%s", fname);
+  slash = strrchr(dir, '/');
+  if (!slash)
+    snprintf(dir, sizeof(dir), ".");
+  else
+    slash[slash == dir] = 0;
+
+  fd = open(dir, O_TMPFILE | O_WRONLY, S_IRUSR | S_IWUSR);
+  if (0 <= fd) {
+    if (writev_all(fd, iov, iovcnt)) {
+      close(fd);
+      return -1;
     }
+
+    snprintf(dir, sizeof(dir), "/proc/self/fd/%d", fd);
+    do {
+      snprintf(tmp, sizeof(tmp), "%s.%ld.%u", fname, (long)getpid(),
+               __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED));
+      rc = linkat(AT_FDCWD, dir, AT_FDCWD, tmp, AT_SYMLINK_FOLLOW);
+    } while (rc && EEXIST == errno);
+    close(fd);
+
+    // Without /proc to link through, fall back to a named temp file
+    fd = rc ? -1 : 0;
   }
-  return yuyv;
+#endif
+
+  // Write data to temp file, then rename to output file
+  if (0 > fd) {
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", fname);
+    fd = mkstemp(tmp);
+    if (0 > fd)
+      return -1;
+
+    rc = writev_all(fd, iov, iovcnt);
+    close(fd);
+    if (rc) {
+      unlink(tmp);
+      return -1;
+    }
+  }
+
+  if (-1 == rename(tmp, fname)) {
+    unlink(tmp);
+    return -1;
+  }
+
+  return len;
 }
 
+struct file_write {
+  char              *fname;
+  uint8_t           *data;
+  size_t             len;
+  file_writer_cb     cb;
+  void              *ctx;
+  struct file_write *next;
+};
+
+struct file_writer {
+  pthread_mutex_t    lock;
+  pthread_cond_t     work;      // a write was queued or finished, or closing
+  pthread_cond_t     idle;      // a write finished
+  struct file_write *queue;     // oldest first
+  struct file_write *busy;      // being written
+  int                queued, depth, closing, nthreads;
+  pthread_t         *threads;
+};
+
+// Ends write <job>, calling back with the bytes written or errno
+static void file_write_done(struct file_write *job, ssize_t len, int err) {
+  if (job->cb)
+    job->cb(job->ctx, job->fname, len, err);
+}
 
-uint8_t * file_read(const char *fname, size_t *fsize) {
-  ssize_t  rc;
-  size_t   blen, ofst;
-  uint8_t *buf;
-  int      fd, err = 0;
+static void file_write_free(struct file_write *job) {
+  free(job->fname);
+  free(job->data);
+  free(job);
+}
 
-  fd = open(fname, O_RDONLY);
-  if (0 > fd) { return NULL; }
+// Takes the oldest queued write to a file that isn't being written already,
+// so that writes to one file land in the order they came
+static struct file_write * file_writer_pick(struct file_writer *fw) {
+  struct file_write **pp, *job, *bb;
+
+  for (pp = &fw->queue; *pp; pp = &(*pp)->next) {
+    for (bb = fw->busy; bb && strcmp(bb->fname, (*pp)->fname); bb = bb->next);
+    if (bb)
+      continue;
+
+    job       = *pp;
+    *pp       = job->next;
+    job->next = fw->busy;
+    fw->busy  = job;
+    fw->queued--;
+    return job;
+  }
+  return NULL;
+}
 
-  // read up to 1 page first
-  blen = getpagesize();
-  buf  = NULL;
-  ofst = 0;
-  rc   = 1;
+static void * file_writer_thread(void *arg) {
+  struct file_writer  *fw = arg;
+  struct file_write   *job, **pp;
+  ssize_t              len;
+  int                  err;
 
-  // read() returns bytes read, 0 on EOF, or -1 on error
-  while (rc) {
-    buf = realloc(buf, blen);
-    rc  = read(fd, buf + ofst, blen - ofst);
-    if (0 <= rc) {
-      ofst += rc;
-      // double the buffer if half or more full
-      blen *= (blen/(1+ofst) <= 1) ? 2 : 1;
+  pthread_mutex_lock(&fw->lock);
+  for (;;) {
+    job = file_writer_pick(fw);
+    if (!job && fw->closing && !fw->queue)
+      break;
+    if (!job) {
+      pthread_cond_wait(&fw->work, &fw->lock);
+      continue;
     }
-    else if (EINTR != errno) { err = 1; break; }
+    pthread_mutex_unlock(&fw->lock);
+
+    len = file_write_atomic(job->fname, job->data, job->len);
+    err = 0 > len ? errno : 0;
+
+    // Still busy until the callback returns, so flush waits for it too
+    file_write_done(job, len, err ? err : 0 > len ? EIO : 0);
+
+    pthread_mutex_lock(&fw->lock);
+    for (pp = &fw->busy; *pp != job; pp = &(*pp)->next);
+    *pp = job->next;
+    pthread_cond_broadcast(&fw->work);
+    pthread_cond_broadcast(&fw->idle);
+    pthread_mutex_unlock(&fw->lock);
+
+    file_write_free(job);
+    pthread_mutex_lock(&fw->lock);
   }
+  pthread_mutex_unlock(&fw->lock);
+  return NULL;
+}
 
-  close(fd);
+struct file_writer * file_writer_open(int threads, int depth) {
+  struct file_writer *fw;
 
-  // realloc down to actual bytes read or 1 if no bytes read
-  buf = realloc(buf, ofst > 0 ? ofst : 1);
+  if (threads < 1 || depth < 1)
+    return NULL;
 
-  // An error occurred
-  if (err) {
-    free(buf);
+  fw = calloc(1, sizeof(*fw));
+  if (!fw)
+    return NULL;
+
+  fw->depth   = depth;
+  fw->threads = calloc(threads, sizeof(pthread_t));
+  if (!fw->threads) {
+    free(fw);
     return NULL;
   }
+  pthread_mutex_init(&fw->lock, NULL);
+  pthread_cond_init(&fw->work, NULL);
+  pthread_cond_init(&fw->idle, NULL);
 
-  if (fsize) { *fsize = ofst; }
+  // Make do with however many threads start, as long as one does
+  for (; fw->nthreads < threads; fw->nthreads++)
+    if (pthread_create(&fw->threads[fw->nthreads], NULL, file_writer_thread, fw))
+      break;
 
-  return buf;
+  if (!fw->nthreads) {
+    file_writer_close(fw);
+    return NULL;
+  }
+  return fw;
 }
 
+int file_writer_submit(struct file_writer *fw, const char *fname, uint8_t *data,
+                       size_t len, file_writer_cb cb, void *ctx) {
+  struct file_write *job, **pp, *old = NULL;
 
-static uint8_t ycr_to_r(uint8_t y, uint8_t cr)
-{
-  int _y = y;
-  int _cr = cr - 128;
-  int r;
+  job = calloc(1, sizeof(*job));
+  if (job)
+    job->fname = strdup(fname);
+  if (!job || !job->fname) {
+    free(job);
+    errno = ENOMEM;
+    return -1;
+  }
+  job->data = data;
+  job->len  = len;
+  job->cb   = cb;
+  job->ctx  = ctx;
+
+  pthread_mutex_lock(&fw->lock);
+
+  // A write to the same file that hasn't started yet would only be replaced
+  for (pp = &fw->queue; *pp && strcmp((*pp)->fname, fname); pp = &(*pp)->next);
+  if (*pp) {
+    old       = *pp;
+    job->next = old->next;
+    *pp       = job;
+  } else if (fw->queued < fw->depth && !fw->closing) {
+    *pp = job;
+    fw->queued++;
+  } else {
+    pthread_mutex_unlock(&fw->lock);
+    free(job->fname);
+    free(job);
+    errno = EAGAIN;
+    return -1;
+  }
 
-  // 1.403 ~= 45/32
-  r = (_y*32) + 45*_cr;
-  if (r <= 0)
-    r = 0;
-  else if (r >= 32*255)
-    r = 255;
-  else
-    r = r / 32;
+  pthread_cond_signal(&fw->work);
+  pthread_mutex_unlock(&fw->lock);
 
-  return (uint8_t)r;
+  if (old) {
+    file_write_done(old, -1, ECANCELED);
+    file_write_free(old);
+  }
+
+  return 0;
 }
 
-static uint8_t ycrcb_to_g(uint8_t y, uint8_t cr, uint8_t cb)
-{
-  int _y = y;
-  int _cr = cr - 128;
-  int _cb = cb - 128;
-  int g;
+void file_writer_flush(struct file_writer *fw) {
+  pthread_mutex_lock(&fw->lock);
+  while (fw->queue || fw->busy)
+    pthread_cond_wait(&fw->idle, &fw->lock);
+  pthread_mutex_unlock(&fw->lock);
+}
 
-  // 0.7169 ~= 23/32
-  // 0.3455 ~= 11/32
-  g = (_y*32) - 11*_cb - 23*_cr;
-  if (g <= 0)
-    g = 0;
-  else if (g >= 32*255)
-    g = 255;
-  else
-    g = g / 32;
+void file_writer_close(struct file_writer *fw) {
+  int ii;
 
-  return (uint8_t)g;
-}
+  if (!fw)
+    return;
 
-static uint8_t ycb_to_b(uint8_t y, uint8_t cb)
-{
-  int _y = y;
-  int _cb = cb - 128;
-  int b;
+  // The threads finish the queue before they exit
+  pthread_mutex_lock(&fw->lock);
+  fw->closing = 1;
+  pthread_cond_broadcast(&fw->work);
+  pthread_mutex_unlock(&fw->lock);
 
-  // 1.7790 ~= 57/32
-  b = (_y*32) + 57*_cb;
-  if (b <= 0)
-    b = 0;
-  else if (b >= 32*255)
-    b = 255;
-  else
-    b = b / 32;
+  for (ii = 0; ii < fw->nthreads; ii++)
+    pthread_join(fw->threads[ii], NULL);
 
-  return (uint8_t)b;
+  pthread_mutex_destroy(&fw->lock);
+  pthread_cond_destroy(&fw->work);
+  pthread_cond_destroy(&fw->idle);
+  free(fw->threads);
+  free(fw);
 }
 
-typedef struct {
-  size_t   len;
-  uint8_t *buf;
-} JBuf;
 
-// callback for tiny_jpeg that receives "chunks" of jpeg data and saves them
-// Structure keeping track of all state for a child of this silo
-static void chunk(void* ctx, void* data, int size)
-{
-  JBuf *jbuf = (JBuf*)ctx;
+struct frame_ring {
+  int      *fds;         // one per segment
+  uint32_t  nseg, cur;   // segment being filled
+  size_t    seg_len;
+  size_t    data_ofst;   // length of the index, where the frames start
+  size_t    ofst;        // of the next frame in the current segment
+  size_t    synced;      // bytes of the current segment synced so far
+  uint32_t  max_frames, nframes;
+  uint32_t  sync_every, unsynced;
+  uint64_t  seq;
+  int       direct;
+  uint8_t  *index;       // of the current segment
+  uint8_t  *buf;         // aligned copies of frames for O_DIRECT
+  size_t    buf_len;
+};
+
+static size_t frame_ring_align(size_t n) {
+  return (n + FRAME_RING_ALIGN - 1) & ~(size_t)(FRAME_RING_ALIGN - 1);
+}
 
-  // Allocate a new buffer to hold the next jpeg file chunk
-  jbuf->buf = realloc(jbuf->buf, jbuf->len + size);
-  if (jbuf) {
-    memcpy(jbuf->buf + jbuf->len, data, size); // copy new chunk
-    jbuf->len += size;
+static int pwrite_all(int fd, const uint8_t *p, size_t n, size_t ofst) {
+  ssize_t rc;
+
+  while (n) {
+    rc = pwrite(fd, p, n, ofst);
+    if (0 > rc && EINTR == errno)
+      continue;
+    if (0 >= rc)
+      return -1;
+    p    += rc;
+    n    -= rc;
+    ofst += rc;
   }
+  return 0;
 }
 
+// Gives up O_DIRECT on every segment, for a filesystem that turns it down
+static int frame_ring_nodirect(struct frame_ring *fr) {
+  uint32_t ii;
+  int      flags;
+
+  fr->direct = 0;
+  for (ii = 0; ii < fr->nseg; ii++) {
+    if (fr->fds[ii] < 0)
+      continue;
+    flags = fcntl(fr->fds[ii], F_GETFL);
+    if (0 > flags || fcntl(fr->fds[ii], F_SETFL, flags & ~O_DIRECT))
+      return -1;
+  }
+  return 0;
+}
 
-// ----------------------------------------------------------------------------
-// Public API
-// ----------------------------------------------------------------------------
-
-ssize_t file_write_atomic(char *fname, uint8_t *data, size_t len) {
-  char tmp[256];
-  int  fp;
+// pwrite_all to the current segment, retried without O_DIRECT if the
+// filesystem took the flag at open but won't do the I/O
+static int frame_ring_pwrite(struct frame_ring *fr, const uint8_t *p, size_t n,
+                             size_t ofst) {
+  if (!pwrite_all(fr->fds[fr->cur], p, n, ofst))
+    return 0;
+  if (!fr->direct || EINVAL != errno || frame_ring_nodirect(fr))
+    return -1;
+  return pwrite_all(fr->fds[fr->cur], p, n, ofst);
+}
 
-  // Write data to temp file, then rename to output file
-  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", fname);
-  mkstemp(tmp);
+// Syncs the frames written to the current segment, then its index. The
+// frames go first, so the index never lists a frame still only in memory.
+static int frame_ring_sync(struct frame_ring *fr) {
+  int fd = fr->fds[fr->cur];
 
-  if (strlen(tmp) == 0)
+  if (fr->ofst > fr->synced && fdatasync(fd))
     return -1;
 
-  fp = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-  if (fp < 0) {
-    unlink(tmp);
+  put_le32(fr->index + 8, fr->nframes);
+  if (frame_ring_pwrite(fr, fr->index, fr->data_ofst, 0) || fdatasync(fd))
     return -1;
+
+  // Keep a long recording from pushing everything else out of the page cache
+  if (!fr->direct && fr->ofst > fr->synced)
+    posix_fadvise(fd, fr->synced, fr->ofst - fr->synced, POSIX_FADV_DONTNEED);
+
+  fr->synced   = fr->ofst;
+  fr->unsynced = 0;
+  return 0;
+}
+
+// Starts filling segment <seg> afresh
+static int frame_ring_start(struct frame_ring *fr, uint32_t seg) {
+  fr->cur     = seg;
+  fr->nframes = 0;
+  fr->ofst    = fr->data_ofst;
+  fr->synced  = fr->data_ofst;
+  fr->seq++;
+
+  memset(fr->index, 0, fr->data_ofst);
+  memcpy(fr->index, "FRNG", 4);
+  put_le16(fr->index + 4,  FRAME_RING_VERSION);
+  put_le32(fr->index + 12, fr->max_frames);
+  put_le64(fr->index + 16, fr->seq);
+  put_le64(fr->index + 24, fr->data_ofst);
+
+  // The old index must be gone before its frames are overwritten
+  return frame_ring_sync(fr);
+}
+
+static void frame_ring_free(struct frame_ring *fr) {
+  uint32_t ii;
+
+  for (ii = 0; ii < fr->nseg; ii++)
+    if (fr->fds[ii] >= 0)
+      close(fr->fds[ii]);
+  free(fr->fds);
+  free(fr->index);
+  free(fr->buf);
+  free(fr);
+}
+
+struct frame_ring * frame_ring_open(const char *prefix, uint32_t nseg, size_t seg_len,
+                                    uint32_t max_frames, uint32_t sync_every,
+                                    int direct) {
+  struct frame_ring *fr;
+  struct stat        st;
+  char              *fname = NULL;
+  uint32_t           ii, newest = 0;
+  uint64_t           seq;
+  ssize_t            rc;
+  int                fd, flags;
+
+  if (!nseg || !max_frames)
+    return NULL;
+
+  fr = calloc(1, sizeof(*fr));
+  if (!fr)
+    return NULL;
+
+  fr->seg_len    = seg_len;
+  fr->max_frames = max_frames;
+  fr->sync_every = sync_every;
+  fr->direct     = direct;
+  fr->data_ofst  = frame_ring_align(FRAME_RING_HDR_LEN + (size_t)FRAME_RING_ENTRY*max_frames);
+
+  // Room for at least one frame after the index
+  if (seg_len < fr->data_ofst + FRAME_RING_ALIGN)
+    goto err;
+
+  fr->fds   = malloc(nseg*sizeof(int));
+  fname     = malloc(strlen(prefix) + 16);
+  if (!fr->fds || !fname ||
+      posix_memalign((void **)&fr->index, FRAME_RING_ALIGN, fr->data_ofst)) {
+    fr->index = NULL;
+    goto err;
+  }
+  for (; fr->nseg < nseg; fr->nseg++)
+    fr->fds[fr->nseg] = -1;
+
+  for (ii = 0; ii < nseg; ii++) {
+    sprintf(fname, "%s.%u", prefix, ii);
+
+    // Fall back to the page cache if the filesystem can't do without it
+    flags = O_RDWR | O_CREAT | (fr->direct ? O_DIRECT : 0);
+    fd    = open(fname, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (0 > fd && fr->direct && EINVAL == errno) {
+      if (frame_ring_nodirect(fr))
+        goto err;
+      fd = open(fname, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    }
+    if (0 > fd)
+      goto err;
+    fr->fds[ii] = fd;
+
+    // Every segment takes up exactly <seg_len> bytes, from the start
+    if (fstat(fd, &st) || ((size_t)st.st_size > seg_len && ftruncate(fd, seg_len)))
+      goto err;
+    if ((errno = posix_fallocate(fd, 0, seg_len)))
+      goto err;
+
+    // Find the newest segment, to carry on after it
+    rc = pread(fd, fr->index, FRAME_RING_ALIGN, 0);
+    if (0 > rc && fr->direct && EINVAL == errno) {
+      if (frame_ring_nodirect(fr))
+        goto err;
+      rc = pread(fd, fr->index, FRAME_RING_ALIGN, 0);
+    }
+    if (FRAME_RING_ALIGN == rc &&
+        !memcmp(fr->index, "FRNG", 4) &&
+        FRAME_RING_VERSION == get_le16(fr->index + 4)) {
+      seq = get_le64(fr->index + 16);
+      if (seq > fr->seq) {
+        fr->seq = seq;
+        newest  = ii;
+      }
+    }
   }
 
-  if (len != (size_t)write(fp, data, len)) {
-    close(fp);
+  if (frame_ring_start(fr, fr->seq ? (newest + 1) % nseg : 0))
+    goto err;
+
+  free(fname);
+  return fr;
+
+err:
+  free(fname);
+  frame_ring_free(fr);
+  return NULL;
+}
+
+int frame_ring_write(struct frame_ring *fr, const uint8_t *data, size_t len,
+                     uint64_t ts) {
+  size_t   slot = frame_ring_align(len);
+  uint8_t *entry;
+
+  if (len > UINT32_MAX || slot > fr->seg_len - fr->data_ofst) {
+    errno = EFBIG;
     return -1;
   }
-  close(fp);
 
-  if (-1 == rename(tmp, fname))
+  // Finish a full segment and move on to the oldest
+  if (fr->nframes == fr->max_frames || slot > fr->seg_len - fr->ofst)
+    if (frame_ring_sync(fr) || frame_ring_start(fr, (fr->cur + 1) % fr->nseg))
+      return -1;
+
+  if (fr->direct && ((uintptr_t)data % FRAME_RING_ALIGN || len != slot)) {
+    // O_DIRECT needs aligned memory and whole blocks
+    if (fr->buf_len < slot) {
+      free(fr->buf);
+      if (posix_memalign((void **)&fr->buf, FRAME_RING_ALIGN, slot)) {
+        fr->buf     = NULL;
+        fr->buf_len = 0;
+        return -1;
+      }
+      fr->buf_len = slot;
+    }
+    memcpy(fr->buf, data, len);
+    memset(fr->buf + len, 0, slot - len);
+    if (frame_ring_pwrite(fr, fr->buf, slot, fr->ofst))
+      return -1;
+  } else if (frame_ring_pwrite(fr, data, len, fr->ofst)) {
     return -1;
+  }
+
+  entry = fr->index + FRAME_RING_HDR_LEN + (size_t)FRAME_RING_ENTRY*fr->nframes;
+  put_le64(entry,      ts);
+  put_le64(entry + 8,  fr->ofst);
+  put_le32(entry + 16, len);
+  put_le32(entry + 20, 0);
+
+  fr->nframes++;
+  fr->ofst += slot;
+
+  if (fr->sync_every && ++fr->unsynced >= fr->sync_every)
+    return frame_ring_sync(fr);
+  return 0;
+}
+
+int frame_ring_close(struct frame_ring *fr) {
+  int rc;
+
+  if (!fr)
+    return 0;
+
+  rc = frame_ring_sync(fr);
+  frame_ring_free(fr);
+  return rc;
+}
+
+// Walk the marker segments of MJPEG frame <frame> up to its scan
+size_t mjpeg_check(const uint8_t *frame, size_t len, size_t *dht_off) {
+  size_t  ii = 2, seglen;
+  int     has_sof = 0, has_dht = 0;
+  uint8_t marker;
+
+  if (len < 4 || frame[0] != 0xff || frame[1] != 0xd8)
+    return 0;
+
+  for (;;) {
+    // Markers may be preceded by any number of 0xff fill bytes
+    if (ii >= len || frame[ii] != 0xff)
+      return 0;
+    while (ii < len && frame[ii] == 0xff)
+      ii++;
+    if (ii >= len)
+      return 0;
+    marker = frame[ii++];
+
+    // Standalone markers: TEM and RSTn
+    if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7))
+      continue;
+    // SOI again, or EOI before any scan
+    if (marker == 0xd8 || marker == 0xd9)
+      return 0;
+
+    if (ii + 2 > len)
+      return 0;
+    seglen = ((size_t)frame[ii] << 8) | frame[ii+1];
+    if (seglen < 2 || ii + seglen > len)
+      return 0;
+
+    if (marker == 0xc4)
+      has_dht = 1;
+    // SOFn, but not DHT, JPG or DAC
+    else if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc8 && marker != 0xcc)
+      has_sof = 1;
+    else if (marker == 0xda)
+      break;
+
+    ii += seglen;
+  }
+
+  if (!has_sof)
+    return 0;
+
+  // The scan header starts at the SOS marker, 2 bytes back; the tables go
+  // right before it if the frame has none
+  if (dht_off)
+    *dht_off = has_dht ? 0 : ii - 2;
+
+  // Drivers may pad the buffer past EOI
+  while (len > ii && frame[len-1] == 0)
+    len--;
+  if (len < ii + 2 || frame[len-2] != 0xff || frame[len-1] != 0xd9)
+    return 0;
 
   return len;
 }
 
+uint8_t * mjpeg_to_jpeg(const uint8_t *frame, size_t len, size_t *jlen) {
+  uint8_t *jpeg;
+  size_t   dht_off, dht_len;
+
+  len = mjpeg_check(frame, len, &dht_off);
+  if (!len)
+    return NULL;
+
+  dht_len = dht_off ? TJE_STANDARD_DHT_SIZE : 0;
+  jpeg = malloc(len + dht_len);
+  if (!jpeg)
+    return NULL;
+
+  if (dht_off) {
+    memcpy(jpeg, frame, dht_off);
+    tje_standard_dht(jpeg + dht_off, dht_len);
+    memcpy(jpeg + dht_off + dht_len, frame + dht_off, len - dht_off);
+  } else {
+    memcpy(jpeg, frame, len);
+  }
+
+  if (jlen)
+    *jlen = len + dht_len;
+
+  return jpeg;
+}
+
+ssize_t mjpeg_write_atomic(char *fname, const uint8_t *frame, size_t len) {
+  struct iovec iov[3];
+  uint8_t      dht[TJE_STANDARD_DHT_SIZE];
+  size_t       dht_off;
+
+  len = mjpeg_check(frame, len, &dht_off);
+  if (!len)
+    return -1;
+
+  if (!dht_off) {
+    iov[0].iov_base = (void *)(uintptr_t)frame;
+    iov[0].iov_len  = len;
+    return file_writev_atomic(fname, iov, 1);
+  }
+
+  // Splice the tables in on the way out, without copying the frame
+  tje_standard_dht(dht, sizeof(dht));
+  iov[0].iov_base = (void *)(uintptr_t)frame;
+  iov[0].iov_len  = dht_off;
+  iov[1].iov_base = dht;
+  iov[1].iov_len  = sizeof(dht);
+  iov[2].iov_base = (void *)(uintptr_t)(frame + dht_off);
+  iov[2].iov_len  = len - dht_off;
+
+  return file_writev_atomic(fname, iov, 3);
+}
+
+uint8_t * jpeg_transform(const uint8_t *jpeg, size_t len, enum jpeg_xform xform,
+                         uint32_t cx, uint32_t cy, uint32_t cw, uint32_t ch,
+                         size_t *jlen) {
+  static const int tje_xform[] = {
+    [JPEG_XFORM_NONE]       = TJE_TRANSFORM_NONE,
+    [JPEG_XFORM_FLIP_H]     = TJE_TRANSFORM_FLIP_H,
+    [JPEG_XFORM_FLIP_V]     = TJE_TRANSFORM_FLIP_V,
+    [JPEG_XFORM_TRANSPOSE]  = TJE_TRANSFORM_TRANSPOSE,
+    [JPEG_XFORM_TRANSVERSE] = TJE_TRANSFORM_TRANSVERSE,
+    [JPEG_XFORM_ROT90]      = TJE_TRANSFORM_ROT_90,
+    [JPEG_XFORM_ROT180]     = TJE_TRANSFORM_ROT_180,
+    [JPEG_XFORM_ROT270]     = TJE_TRANSFORM_ROT_270,
+  };
+  uint8_t *out = NULL;
+  size_t   size = 0, olen;
+
+  if ((unsigned)xform > JPEG_XFORM_ROT270 || (cx | cy | cw | ch) > 0xffff)
+    return NULL;
+
+  olen = tje_transform(&out, &size, jpeg, len, tje_xform[xform], cx, cy, cw, ch);
+  if (!olen) {
+    free(out);
+    return NULL;
+  }
+
+  if (jlen)
+    *jlen = olen;
+
+  return out;
+}
+
+uint8_t * jpeg_to_yuyv(const uint8_t *jpeg, size_t len, uint8_t scale,
+                       uint32_t *w, uint32_t *h) {
+  TJEDecoder   *dec;
+  TJEImageInfo  info;
+  uint8_t      *yuyv = NULL;
+  int           stride;
+
+  dec = tje_decoder_new();
+  if (!dec || !tje_decoder_parse(dec, jpeg, len, scale, &info))
+    goto cleanup;
+
+  // YUYV comes in pixel pairs
+  stride = 4 * ((info.width + 1) / 2);
+  yuyv = malloc((size_t)stride * info.height);
+  if (!yuyv)
+    goto cleanup;
+
+  if (!tje_decoder_decode(dec, TJE_DECODE_YUYV, &yuyv, &stride)) {
+    free(yuyv);
+    yuyv = NULL;
+    goto cleanup;
+  }
+
+  if (w)
+    *w = stride / 2;
+  if (h)
+    *h = info.height;
+
+cleanup:
+  tje_decoder_free(dec);
+  return yuyv;
+}
+
 // Convert YUYV422 to RGB
 void yuyv422_to_rgb24(uint8_t *rgb, uint8_t *yuyv, uint32_t npix) {
   uint32_t y, cr, cb, ii, jj;
@@ -334,50 +2445,146 @@ void yuyv422_to_rgb24(uint8_t *rgb, uint8_t *yuyv, uint32_t npix) {
   }
 }
 
+// Rows of YUYV converted to RGB at a time: a whole number of MCU rows
+#define JPEG_STRIP_ROWS 16
+
+// Starting size of the JPEG, before jpeg_buf_write grows it
+#define JPEG_BUF_START  (64*1024)
+
 // Convert YUYV422 to JPEG File-format
 uint8_t * yuyv422_to_jpeg(uint8_t *yuyv, uint32_t w, uint32_t h,
                           uint8_t qual, size_t *len) {
 
-  uint8_t *rgb;
-  JBuf     ctx = {0};
+  struct jpeg_buf  out = { 0 };
+  TJEStream       *stream;
+  uint8_t         *rgb;
+  uint32_t         row, nrows;
 
-  rgb =  malloc(3*w*h);
+  // Converted a strip at a time, so the RGB stays in cache
+  rgb = malloc(3*w*JPEG_STRIP_ROWS);
   if (!rgb)
     return 0;
 
-  // Convert to RGB first
-  yuyv422_to_rgb24(rgb, yuyv, w*h);
+  // jpeg_buf_write grows it to fit, so don't hold a frame's worth up front
+  out.size = JPEG_BUF_START;
+  out.data = malloc(out.size);
+  stream = out.data ? tje_begin(jpeg_buf_write, &out, qual, w, h, 3, TJE_SUBSAMPLING_444) : NULL;
+  if (!stream) {
+    free(out.data);
+    free(rgb);
+    return 0;
+  }
 
-  // jpeg_handler() callback mallocs fc->frame and copies jpeg to it
-  tje_encode_with_func(chunk, &ctx, qual, w, h, 3, rgb);
+  for (row = 0; row < h; row += nrows) {
+    nrows = h - row < JPEG_STRIP_ROWS ? h - row : JPEG_STRIP_ROWS;
+    yuyv422_to_rgb24(rgb, yuyv + 2*w*row, w*nrows);
+    // tje_end fails if any rows are missing
+    if (!tje_push_rows(stream, rgb, nrows) || out.err)
+      break;
+  }
 
   free(rgb);
 
+  if (!tje_end(stream) || out.err) {
+    free(out.data);
+    return 0;
+  }
+
   if (len)
-    *len = ctx.len;
+    *len = out.len;
 
-  return ctx.buf;
+  return out.data;
 }
 
 // Convert RGB24 to JPEG File-format
 uint8_t * rgb24_to_jpeg(uint8_t *rgb, uint32_t w, uint32_t h,
                         uint8_t qual, size_t *len) {
 
-  JBuf     ctx = {0};
+  if (!rgb)
+    return 0;
+
+  return encode_jpeg(rgb, 3, w, h, qual, len);
+}
+
+// Convert RGB24 to JPEG File-format, on the 1-100 quality scale
+uint8_t * rgb24_to_jpeg_sized(uint8_t *rgb, uint32_t w, uint32_t h,
+                              uint8_t qual, size_t max_len, size_t *len) {
 
   if (!rgb)
     return 0;
 
-  // jpeg_handler() callback mallocs fc->frame and copies jpeg to it
-  tje_encode_with_func(chunk, &ctx, qual, w, h, 3, rgb);
+  return encode_jpeg_sized(rgb, 3, w, h, qual, max_len, len);
+}
 
-  if (len)
-    *len = ctx.len;
+// Extract the Y plane of YUYV422: every other byte
+void yuyv422_to_y8(uint8_t *y, const uint8_t *yuyv, uint32_t npix) {
+  uint32_t ii = 0;
+
+#if defined(__SSE2__)
+  const __m128i lo = _mm_set1_epi16(0x00ff);
+
+  for (; ii + 16 <= npix; ii += 16)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i *)(yuyv + 2*ii));
+    __m128i b = _mm_loadu_si128((const __m128i *)(yuyv + 2*ii + 16));
+    a = _mm_and_si128(a, lo);
+    b = _mm_and_si128(b, lo);
+    _mm_storeu_si128((__m128i *)(y + ii), _mm_packus_epi16(a, b));
+  }
+#elif defined(__ARM_NEON)
+  for (; ii + 16 <= npix; ii += 16)
+  {
+    uint8x16x2_t v = vld2q_u8(yuyv + 2*ii);
+    vst1q_u8(y + ii, v.val[0]);
+  }
+#endif
+
+  // Leftovers, or everything without SIMD
+  for (; ii < npix; ii++)
+    y[ii] = yuyv[2*ii];
+}
+
+// Convert YUYV422 to grayscale JPEG File-format
+uint8_t * yuyv422_to_jpeg_gray(uint8_t *yuyv, uint32_t w, uint32_t h,
+                               uint8_t qual, size_t *len) {
+
+  uint8_t *y, *jpeg;
 
-  return ctx.buf;
+  y = malloc(w*h);
+  if (!y)
+    return 0;
+
+  yuyv422_to_y8(y, yuyv, w*h);
+
+  jpeg = encode_jpeg(y, 1, w, h, qual, len);
+
+  free(y);
+
+  return jpeg;
+}
+
+// Convert 8-bit grayscale to JPEG File-format
+uint8_t * y8_to_jpeg(uint8_t *y, uint32_t w, uint32_t h,
+                     uint8_t qual, size_t *len) {
+
+  if (!y)
+    return 0;
+
+  return encode_jpeg(y, 1, w, h, qual, len);
+}
+
+// Convert 8-bit grayscale to JPEG File-format, on the 1-100 quality scale
+uint8_t * y8_to_jpeg_sized(uint8_t *y, uint32_t w, uint32_t h,
+                           uint8_t qual, size_t max_len, size_t *len) {
+
+  if (!y)
+    return 0;
+
+  return encode_jpeg_sized(y, 1, w, h, qual, max_len, len);
 }
 
 
+
 void yuyv_putstr(char *str, uint32_t x, uint32_t y,
                  uint8_t *yuyv, uint32_t w, uint32_t h) {
   uint32_t xx, yy, len;
@@ -33,16 +33,185 @@
 // ----------------------------------------------------------------------------
 
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 // Converts YUYV image of byte-length <len> to ImgBlk format.
+// <xres> must be even. Uses 80-macropixel blocks and IMGBLK_QUANT_MAG, with
+// no header; see yuyv_to_imgblk_file.
 uint8_t * yuyv2imgblk(const uint8_t *yuyv, uint32_t xres, uint32_t yres);
 
 // Converts ImgBlk image of byte-length <len> to YUYV format.
+// The inverse of yuyv2imgblk.
 uint8_t * imgblk2yuyv(const uint8_t *blk, uint32_t xres, uint32_t yres);
 
+// Same as yuyv2imgblk and imgblk2yuyv, converting the image in <buf> in place,
+// with a block row of scratch instead of a second frame. Return 0 if out of
+// memory, leaving <buf> unchanged.
+int yuyv2imgblk_inplace(uint8_t *buf, uint32_t xres, uint32_t yres);
+int imgblk2yuyv_inplace(uint8_t *buf, uint32_t xres, uint32_t yres);
+
+// Converts ImgBlk image <blk>, as made by yuyv2imgblk, to JPEG File-format
+// with 4:2:2 chroma, straight from its planes. Caller must free() the
+// returned buffer. Length is returned in *len
+uint8_t * imgblk2jpeg(const uint8_t *blk, uint32_t xres, uint32_t yres, uint8_t qual,
+                      size_t *len);
+
+// ImgBlk file: a little-endian header of IMGBLK_HDR_LEN bytes, then the
+// planes. The planes hold all of the Y samples, then Cb, then Cr, each in
+// block order. Blocks are <side> YUYV macropixels (2*<side> pixels) across by
+// <side> rows, in raster order. The blocks on the right and bottom edges are
+// cut to fit, so the planes are always 2 bytes/pixel.
+//
+//   0  "IBLK"       8  fourcc      20  side         24  timestamp
+//   4  version     12  width       22  quantizer    32  data bytes
+//   6  header len  16  height      23  codec
+//
+// With IMGBLK_CODEC_DEFLATE, the data is instead a table of nblocks + 1
+// 64-bit offsets, then the blocks. Offset i is where block i starts, counting
+// from the end of the table; the last is where the final block ends. Each
+// block is one zlib stream of its Y, Cb and Cr planes in turn, every sample
+// stored as the difference from the one to its left, or, down the first
+// column, from the one above.
+//
+// An ImgBlk stream is ImgBlk files back to back, one per frame. Keyframes are
+// whole files. Other frames are IMGBLK_CODEC_CHANGED: their data is a bitmap
+// of the blocks that changed since the frame before, bit i%8 of byte i/8 for
+// block i, then the Y, Cb and Cr planes of each of those blocks in turn.
+#define IMGBLK_VERSION     2
+#define IMGBLK_HDR_LEN     40
+#define IMGBLK_MAX_SIDE    1024
+#define IMGBLK_FOURCC_YUYV 0x56595559  // Same as V4L2_PIX_FMT_YUYV
+
+enum imgblk_quant {
+  IMGBLK_QUANT_NONE,  // lossless
+  IMGBLK_QUANT_MAG,   // drops 2-3 low bits of samples far from mid-scale
+};
+
+enum imgblk_codec {
+  IMGBLK_CODEC_RAW,      // planes stored as-is
+  IMGBLK_CODEC_DEFLATE,  // blocks delta coded and deflated one by one
+  IMGBLK_CODEC_CHANGED,  // only the blocks changed since the frame before
+};
+
+struct imgblk_hdr {
+  uint32_t fourcc;     // pixel format of the source frame
+  uint32_t w, h;       // pixels; <w> even
+  uint16_t side;       // block side in macropixels and rows: a multiple of 8,
+                       // at most IMGBLK_MAX_SIDE
+  uint8_t  quant;      // enum imgblk_quant
+  uint8_t  codec;      // enum imgblk_codec
+  uint64_t timestamp;  // capture time in ns since the epoch, 0 if unknown
+};
+
+// Returns an ImgBlk file of YUYV422 image <yuyv>, laid out and quantized as
+// <hdr> describes. NULL if <hdr> is invalid. Caller must free() the returned
+// buffer. Length is returned in *len
+uint8_t * yuyv_to_imgblk_file(const uint8_t *yuyv, const struct imgblk_hdr *hdr,
+                              size_t *len);
+
+// Same as yuyv_to_imgblk_file, deflating at zlib level <level> (-1 for the
+// default, or 0-9) on up to <threads> threads, if hdr->codec is
+// IMGBLK_CODEC_DEFLATE.
+uint8_t * yuyv_to_imgblk_file_z(const uint8_t *yuyv, const struct imgblk_hdr *hdr,
+                                int level, int threads, size_t *len);
+
+// Reads and checks the header of ImgBlk file <file> of <len> bytes into *hdr.
+// Returns the offset of the planes, or 0 if <file> isn't a complete ImgBlk
+// file this version can read.
+size_t imgblk_file_hdr(const uint8_t *file, size_t len, struct imgblk_hdr *hdr);
+
+// Returns the YUYV422 image in ImgBlk file <file> of <len> bytes, and its
+// header in *hdr. NULL if the file isn't valid. Caller must free() the
+// returned buffer.
+uint8_t * imgblk_file_to_yuyv(const uint8_t *file, size_t len,
+                              struct imgblk_hdr *hdr);
+
+// Same as imgblk_file_to_yuyv, returning the image as a JPEG File with 4:2:2
+// chroma, encoded straight from the planes. Length is returned in *jlen
+uint8_t * imgblk_file_to_jpeg(const uint8_t *file, size_t len, uint8_t qual,
+                              struct imgblk_hdr *hdr, size_t *jlen);
+
+enum imgblk_fmt {
+  IMGBLK_FMT_YUYV,
+  IMGBLK_FMT_RGB24,
+};
+
+// Reads parts of an ImgBlk file, decoding only the blocks needed
+struct imgblk_reader;
+
+// Opens ImgBlk file <fname>, mapping it into memory if it is a regular file
+// or else reading it, and returns its header in *hdr. NULL if it can't be
+// read or isn't a valid ImgBlk file. Close with imgblk_close.
+struct imgblk_reader * imgblk_open(const char *fname, struct imgblk_hdr *hdr);
+
+// Same as imgblk_open, for ImgBlk file <file> of <len> bytes already in
+// memory. <file> must stay valid until imgblk_close.
+struct imgblk_reader * imgblk_open_mem(const uint8_t *file, size_t len,
+                                       struct imgblk_hdr *hdr);
+
+// Decodes the <w>x<h> pixels at <x>,<y> into <dst> as <fmt>, with rows
+// <stride> bytes apart. <x> and <w> must be even. Returns 0 if the rectangle
+// isn't within the image or the blocks it covers are corrupt.
+int imgblk_read(struct imgblk_reader *rd, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                enum imgblk_fmt fmt, uint8_t *dst, size_t stride);
+
+void imgblk_close(struct imgblk_reader *rd);
+
+// Writes an ImgBlk stream: a keyframe every <keyint> frames, and in between
+// only the blocks that differ from what a reader of the stream already has
+struct imgblk_stream;
+
+// Returns a new stream of frames laid out, quantized and, for keyframes,
+// coded as <hdr> describes. A block counts as changed when the sum of absolute
+// differences of its samples exceeds <thresh>; 0 keeps every change. NULL if
+// <hdr> is invalid. Free with imgblk_stream_free.
+struct imgblk_stream * imgblk_stream_new(const struct imgblk_hdr *hdr, uint32_t keyint,
+                                         uint32_t thresh);
+
+// Returns the next frame of stream <st> for YUYV422 image <yuyv> captured at
+// <timestamp>, to append to the frames before it. NULL if out of memory.
+// Caller must free() the returned buffer. Length is returned in *len
+uint8_t * imgblk_stream_frame(struct imgblk_stream *st, const uint8_t *yuyv,
+                              uint64_t timestamp, size_t *len);
+
+// Writes the last frame of stream <st>, as a reader of it will decode it, to
+// YUYV422 image <yuyv>.
+void imgblk_stream_last(const struct imgblk_stream *st, uint8_t *yuyv);
+
+void imgblk_stream_free(struct imgblk_stream *st);
+
+// Returns YUYV422 frame <n>, counting from 0, of ImgBlk stream <stream> of
+// <len> bytes, rebuilt from the keyframe before it, and its header in *hdr.
+// NULL if there is no such frame or the stream is corrupt. Caller must free()
+// the returned buffer.
+uint8_t * imgblk_stream_to_yuyv(const uint8_t *stream, size_t len, size_t n,
+                                struct imgblk_hdr *hdr);
+
 // Slurp an entire file, or the entire contents of a pipe until it is closed
 uint8_t * file_read(const char *fname, size_t *fsize);
 
+// Reads frames of a fixed size from a file or a pipe, one after another, for
+// converting a stream in one process
+struct frame_reader;
+
+// Opens <fname> to read frames of <frame_len> bytes, mapping it into memory if
+// it is a regular file. NULL if it can't be opened. Close with
+// frame_reader_close.
+struct frame_reader * frame_reader_open(const char *fname, size_t frame_len);
+
+// Returns the next frame, which may be changed in place and is valid until
+// the next call, always at the same page-aligned address for a pipe. NULL at
+// the end of the input, on an error, or if the last frame is cut short.
+uint8_t * frame_reader_next(struct frame_reader *fr);
+
+// Once frame_reader_next has returned NULL, nonzero if that was because the
+// input ended partway through a frame or couldn't be read, rather than
+// cleanly after a whole frame.
+int frame_reader_error(const struct frame_reader *fr);
+
+void frame_reader_close(struct frame_reader *fr);
+
 
 
 
@@ -52,6 +221,124 @@ uint8_t * file_read(const char *fname, size_t *fsize);
 // contents.
 ssize_t file_write_atomic(char *fname, uint8_t *data, size_t len);
 
+// Same as file_write_atomic, for data gathered from <iovcnt> buffers <iov>.
+ssize_t file_writev_atomic(char *fname, const struct iovec *iov, int iovcnt);
+
+// Writes files atomically on background threads, so the caller never waits
+// on the disk
+struct file_writer;
+
+// Called when a write to <fname> is done: <len> bytes written, or -1 and
+// errno <err>. Runs on a writer thread, except that a write replaced by a
+// later one to the same file before it began gets <err> ECANCELED on the
+// thread that submitted the later one, from inside file_writer_submit.
+typedef void (*file_writer_cb)(void *ctx, const char *fname, ssize_t len, int err);
+
+// Starts <threads> writer threads, with room for writes to <depth> different
+// files to wait. NULL on error. Finish with file_writer_close.
+struct file_writer * file_writer_open(int threads, int depth);
+
+// Queues <len> bytes at <data> to be written to <fname> as file_write_atomic
+// does, replacing any queued write to <fname> that hasn't begun. Writes to a
+// file land in order. Takes ownership of <data>, which must be malloc()ed,
+// and calls <cb> with <ctx> once done, unless NULL. Returns 0, or -1 with
+// errno EAGAIN, leaving <data> to the caller, if the queue is full.
+int file_writer_submit(struct file_writer *fw, const char *fname, uint8_t *data,
+                       size_t len, file_writer_cb cb, void *ctx);
+
+// Waits for every queued write to be done and its callback to have returned
+void file_writer_flush(struct file_writer *fw);
+
+// Finishes the queued writes and stops the threads
+void file_writer_close(struct file_writer *fw);
+
+// Records frames into a fixed set of segment files that are preallocated
+// once and then reused in turn, so the disk space used never changes and no
+// files are created, renamed or grown while recording.
+//
+// Segment file: a little-endian index of FRAME_RING_HDR_LEN bytes plus one
+// 24-byte entry per frame it has room for, padded to FRAME_RING_ALIGN bytes,
+// then the frames, each starting on a FRAME_RING_ALIGN boundary.
+//
+//   0  "FRNG"       8  frames held   16  sequence    32  first entry
+//   4  version     12  index room    24  data start
+//
+// Entry: 0 timestamp, 8 offset of the frame in the file, 16 bytes, 20 zero.
+// The sequence numbers the segments in the order they were filled, so the
+// one with the highest sequence is the newest. Only the frames the index
+// holds are valid; the rest of the file is left over from earlier laps. A
+// segment not yet used has no index.
+#define FRAME_RING_VERSION 1
+#define FRAME_RING_HDR_LEN 32
+#define FRAME_RING_ENTRY   24
+#define FRAME_RING_ALIGN   4096
+
+struct frame_ring;
+
+// Opens segment files "<prefix>.0" to "<prefix>.<nseg-1>", creating them and
+// preallocating each to <seg_len> bytes, with index room for <max_frames>
+// frames per segment. Recording carries on after the newest segment already
+// there. The index is written and the data synced every <sync_every> frames,
+// and whenever a segment fills; 0 syncs only when a segment fills. <direct>
+// bypasses the page cache with O_DIRECT where the filesystem allows it. NULL
+// on error. Finish with frame_ring_close.
+struct frame_ring * frame_ring_open(const char *prefix, uint32_t nseg, size_t seg_len,
+                                    uint32_t max_frames, uint32_t sync_every,
+                                    int direct);
+
+// Appends frame <data> of <len> bytes, captured at <ts> ns since the epoch,
+// moving on to the next segment, and overwriting the oldest one, when the
+// current one is full. Fastest when <data> is FRAME_RING_ALIGN-aligned. 0,
+// or -1 on error, with errno EFBIG if the frame can never fit a segment.
+int frame_ring_write(struct frame_ring *fr, const uint8_t *data, size_t len,
+                     uint64_t ts);
+
+// Writes the index, syncs and closes the segments. 0, or -1 if the last sync
+// failed.
+int frame_ring_close(struct frame_ring *fr);
+
+// Checks that MJPEG frame <frame> of <len> bytes is a complete JPEG: SOI,
+// well-formed marker segments including a frame header, a scan, and EOI.
+// Returns its length without any padding after EOI, or 0 if it is not.
+// *dht_off is 0 if the frame has Huffman tables, or else the offset at which
+// to insert them.
+size_t mjpeg_check(const uint8_t *frame, size_t len, size_t *dht_off);
+
+// Returns MJPEG frame <frame> as a standalone JPEG-file, with the standard
+// Huffman tables inserted if the frame has none. NULL if the frame is not
+// valid. Caller must free() the returned buffer. Length is returned in *jlen
+uint8_t * mjpeg_to_jpeg(const uint8_t *frame, size_t len, size_t *jlen);
+
+// Writes MJPEG frame <frame> atomically to file <fname> as a standalone
+// JPEG, as mjpeg_to_jpeg does but without copying the frame. Returns the
+// file length, or -1 if the frame is not valid or on write errors.
+ssize_t mjpeg_write_atomic(char *fname, const uint8_t *frame, size_t len);
+
+enum jpeg_xform {
+  JPEG_XFORM_NONE,       // crop only
+  JPEG_XFORM_FLIP_H,
+  JPEG_XFORM_FLIP_V,
+  JPEG_XFORM_TRANSPOSE,
+  JPEG_XFORM_TRANSVERSE,
+  JPEG_XFORM_ROT90,      // clockwise
+  JPEG_XFORM_ROT180,
+  JPEG_XFORM_ROT270,
+};
+
+// Losslessly flips or rotates JPEG <jpeg> by <xform> after cropping it to
+// <cw>x<ch> pixels at (<cx>,<cy>), without decoding it; see tje_transform.
+// Returns a malloc()ed JPEG, or NULL if the input can't be transformed.
+// Length is returned in *jlen
+uint8_t * jpeg_transform(const uint8_t *jpeg, size_t len, enum jpeg_xform xform,
+                         uint32_t cx, uint32_t cy, uint32_t cw, uint32_t ch,
+                         size_t *jlen);
+
+// Decodes JPEG or MJPEG frame <jpeg> to a malloc()ed YUYV422 image, scaled
+// down by <scale>: 1, 2, 4 or 8. The image size is returned in *w and *h,
+// with *w rounded up to even. NULL if the frame can't be decoded
+uint8_t * jpeg_to_yuyv(const uint8_t *jpeg, size_t len, uint8_t scale,
+                       uint32_t *w, uint32_t *h);
+
 // Converts YUYV422 image <yuyv> of total pixel-count <npix> into RGB24 format
 // in caller-allocated buffer <rgb> of length npix*3 bytes.
 void yuyv422_to_rgb24(uint8_t *rgb, uint8_t *yuyv, uint32_t npix);
@@ -66,6 +353,50 @@ uint8_t * yuyv422_to_jpeg(uint8_t *yuyv, uint32_t w, uint32_t h,
 uint8_t * rgb24_to_jpeg(uint8_t *rgb, uint32_t w, uint32_t h,
                         uint8_t qual, size_t *len);
 
+// Returns a JPEG-file from RGB24 image <rgb> at libjpeg-style quality <qual>
+// (1-100). If <max_len> is non-zero, the quality is lowered as needed to keep
+// the file within <max_len> bytes. Uses Huffman tables optimized for the
+// image. Caller must free() the returned buffer.
+// Length is returned in *len
+uint8_t * rgb24_to_jpeg_sized(uint8_t *rgb, uint32_t w, uint32_t h,
+                              uint8_t qual, size_t max_len, size_t *len);
+
+// Copies the luma (Y) plane of YUYV422 image <yuyv> of total pixel-count
+// <npix> into caller-allocated buffer <y> of length npix bytes.
+void yuyv422_to_y8(uint8_t *y, const uint8_t *yuyv, uint32_t npix);
+
+// Returns a grayscale JPEG-file of quality <qual> from the luma of YUYV422
+// image <yuyv>. Caller must free() the returned buffer. Length is returned
+// in *len
+uint8_t * yuyv422_to_jpeg_gray(uint8_t *yuyv, uint32_t w, uint32_t h,
+                               uint8_t qual, size_t *len);
+
+// Returns a grayscale JPEG-file of quality <qual> from 8-bit grayscale image
+// <y>. Caller must free() the returned buffer. Length is returned in *len
+uint8_t * y8_to_jpeg(uint8_t *y, uint32_t w, uint32_t h,
+                     uint8_t qual, size_t *len);
+
+// Same as rgb24_to_jpeg_sized, for 8-bit grayscale image <y>.
+uint8_t * y8_to_jpeg_sized(uint8_t *y, uint32_t w, uint32_t h,
+                           uint8_t qual, size_t max_len, size_t *len);
+
+// Encodes a run of frames of one size as rgb24_to_jpeg_sized and
+// y8_to_jpeg_sized do, carrying the size control's estimate of how big each
+// quality comes out from one frame to the next, so a stream settles on its
+// quality instead of searching for it afresh every frame.
+struct jpeg_encoder;
+
+// For <w>x<h> images of <comps> channels: 3 for RGB24, 1 for 8-bit gray. NULL
+// on error. Free with jpeg_encoder_free.
+struct jpeg_encoder * jpeg_encoder_new(uint32_t w, uint32_t h, int comps,
+                                      uint8_t qual, size_t max_len);
+
+// Returns image <pix> as a JPEG-file. Caller must free() the returned buffer.
+// Length is returned in *len
+uint8_t * jpeg_encoder_encode(struct jpeg_encoder *je, uint8_t *pix, size_t *len);
+
+void jpeg_encoder_free(struct jpeg_encoder *je);
+
 // Prints string <str> at location <str_x>,<str_y> on image <yuyv>
 // having resolution <yuyv_w> x <yuyv_h> pixels
 // Character pixel width and height